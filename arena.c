@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// blocks are only ever added, never freed before arena_destroy; a request
+// bigger than the block size gets a block of its own
+
+void arena_init(arena* scratch, size_t blockSize){
+    scratch->head = NULL;
+    scratch->current = NULL;
+    scratch->blockSize = blockSize > 0 ? blockSize : ARENA_DEFAULT_BLOCK;
+}
+
+static arenaBlock* new_block(size_t size){
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arenaBlock* block = malloc(sizeof(arenaBlock));
+    if(block == NULL) return NULL;
+    block->data = aligned_alloc(ARENA_ALIGN, size);
+    if(block->data == NULL){
+        free(block);
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void* arena_alloc(arena* scratch, size_t bytes){
+    bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(bytes == 0) bytes = ARENA_ALIGN;
+
+    // the current block, then any block a reset left behind it
+    arenaBlock* block = scratch->current;
+    while(block != NULL && block->size - block->used < bytes){
+        block = block->next;
+    }
+    if(block == NULL){
+        size_t size = bytes > scratch->blockSize ? bytes : scratch->blockSize;
+        block = new_block(size);
+        if(block == NULL){
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        // keep the list in allocation order so reset can walk it from the head
+        if(scratch->current == NULL){
+            block->next = scratch->head;
+            scratch->head = block;
+        }else{
+            block->next = scratch->current->next;
+            scratch->current->next = block;
+        }
+    }
+    scratch->current = block;
+    void* result = block->data + block->used;
+    block->used += bytes;
+    return result;
+}
+
+void* arena_calloc(arena* scratch, size_t count, size_t size){
+    void* result = arena_alloc(scratch, count * size);
+    memset(result, 0, count * size);
+    return result;
+}
+
+void arena_reset(arena* scratch){
+    for(arenaBlock* block = scratch->head; block != NULL; block = block->next){
+        block->used = 0;
+    }
+    scratch->current = scratch->head;
+}
+
+void arena_destroy(arena* scratch){
+    arenaBlock* block = scratch->head;
+    while(block != NULL){
+        arenaBlock* next = block->next;
+        free(block->data);
+        free(block);
+        block = next;
+    }
+    scratch->head = NULL;
+    scratch->current = NULL;
+}
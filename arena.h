@@ -0,0 +1,31 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 64              // cache line, so per-worker state never shares one
+#define ARENA_DEFAULT_BLOCK (1UL << 20)
+
+typedef struct arenaBlock{
+    struct arenaBlock* next;
+    size_t size;
+    size_t used;
+    unsigned char* data;
+} arenaBlock;
+
+// bump allocator for per-recovery scratch: reset rewinds every block and
+// keeps it, so a recovery that has been through one candidate allocates
+// nothing for the next
+typedef struct arena{
+    arenaBlock* head;
+    arenaBlock* current;
+    size_t blockSize;
+} arena;
+
+void arena_init(arena* scratch, size_t blockSize);
+void* arena_alloc(arena* scratch, size_t bytes);
+void* arena_calloc(arena* scratch, size_t count, size_t size);
+void arena_reset(arena* scratch);
+void arena_destroy(arena* scratch);
+
+#endif
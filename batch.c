@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "search.h"
+#include "freemap.h"
+#include "dirscan.h"
+#include "dirtree.h"
+#include "batch.h"
+#include "extract.h"
+#include "commit.h"
+#include "arena.h"
+#include "sidecar.h"
+#include "stats.h"
+
+// batch recovery (-b manifest)
+//
+// every manifest line is a request of the form name[,sha1][,contiguous|fragmented],
+// where name may be DIR/NAME.EXT. each directory the requests name is walked
+// once and each deleted entry is looked up in a hash set of the requested
+// names, keyed on DIR_Name bytes 1..10 since the first byte is lost on deletion. the recoveries are then planned in manifest order,
+// claiming clusters as they go, and every FAT update is applied together at the end.
+// what became of each request is printed in manifest order once that is known.
+// candidates are kept as (directory cluster, slot) pairs rather than pointers,
+// since a directory cluster is only pinned while it is being read.
+
+// what became of a request
+#define OUTCOME_NOT_FOUND 0
+#define OUTCOME_STOPPED 1           // the search budget ran out first
+#define OUTCOME_MULTIPLE 2
+#define OUTCOME_CONFLICT 3          // an earlier request already claimed its clusters
+#define OUTCOME_PLANNED 4
+#define OUTCOME_FAILED 5            // planned, but the extraction or the commit failed
+
+typedef struct entryLocation{
+    int cluster;            // directory cluster holding the entry
+    int index;              // slot within that cluster
+} entryLocation;
+
+typedef struct batchRequest{
+    char* name;
+    char* leaf;             // last path component of name, the name restored
+    nameKey key;            // of the last path component
+    int directory;          // cluster of the parent directory, -1 when it does not exist
+    char* shaSignature;     // hex digest from the manifest, NULL if none
+    char hash[SHA_DIGEST_LENGTH];
+    int fragmented;
+    int nextSameKey;        // next request sharing key bytes 1..10, -1 at the end
+
+    entryLocation* candidates;
+    int candidateCount;
+    int candidateCapacity;
+    int outcome;            // OUTCOME_*
+} batchRequest;
+
+typedef struct pendingRecovery{
+    entryLocation entry;
+    int request;
+    char* name;             // the leaf restored into the entry
+    int isContiguous;
+    int* chain;
+    int chainSize;
+} pendingRecovery;
+
+static uint32_t key_hash(const unsigned char* bytes){
+    // FNV-1a over DIR_Name bytes 1..10
+    uint32_t hash = 2166136261u;
+    for(int i = 1; i < 11; i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int is_hex_digest(const char* text){
+    if(strlen(text) != 2*SHA_DIGEST_LENGTH) return 0;
+    for(int i = 0; text[i] != '\0'; i++){
+        if(!isxdigit((unsigned char)text[i])) return 0;
+    }
+    return 1;
+}
+
+static char* trim(char* text){
+    while(isspace((unsigned char)*text)) text++;
+    char* end = text + strlen(text);
+    while(end > text && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return text;
+}
+
+static int parse_request(char* line, batchRequest* request){
+    // returns 0 when the line is not a valid request
+    memset(request, 0, sizeof(batchRequest));
+    request->nextSameKey = -1;
+    char* save = NULL;
+    char* field = strtok_r(line, ",", &save);
+    if(field == NULL) return 0;
+    request->name = strdup(trim(field));
+    char* slash = strrchr(request->name, '/');
+    if(!make_name_key(slash != NULL ? slash + 1 : request->name, &request->key)) return 0;
+
+    int sawMode = 0;
+    while((field = strtok_r(NULL, ",", &save)) != NULL){
+        field = trim(field);
+        if(strcmp(field, "contiguous") == 0 && !sawMode){
+            sawMode = 1;
+        }else if(strcmp(field, "fragmented") == 0 && !sawMode){
+            request->fragmented = 1;
+            sawMode = 1;
+        }else if(is_hex_digest(field) && request->shaSignature == NULL && !sawMode){
+            for(int i = 0; field[i] != '\0'; i++) field[i] = tolower((unsigned char)field[i]);
+            request->shaSignature = strdup(field);
+            input_to_hash(request->shaSignature, request->hash);
+        }else{
+            return 0;
+        }
+    }
+    // a fragmented file can only be told apart by its digest
+    return !(request->fragmented && request->shaSignature == NULL);
+}
+
+static void add_candidate(batchRequest* request, int cluster, int index){
+    if(request->candidateCount == request->candidateCapacity){
+        request->candidateCapacity = request->candidateCapacity == 0 ? 4 : request->candidateCapacity * 2;
+        request->candidates = realloc(request->candidates, sizeof(entryLocation) * request->candidateCapacity);
+    }
+    request->candidates[request->candidateCount].cluster = cluster;
+    request->candidates[request->candidateCount].index = index;
+    request->candidateCount++;
+}
+
+static int compare_clusters(const void* a, const void* b){
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+static int entry_taken(pendingRecovery* pending, int pendingCount, entryLocation entry){
+    for(int p = 0; p < pendingCount; p++){
+        if(pending[p].entry.cluster == entry.cluster && pending[p].entry.index == entry.index) return 1;
+    }
+    return 0;
+}
+
+static int run_free(freeMap* freeClusters, const struct DirEntry* entry, int clusterSize){
+    // 1 when no earlier plan has claimed a cluster of the entry's contiguous run
+    int startingCluster = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+    for(unsigned int offset = 0; offset < entry->DIR_FileSize; offset += clusterSize){
+        if(!is_cluster_free(freeClusters, startingCluster++)) return 0;
+    }
+    return 1;
+}
+
+static void print_outcome(batchRequest* request, const char* extractDir){
+    switch(request->outcome){
+        case OUTCOME_NOT_FOUND: printf("%s: file not found\n", request->name); break;
+        case OUTCOME_STOPPED: printf("%s: search stopped before a match was found\n", request->name); break;
+        case OUTCOME_MULTIPLE: printf("%s: multiple candidates found\n", request->name); break;
+        case OUTCOME_CONFLICT: printf("%s: clusters already claimed by an earlier request\n", request->name); break;
+        case OUTCOME_FAILED:
+            if(extractDir != NULL) printf("%s: extraction failed\n", request->name);
+            else printf("%s: recovery failed, image unchanged\n", request->name);
+            break;
+        default:
+            if(request->shaSignature != NULL) printf("%s: successfully recovered with SHA-1\n", request->name);
+            else printf("%s: successfully recovered\n", request->name);
+    }
+}
+
+static void claim_chain(freeMap* freeClusters, int* chain, int chainSize){
+    for(int c = 0; c < chainSize; c++){
+        mark_cluster_used(freeClusters, chain[c]);
+    }
+}
+
+static void free_requests(batchRequest* requests, int requestCount){
+    for(int r = 0; r < requestCount; r++){
+        free(requests[r].name);
+        free(requests[r].shaSignature);
+        free(requests[r].candidates);
+    }
+    free(requests);
+}
+
+void recover_batch(char* manifestPath, diskImage* disk, searchConfig* config, const char* extractDir){
+    FILE* manifest = fopen(manifestPath, "r");
+    if(manifest == NULL){
+        perror(manifestPath);
+        return;
+    }
+
+    // parse every request before touching the image
+    batchRequest* requests = NULL;
+    int requestCount = 0, requestCapacity = 0;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    int lineNumber = 0;
+    while(getline(&line, &lineCapacity, manifest) != -1){
+        lineNumber++;
+        char* text = trim(line);
+        if(text[0] == '\0' || text[0] == '#') continue;
+        if(requestCount == requestCapacity){
+            requestCapacity = requestCapacity == 0 ? 64 : requestCapacity * 2;
+            requests = realloc(requests, sizeof(batchRequest) * requestCapacity);
+        }
+        if(!parse_request(text, &requests[requestCount])){
+            fprintf(stderr, "%s:%d: invalid request\n", manifestPath, lineNumber);
+            free(line);
+            fclose(manifest);
+            // the rejected request may already hold its name and digest
+            free_requests(requests, requestCount + 1);
+            return;
+        }
+        requestCount++;
+    }
+    free(line);
+    fclose(manifest);
+
+    // open-addressing set of requested names, sized to stay under half full
+    int tableSize = 16;
+    while(tableSize < requestCount * 2) tableSize *= 2;
+    int* table = malloc(sizeof(int) * tableSize);
+    for(int t = 0; t < tableSize; t++) table[t] = -1;
+    for(int r = requestCount - 1; r >= 0; r--){
+        uint32_t slot = key_hash(requests[r].key.name) & (tableSize - 1);
+        while(table[slot] >= 0 && memcmp(requests[table[slot]].key.name + 1, requests[r].key.name + 1, 10) != 0){
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        // requests sharing a key are chained, lowest line first
+        requests[r].nextSameKey = table[slot];
+        table[slot] = r;
+    }
+
+    // one pass over each named directory matches its deleted entries against the set
+    STAT_PHASE_BEGIN(PHASE_DIR_WALK);
+    unsigned int* fat = disk_fat(disk);
+    int clusterSize = disk->clusterSize;
+    int entriesPerCluster = clusterSize / sizeof(struct DirEntry);
+    int* directories = malloc(sizeof(int) * (requestCount + 1));
+    int directoryCount = 0;
+    for(int r = 0; r < requestCount; r++){
+        if(!resolve_parent(disk, requests[r].name, &requests[r].directory, &requests[r].leaf)) requests[r].directory = -1;
+        else directories[directoryCount++] = requests[r].directory;
+    }
+    qsort(directories, directoryCount, sizeof(int), compare_clusters);
+    int distinct = 0;
+    for(int d = 0; d < directoryCount; d++){
+        if(distinct == 0 || directories[distinct-1] != directories[d]) directories[distinct++] = directories[d];
+    }
+    directoryCount = distinct;
+    if(disk->index != NULL){
+        // the sidecar lists the matching entries of each name directly
+        for(int r = 0; r < requestCount; r++){
+            if(requests[r].directory < 0) continue;
+            const sidecarEntry* first;
+            int count = sidecar_match_range(disk->index, requests[r].directory, &requests[r].key, &first);
+            for(int e = 0; e < count; e++){
+                if(first[e].name[0] == 0xE5) add_candidate(&requests[r], first[e].cluster, first[e].index);
+            }
+        }
+        directoryCount = 0;
+    }
+    for(int d = 0; d < directoryCount; d++){
+        int directory = directories[d];
+        int cluster = directory;
+        int walked = 0;
+        while(cluster >= 2 && cluster < 0x0FFFFFF7 && cluster < disk->clusterCount && walked++ < disk->clusterCount){
+            struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, cluster);
+            if(entries == NULL) break;
+            STAT_ADD(STAT_DIR_CLUSTERS, 1);
+            STAT_ADD(STAT_DIR_ENTRIES, entriesPerCluster);
+            for(int i = 0; i < entriesPerCluster; i++){
+                if(entries[i].DIR_Name[0] != 0xE5) continue;
+                uint32_t slot = key_hash(entries[i].DIR_Name) & (tableSize - 1);
+                while(table[slot] >= 0){
+                    if(memcmp(requests[table[slot]].key.name + 1, entries[i].DIR_Name + 1, 10) == 0){
+                        // the same name may be requested in other directories too
+                        for(int r = table[slot]; r >= 0; r = requests[r].nextSameKey){
+                            if(requests[r].directory == directory) add_candidate(&requests[r], cluster, i);
+                        }
+                        break;
+                    }
+                    slot = (slot + 1) & (tableSize - 1);
+                }
+            }
+            put_cluster(disk, cluster);
+            STAT_ADD(STAT_FAT_READS, 1);
+            cluster = fat[cluster] & 0x0FFFFFFF;
+        }
+    }
+    free(directories);
+    STAT_PHASE_END(PHASE_DIR_WALK);
+    free(table);
+
+    // plan every recovery in manifest order, nothing is written yet
+    freeMap* freeClusters = build_free_map(disk);
+    pendingRecovery* pending = malloc(sizeof(pendingRecovery) * (requestCount + 1));
+    int pendingCount = 0;
+    arena scratch;
+    arena_init(&scratch, ARENA_DEFAULT_BLOCK);
+    for(int r = 0; r < requestCount; r++){
+        batchRequest* request = &requests[r];
+        entryLocation target = { -1, -1 };
+        struct DirEntry targetEntry;
+        int found = 0;
+        int* resultChain = NULL;
+        int resultChainSize = 0;
+
+        for(int c = 0; c < request->candidateCount; c++){
+            entryLocation location = request->candidates[c];
+            if(entry_taken(pending, pendingCount, location)) continue;
+            // copy the entry out so the cluster need not stay pinned through the search
+            struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, location.cluster);
+            if(entries == NULL) continue;
+            struct DirEntry copied = entries[location.index];
+            struct DirEntry* fileEntry = &copied;
+            put_cluster(disk, location.cluster);
+            if(request->fragmented){
+                int startingCluster = fileEntry->DIR_FstClusHI << 16 | fileEntry->DIR_FstClusLO;
+                int counter = 0;
+                arena_reset(&scratch);
+                int* clusterList = get_candidate_clusters(freeClusters, config, startingCluster, &counter, &scratch);
+                resultChain = get_uncontinguous_block_match(disk, clusterList, counter, fileEntry->DIR_FileSize, request->hash, &resultChainSize, config, &scratch);
+                if(resultChain != NULL){
+                    target = location;
+                    targetEntry = copied;
+                    found = 1;
+                    break;
+                }
+            }else if(request->shaSignature == NULL){
+                target = location;
+                targetEntry = copied;
+                found += 1;
+            }else{
+                char hash[SHA_DIGEST_LENGTH];
+                get_contiguous_deleted_hash(disk, fileEntry, hash);
+                if(compare_hash(hash, request->hash) == 1){
+                    target = location;
+                    targetEntry = copied;
+                    found += 1;
+                }
+            }
+        }
+
+        if(found == 0 && request->fragmented && config->stopped != SEARCH_STOP_NONE){
+            request->outcome = OUTCOME_STOPPED;
+        }else if(found == 0){
+            request->outcome = OUTCOME_NOT_FOUND;
+        }else if(found > 1){
+            request->outcome = OUTCOME_MULTIPLE;
+        }else if(!request->fragmented && !run_free(freeClusters, &targetEntry, clusterSize)){
+            // two deleted entries over the same clusters, only the first request gets them
+            request->outcome = OUTCOME_CONFLICT;
+        }else{
+            request->outcome = OUTCOME_PLANNED;
+            pendingRecovery* recovery = &pending[pendingCount++];
+            recovery->entry = target;
+            recovery->request = r;
+            recovery->name = request->leaf;
+            recovery->isContiguous = !request->fragmented;
+            recovery->chain = resultChain;
+            recovery->chainSize = resultChainSize;
+            if(request->fragmented){
+                claim_chain(freeClusters, resultChain, resultChainSize);
+            }else{
+                int startingCluster = targetEntry.DIR_FstClusHI << 16 | targetEntry.DIR_FstClusLO;
+                for(unsigned int offset = 0; offset < targetEntry.DIR_FileSize; offset += clusterSize){
+                    mark_cluster_used(freeClusters, startingCluster++);
+                }
+            }
+        }
+    }
+    destroy_free_map(freeClusters);
+    arena_destroy(&scratch);
+
+    // commit: every directory entry and FAT update in one transaction, or every file written out with -x
+    diskTransaction txn;
+    begin_transaction(&txn, disk);
+    for(int p = 0; p < pendingCount; p++){
+        entryLocation location = pending[p].entry;
+        struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, location.cluster);
+        struct DirEntry* entry = &entries[location.index];
+        if(extractDir != NULL){
+            char* path = requests[pending[p].request].name;
+            int extracted = pending[p].isContiguous ? extract_contiguous(disk, entry, path, extractDir)
+                          : extract_chain(disk, pending[p].chain, pending[p].chainSize, entry->DIR_FileSize, path, extractDir);
+            if(!extracted) requests[pending[p].request].outcome = OUTCOME_FAILED;
+            free(pending[p].chain);
+        }else if(pending[p].isContiguous){
+            undelete_file(&txn, location.cluster, location.index, entry, pending[p].name);
+        }else{
+            undelete_uncontiguous_file(&txn, location.cluster, location.index, entry, pending[p].name, pending[p].chain, pending[p].chainSize);
+            free(pending[p].chain);
+        }
+        put_cluster(disk, location.cluster);
+    }
+    if(extractDir == NULL && pendingCount > 0 && commit_transaction(&txn) < 0){
+        for(int p = 0; p < pendingCount; p++) requests[pending[p].request].outcome = OUTCOME_FAILED;
+    }
+    abort_transaction(&txn);
+    free(pending);
+
+    for(int r = 0; r < requestCount; r++){
+        print_outcome(&requests[r], extractDir);
+    }
+
+    free_requests(requests, requestCount);
+}
@@ -0,0 +1,9 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "search.h"
+#include "diskio.h"
+
+void recover_batch(char* manifestPath, diskImage* disk, searchConfig* config, const char* extractDir);
+
+#endif
@@ -0,0 +1,154 @@
+#!/bin/bash
+# recovery benchmark (make bench)
+#
+# builds each workload below with mkimage in a scratch directory, then times
+# -l, one -b of every deleted file, every -r of a deleted contiguous file and
+# every -R of a deleted fragmented one. results go to stdout (or $BENCH_OUT)
+# as one JSON object per line: a "workload" record with the generator
+# parameters, one record per run, and a "summary" record per workload and mode. runs carry the
+# --stats=json report of nyufile when it was built with STATS=1.
+#
+#   BENCH_DIR      scratch directory (default: a fresh mktemp -d, removed afterwards)
+#   BENCH_OUT      results file (default: stdout)
+#   BENCH_FILTER   only run workloads whose name matches this regex
+#   BENCH_ARGS     extra nyufile options for every -r/-R run, e.g. "-t 4" or "--io pread"
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+NYUFILE=${NYUFILE:-$here/nyufile}
+MKIMAGE=${MKIMAGE:-$here/mkimage}
+BENCH_FILTER=${BENCH_FILTER:-.}
+BENCH_ARGS=${BENCH_ARGS:-}
+
+if [ -n "${BENCH_DIR:-}" ]; then
+    work=$BENCH_DIR
+    mkdir -p "$work"
+else
+    work=$(mktemp -d)
+    trap 'rm -rf "$work"' EXIT
+fi
+if [ -n "${BENCH_OUT:-}" ]; then
+    exec > "$BENCH_OUT"
+fi
+
+# name and mkimage arguments; every workload has a fixed seed so runs are repeatable
+workloads=(
+    "contiguous     -c 4096 -n 16384 -f 200 -s 1-32768 -p contiguous -d 0.5 -e 200 -S 1"
+    "large-dir      -c 512 -n 65536 -f 1000 -s 1-4096 -p contiguous -d 0.3 -e 8000 -D 4 -S 2"
+    "interleaved    -c 1024 -n 8192 -f 32 -s 1000-6000 -p interleaved -d 1 -S 3"
+    "reversed       -c 1024 -n 8192 -f 32 -s 1000-6000 -p reversed -d 1 -S 4"
+    "random-window  -c 512 -n 8192 -f 24 -s 600-2500 -p random -w 10 -d 1 -S 5"
+    "random-text    -c 2048 -n 8192 -f 16 -s 2000-9000 -p random -w 8 -d 1 -k text -S 6"
+    # 64 KB clusters, out of spec; FILE0028 is deleted and crosses the first 64 MB mmap window
+    "large-cluster  -c 65536 -n 2048 -f 40 -s 1000000-4000000 -p contiguous -d 0.5 -S 1"
+)
+
+json_string(){
+    local text=${1//\\/\\\\}
+    printf '"%s"' "${text//\"/\\\"}"
+}
+
+# run_timed: sets elapsed (ns), output and stats for one nyufile invocation
+run_timed(){
+    local start end
+    start=$(date +%s%N)
+    output=$("$NYUFILE" "$@" --stats=json 2> "$work/stats.json")
+    end=$(date +%s%N)
+    elapsed=$((end - start))
+    stats=$(grep -m1 '^{' "$work/stats.json")
+    stats=${stats:-null}
+}
+
+# stat_value: one counter from the last stats report, 0 when not built in
+stat_value(){
+    local value
+    value=$(grep -o "\"$1\":[0-9]*" <<< "$stats" | cut -d: -f2)
+    echo "${value:-0}"
+}
+
+for workload in "${workloads[@]}"; do
+    read -r name args <<< "$workload"
+    [[ $name =~ $BENCH_FILTER ]] || continue
+    image=$work/$name.img
+    manifest=$work/$name.man
+    # shellcheck disable=SC2086
+    if ! "$MKIMAGE" -o "$image" -m "$manifest" $args; then
+        echo "bench: could not build $name" >&2
+        exit 1
+    fi
+    printf '{"type":"workload","workload":"%s","args":%s,"bytes":%s}\n' \
+        "$name" "$(json_string "$args")" "$(stat -c %s "$image")"
+
+    declare -A count=() total=() failed=() nodes=() hashed=()
+    record(){
+        local mode=$1 target=$2 status=$3
+        printf '{"type":"run","workload":"%s","mode":"%s","target":%s,"status":"%s","wall_ns":%s,"stats":%s}\n' \
+            "$name" "$mode" "$(json_string "$target")" "$status" "$elapsed" "$stats"
+        count[$mode]=$(( ${count[$mode]:-0} + 1 ))
+        total[$mode]=$(( ${total[$mode]:-0} + elapsed ))
+        nodes[$mode]=$(( ${nodes[$mode]:-0} + $(stat_value search_nodes) ))
+        hashed[$mode]=$(( ${hashed[$mode]:-0} + $(stat_value sha_bytes) ))
+        [ "$status" = recovered ] || [ "$mode" = -l ] || failed[$mode]=$(( ${failed[$mode]:-0} + 1 ))
+    }
+
+    run_timed "$image" -l
+    record -l "" listed
+
+    # every deleted file in one -b run on a copy, names under a directory as DIR/NAME.EXT;
+    # each restored short name must then be back in a live entry, 0xE5 no longer in front
+    batch=$work/$name.batch
+    restored=$work/$name.names
+    : > "$batch"
+    : > "$restored"
+    while read -r path size start state layout sha chain; do
+        [ "$state" = deleted ] || continue
+        echo "${path#/},$sha,$layout" >> "$batch"
+        leaf=${path##*/}
+        base=${leaf%.*}
+        extension=${leaf#"$base"}
+        printf '%-8s%-3s\n' "$base" "${extension#.}" >> "$restored"
+    done < "$manifest"
+    if [ -s "$batch" ]; then
+        cp "$image" "$image.b"
+        # shellcheck disable=SC2086
+        run_timed "$image.b" -b "$batch" $BENCH_ARGS
+        requested=$(wc -l < "$batch")
+        if [ "$(grep -c "successfully recovered" <<< "$output")" -ne "$requested" ]; then
+            status=not-found
+        elif [ "$(grep -a -o -F -f "$restored" "$image.b" | sort -u | wc -l)" -ne "$(sort -u "$restored" | wc -l)" ]; then
+            status=misnamed
+        else
+            status=recovered
+        fi
+        record -b "${batch##*/}" "$status"
+        rm -f "$image.b"
+    fi
+
+    while read -r path size start state layout sha chain; do
+        [ "$state" = deleted ] || continue
+        target=${path#/}
+        if [ "$layout" = contiguous ]; then
+            # shellcheck disable=SC2086
+            run_timed "$image" -r "$target" -s "$sha" $BENCH_ARGS
+            mode=-r
+        else
+            # shellcheck disable=SC2086
+            run_timed "$image" -R "$target" -s "$sha" $BENCH_ARGS
+            mode=-R
+        fi
+        case $output in
+            *"successfully recovered"*) status=recovered ;;
+            *"multiple candidates"*) status=ambiguous ;;
+            *) status=not-found ;;
+        esac
+        record "$mode" "$target" "$status"
+    done < "$manifest"
+
+    for mode in -l -b -r -R; do
+        [ -n "${count[$mode]:-}" ] || continue
+        printf '{"type":"summary","workload":"%s","mode":"%s","runs":%s,"failed":%s,"wall_ns_total":%s,"search_nodes":%s,"sha_bytes":%s}\n' \
+            "$name" "$mode" "${count[$mode]}" "${failed[$mode]:-0}" "${total[$mode]}" "${nodes[$mode]}" "${hashed[$mode]}"
+    done
+    unset count total failed nodes hashed
+    rm -f "$image"
+done
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "fatscan.h"
+#include "carve.h"
+#include "stats.h"
+
+// signature carving over free clusters (-C outdir)
+//
+// a file always starts on a cluster boundary, so headers are only matched at
+// offset 0 of each free cluster: the first byte selects the signatures that
+// can start there and only those are compared. from a header the file is
+// followed through consecutive free clusters until its footer, or for
+// SQLite until the size recorded in its header.
+//
+// the free runs of the FAT are cut into chunks that workers claim in turn.
+// the extents they find are merged in cluster order, extents starting inside
+// an earlier one are dropped, and the survivors are written out in parallel.
+
+#define CARVE_CHUNK 1024
+#define FOOTER_MAX 8
+#define NOT_FOUND UINT64_MAX
+
+#define CARVE_FOOTER 0              // ends right after the footer
+#define CARVE_PDF 1                 // footer plus an optional line ending
+#define CARVE_ZIP 2                 // footer is the end-of-central-directory record
+#define CARVE_SQLITE 3              // length from page size and page count
+
+typedef struct carveSignature{
+    const char* extension;
+    const char* header;
+    int headerLength;
+    const char* footer;
+    int footerLength;
+    int kind;
+    uint64_t maxBytes;
+    int next;                       // next signature with the same first header byte
+} carveSignature;
+
+static carveSignature signatures[] = {
+    { "jpg", "\xFF\xD8\xFF", 3, "\xFF\xD9", 2, CARVE_FOOTER, 32UL << 20, -1 },
+    { "png", "\x89PNG\r\n\x1A\n", 8, "IEND\xAE\x42\x60\x82", 8, CARVE_FOOTER, 32UL << 20, -1 },
+    { "pdf", "%PDF-", 5, "%%EOF", 5, CARVE_PDF, CARVE_MAX_BYTES, -1 },
+    { "zip", "PK\x03\x04", 4, "PK\x05\x06", 4, CARVE_ZIP, CARVE_MAX_BYTES, -1 },
+    { "sqlite", "SQLite format 3\0", 16, NULL, 0, CARVE_SQLITE, CARVE_MAX_BYTES, -1 },
+};
+
+#define SIGNATURE_COUNT ((int)(sizeof(signatures) / sizeof(signatures[0])))
+
+static int headerIndex[256];
+
+typedef struct carveList{
+    carvedFile* items;
+    int count;
+    int capacity;
+} carveList;
+
+typedef struct carveShared{
+    diskImage* disk;
+    fatScan* scan;
+    int clusterSize;
+    const char* outDir;
+
+    fatExtent* chunks;
+    int chunkCount;
+    atomic_int nextChunk;
+
+    carvedFile* kept;
+    int keptCount;
+    atomic_int nextWrite;
+} carveShared;
+
+typedef struct carveWorker{
+    int id;
+    pthread_t thread;
+    int started;
+    carveShared* shared;
+    carveList found;
+} carveWorker;
+
+
+static void build_header_index(void){
+    for(int b = 0; b < 256; b++) headerIndex[b] = -1;
+    for(int s = SIGNATURE_COUNT - 1; s >= 0; s--){
+        unsigned char first = (unsigned char)signatures[s].header[0];
+        signatures[s].next = headerIndex[first];
+        headerIndex[first] = s;
+    }
+}
+
+static int match_header(const unsigned char* data, int length){
+    for(int s = headerIndex[data[0]]; s >= 0; s = signatures[s].next){
+        if(signatures[s].headerLength <= length && memcmp(data, signatures[s].header, signatures[s].headerLength) == 0){
+            return s;
+        }
+    }
+    return -1;
+}
+
+static int cluster_free(carveShared* shared, int cluster){
+    if(cluster < 2 || cluster >= shared->scan->clusterCount) return 0;
+    return (shared->scan->freeBits[cluster >> 6] >> (cluster & 63)) & 1;
+}
+
+static int read_span(carveShared* shared, int start, uint64_t offset, unsigned char* out, int length){
+    // length bytes at offset into a file starting at start; every cluster touched must be free
+    int clusterSize = shared->clusterSize;
+    while(length > 0){
+        int cluster = start + (int)(offset / clusterSize);
+        int within = (int)(offset % clusterSize);
+        int take = clusterSize - within < length ? clusterSize - within : length;
+        if(!cluster_free(shared, cluster)) return 0;
+        char* data = get_cluster(shared->disk, cluster);
+        if(data == NULL) return 0;
+        memcpy(out, data + within, take);
+        put_cluster(shared->disk, cluster);
+        out += take;
+        offset += take;
+        length -= take;
+    }
+    return 1;
+}
+
+static uint64_t find_footer(carveShared* shared, int start, const carveSignature* signature){
+    // offset of the first footer within the free clusters following start
+    int clusterSize = shared->clusterSize;
+    int footerLength = signature->footerLength;
+    unsigned char carry[FOOTER_MAX];
+    unsigned char joint[2 * FOOTER_MAX];
+    int carried = 0;
+    uint64_t offset = 0;
+    for(int cluster = start; offset < signature->maxBytes && cluster_free(shared, cluster); cluster++){
+        if(cluster_in_hole(shared->disk, cluster)){
+            // every footer ends in a nonzero byte, so none ends inside a hole
+            carried = footerLength - 1;
+            memset(carry, 0, carried);
+            offset += clusterSize;
+            continue;
+        }
+        unsigned char* data = (unsigned char*)get_cluster(shared->disk, cluster);
+        if(data == NULL) break;
+        if(carried > 0){
+            // a footer split across the cluster boundary
+            memcpy(joint, carry, carried);
+            memcpy(joint + carried, data, footerLength - 1);
+            unsigned char* hit = memmem(joint, carried + footerLength - 1, signature->footer, footerLength);
+            if(hit != NULL){
+                put_cluster(shared->disk, cluster);
+                return offset - carried + (uint64_t)(hit - joint);
+            }
+        }
+        unsigned char* hit = memmem(data, clusterSize, signature->footer, footerLength);
+        if(hit != NULL){
+            put_cluster(shared->disk, cluster);
+            return offset + (uint64_t)(hit - data);
+        }
+        carried = footerLength - 1;
+        memcpy(carry, data + clusterSize - carried, carried);
+        put_cluster(shared->disk, cluster);
+        offset += clusterSize;
+    }
+    return NOT_FOUND;
+}
+
+static uint64_t carve_length(carveShared* shared, int start, const carveSignature* signature){
+    // bytes to carve from start, 0 when the file cannot be delimited
+    if(signature->kind == CARVE_SQLITE){
+        unsigned char header[32];
+        if(!read_span(shared, start, 0, header, sizeof(header))) return 0;
+        uint64_t pageSize = (uint64_t)header[16] << 8 | header[17];
+        if(pageSize == 1) pageSize = 65536;
+        uint64_t pageCount = (uint64_t)header[28] << 24 | (uint64_t)header[29] << 16 | (uint64_t)header[30] << 8 | header[31];
+        if(pageSize < 512 || (pageSize & (pageSize - 1)) != 0 || pageCount == 0) return 0;
+        uint64_t length = pageSize * pageCount;
+        if(length > signature->maxBytes) return 0;
+        for(uint64_t offset = 0; offset < length; offset += shared->clusterSize){
+            if(!cluster_free(shared, start + (int)(offset / shared->clusterSize))) return 0;
+        }
+        return length;
+    }
+
+    uint64_t footer = find_footer(shared, start, signature);
+    if(footer == NOT_FOUND) return 0;
+    uint64_t length = footer + signature->footerLength;
+    if(signature->kind == CARVE_ZIP){
+        // the record is 22 bytes followed by its comment
+        unsigned char record[22];
+        if(!read_span(shared, start, footer, record, sizeof(record))) return 0;
+        length = footer + sizeof(record) + (record[20] | record[21] << 8);
+    }else if(signature->kind == CARVE_PDF){
+        unsigned char ending[2];
+        if(read_span(shared, start, length, ending, 1) && (ending[0] == '\r' || ending[0] == '\n')){
+            length += 1;
+            if(ending[0] == '\r' && read_span(shared, start, length, ending + 1, 1) && ending[1] == '\n') length += 1;
+        }
+    }
+    return length;
+}
+
+static void add_found(carveList* list, int cluster, int signature, uint64_t length){
+    if(list->count == list->capacity){
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->items = realloc(list->items, sizeof(carvedFile) * list->capacity);
+    }
+    list->items[list->count].cluster = cluster;
+    list->items[list->count].signature = signature;
+    list->items[list->count].length = length;
+    list->count += 1;
+}
+
+static void* scan_worker(void* arg){
+    carveWorker* worker = (carveWorker*)arg;
+    carveShared* shared = worker->shared;
+    int chunk;
+    while((chunk = atomic_fetch_add(&shared->nextChunk, 1)) < shared->chunkCount){
+        fatExtent extent = shared->chunks[chunk];
+        advise_clusters(shared->disk, extent.start, extent.length, DISK_ADVICE_SEQUENTIAL);
+        int end = extent.start + extent.length;
+        for(int cluster = extent.start; cluster < end; cluster++){
+            // no header starts with a zero byte, so holes are stepped over unread
+            cluster = next_data_cluster(shared->disk, cluster, end);
+            if(cluster == end) break;
+            unsigned char* data = (unsigned char*)get_cluster(shared->disk, cluster);
+            if(data == NULL) continue;
+            int signature = match_header(data, shared->clusterSize);
+            put_cluster(shared->disk, cluster);
+            if(signature < 0) continue;
+            uint64_t length = carve_length(shared, cluster, &signatures[signature]);
+            if(length > 0) add_found(&worker->found, cluster, signature, length);
+        }
+    }
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+void carved_file_name(const carvedFile* candidate, char* name, size_t size){
+    snprintf(name, size, "f%08d.%s", candidate->cluster, signatures[candidate->signature].extension);
+}
+
+static void write_candidate(carveShared* shared, carvedFile* candidate){
+    char name[32];
+    carved_file_name(candidate, name, sizeof(name));
+    char* path = malloc(strlen(shared->outDir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", shared->outDir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        perror(path);
+        free(path);
+        return;
+    }
+    uint64_t remaining = candidate->length;
+    for(int cluster = candidate->cluster; remaining > 0; cluster++){
+        char* data = get_cluster(shared->disk, cluster);
+        if(data == NULL) break;
+        size_t length = remaining < (uint64_t)shared->clusterSize ? (size_t)remaining : (size_t)shared->clusterSize;
+        size_t written = 0;
+        while(written < length){
+            ssize_t put = write(fd, data + written, length - written);
+            if(put < 0 && errno == EINTR) continue;
+            if(put <= 0) break;
+            written += (size_t)put;
+        }
+        put_cluster(shared->disk, cluster);
+        if(written < length){
+            perror(path);
+            break;
+        }
+        remaining -= length;
+    }
+    close(fd);
+    free(path);
+}
+
+static void* write_worker(void* arg){
+    carveWorker* worker = (carveWorker*)arg;
+    carveShared* shared = worker->shared;
+    int index;
+    while((index = atomic_fetch_add(&shared->nextWrite, 1)) < shared->keptCount){
+        write_candidate(shared, &shared->kept[index]);
+    }
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+static void run_workers(carveWorker* workers, int workerCount, void* (*body)(void*)){
+    for(int w = 1; w < workerCount; w++){
+        workers[w].started = pthread_create(&workers[w].thread, NULL, body, &workers[w]) == 0;
+    }
+    body(&workers[0]);
+    for(int w = 1; w < workerCount; w++){
+        if(workers[w].started) pthread_join(workers[w].thread, NULL);
+    }
+}
+
+static int compare_candidates(const void* one, const void* two){
+    return ((const carvedFile*)one)->cluster - ((const carvedFile*)two)->cluster;
+}
+
+static void find_files(carveShared* shared, carveWorker* workers, int workerCount){
+    // fills shared->kept with the delimited files in cluster order
+    diskImage* disk = shared->disk;
+    build_header_index();
+    shared->scan = scan_fat(disk, FAT_SCAN_FREE_BITS | FAT_SCAN_FREE_RUNS);
+    shared->clusterSize = disk->clusterSize;
+
+    // cut the free runs into chunks small enough to balance over the workers
+    shared->chunkCount = 0;
+    for(int r = 0; r < shared->scan->freeRunCount; r++){
+        shared->chunkCount += (shared->scan->freeRuns[r].length + CARVE_CHUNK - 1) / CARVE_CHUNK;
+    }
+    shared->chunks = malloc(sizeof(fatExtent) * (shared->chunkCount + 1));
+    int chunkCounter = 0;
+    for(int r = 0; r < shared->scan->freeRunCount; r++){
+        fatExtent run = shared->scan->freeRuns[r];
+        for(int offset = 0; offset < run.length; offset += CARVE_CHUNK){
+            shared->chunks[chunkCounter].start = run.start + offset;
+            shared->chunks[chunkCounter].length = run.length - offset < CARVE_CHUNK ? run.length - offset : CARVE_CHUNK;
+            chunkCounter++;
+        }
+    }
+    atomic_init(&shared->nextChunk, 0);
+
+    for(int w = 0; w < workerCount; w++){
+        workers[w].id = w;
+        workers[w].shared = shared;
+        workers[w].started = 0;
+        workers[w].found.items = NULL;
+        workers[w].found.count = 0;
+        workers[w].found.capacity = 0;
+    }
+    STAT_PHASE_BEGIN(PHASE_SEARCH);
+    run_workers(workers, workerCount, scan_worker);
+    STAT_PHASE_END(PHASE_SEARCH);
+
+    // merge in cluster order, dropping anything that starts inside an earlier file
+    int total = 0;
+    for(int w = 0; w < workerCount; w++) total += workers[w].found.count;
+    carvedFile* all = malloc(sizeof(carvedFile) * (total + 1));
+    int counter = 0;
+    for(int w = 0; w < workerCount; w++){
+        if(workers[w].found.count > 0) memcpy(all + counter, workers[w].found.items, sizeof(carvedFile) * workers[w].found.count);
+        counter += workers[w].found.count;
+        free(workers[w].found.items);
+    }
+    qsort(all, total, sizeof(carvedFile), compare_candidates);
+    shared->keptCount = 0;
+    uint64_t coveredUntil = 0;
+    for(int i = 0; i < total; i++){
+        if((uint64_t)all[i].cluster < coveredUntil) continue;
+        all[shared->keptCount++] = all[i];
+        coveredUntil = all[i].cluster + (all[i].length + shared->clusterSize - 1) / shared->clusterSize;
+    }
+    shared->kept = all;
+    free(shared->chunks);
+    destroy_fat_scan(shared->scan);
+}
+
+int find_carved_files(diskImage* disk, int workerCount, carvedFile** files){
+    // the files -C would write, in cluster order, without writing them; *files is malloc'd
+    carveShared shared;
+    shared.disk = disk;
+    shared.outDir = NULL;
+    carveWorker* workers = malloc(sizeof(carveWorker) * workerCount);
+    find_files(&shared, workers, workerCount);
+    free(workers);
+    *files = shared.kept;
+    return shared.keptCount;
+}
+
+void carve_free_clusters(diskImage* disk, const char* outDir, int workerCount){
+    if(mkdir(outDir, 0755) < 0 && errno != EEXIST){
+        perror(outDir);
+        return;
+    }
+    carveShared shared;
+    shared.disk = disk;
+    shared.outDir = outDir;
+    carveWorker* workers = malloc(sizeof(carveWorker) * workerCount);
+    find_files(&shared, workers, workerCount);
+    carvedFile* all = shared.kept;
+
+    atomic_init(&shared.nextWrite, 0);
+    run_workers(workers, workerCount, write_worker);
+
+    for(int i = 0; i < shared.keptCount; i++){
+        char name[32];
+        carved_file_name(&shared.kept[i], name, sizeof(name));
+        printf("%s (size = %llu, starting cluster = %d)\n", name, (unsigned long long)shared.kept[i].length, shared.kept[i].cluster);
+    }
+    printf("Total number of carved files = %d\n", shared.keptCount);
+
+    free(all);
+    free(workers);
+}
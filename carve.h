@@ -0,0 +1,22 @@
+#ifndef CARVE_H
+#define CARVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "diskio.h"
+
+#define CARVE_MAX_BYTES (64UL << 20)   // longest file followed when no footer shows up
+
+// a delimited file in consecutive free clusters
+typedef struct carvedFile{
+    int cluster;
+    int signature;
+    uint64_t length;
+} carvedFile;
+
+void carve_free_clusters(diskImage* disk, const char* outDir, int workerCount);
+int find_carved_files(diskImage* disk, int workerCount, carvedFile** files);
+void carved_file_name(const carvedFile* file, char* name, size_t size);
+
+#endif
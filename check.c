@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "fatscan.h"
+#include "dirtree.h"
+#include "commit.h"
+#include "check.h"
+#include "stats.h"
+
+// FAT consistency check (-c), and the pre-flight check of a recovery
+//
+// three parallel passes. the FAT is cut into shards that workers claim in
+// turn: every link sets the in-degree bits of the cluster it points at (one
+// link, or more than one). the directory tree is then walked by the usual
+// worker pool, and every live entry follows its own chain, claiming each
+// cluster in the ownership map with a compare-and-swap: a cluster some other
+// entry already holds is a cross-link, one this entry holds is a loop. a
+// second pass over the shards counts allocated clusters nobody owns and
+// collects those no link points at, the heads of lost chains, which are
+// followed in cluster order at the end. with -r, -R or -b the same maps
+// are built first, and the commit refuses any cluster that is allocated,
+// linked to, or the start of a live file.
+
+typedef struct problemList{
+    checkProblem* items;
+    int count;
+    int capacity;
+} problemList;
+
+typedef struct entryList{
+    checkEntry* items;
+    int count;
+    int capacity;
+} entryList;
+
+typedef struct checkWorker{
+    int id;
+    pthread_t thread;
+    int started;
+    struct checkShared* shared;
+    problemList problems;
+    entryList entries;
+    int* heads;
+    int headCount;
+    int headCapacity;
+    int used;
+    int bad;
+    int owned;
+    int lost;
+} checkWorker;
+
+typedef struct checkShared{
+    volumeCheck* check;
+    checkWorker* workers;
+    int workerCount;
+    int shardCount;
+    void (*shard)(checkWorker* worker, int first, int last);
+} checkShared;
+
+
+static int test_bit(_Atomic uint64_t* bits, int cluster){
+    return (atomic_load_explicit(&bits[cluster >> 6], memory_order_relaxed) >> (cluster & 63)) & 1;
+}
+
+static int set_bit(_Atomic uint64_t* bits, int cluster){
+    // returns the bit as it was
+    uint64_t bit = 1ULL << (cluster & 63);
+    return (atomic_fetch_or_explicit(&bits[cluster >> 6], bit, memory_order_relaxed) & bit) != 0;
+}
+
+static void add_problem(checkWorker* worker, int kind, int cluster, int first, int second, int length, int expected){
+    problemList* list = &worker->problems;
+    if(list->count == list->capacity){
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->items = realloc(list->items, sizeof(checkProblem) * list->capacity);
+    }
+    list->items[list->count++] = (checkProblem){ kind, cluster, first, second, length, expected };
+}
+
+static void add_entry(checkWorker* worker, int id, char* path, unsigned int size){
+    entryList* list = &worker->entries;
+    if(list->count == list->capacity){
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->items = realloc(list->items, sizeof(checkEntry) * list->capacity);
+    }
+    list->items[list->count++] = (checkEntry){ id, path, size };
+}
+
+
+// FAT shards
+
+static void link_shard(checkWorker* worker, int first, int last){
+    volumeCheck* check = worker->shared->check;
+    for(int c = first; c < last; c++){
+        unsigned int value = check->fat[c] & FAT_ENTRY_MASK;
+        if(value == 0) continue;
+        worker->used += 1;
+        if(value == FAT_BAD_CLUSTER){
+            worker->bad += 1;
+        }else if(value >= FAT_EOC_MIN){
+            continue;
+        }else if(value < 2 || value >= (unsigned int)check->clusterCount){
+            add_problem(worker, CHECK_BAD_LINK, c, 0, 0, 0, 0);
+        }else if(set_bit(check->linked, (int)value)){
+            set_bit(check->linkedTwice, (int)value);
+        }
+    }
+    STAT_ADD(STAT_FAT_READS, last - first);
+}
+
+static void orphan_shard(checkWorker* worker, int first, int last){
+    volumeCheck* check = worker->shared->check;
+    for(int c = first; c < last; c++){
+        if(test_bit(check->linkedTwice, c) && !test_bit(check->crossed, c)){
+            add_problem(worker, CHECK_FAT_CROSS_LINK, c, 0, 0, 0, 0);
+        }
+        unsigned int value = check->fat[c] & FAT_ENTRY_MASK;
+        if(value == 0 || value == FAT_BAD_CLUSTER || atomic_load_explicit(&check->owner[c], memory_order_relaxed) != 0) continue;
+        worker->lost += 1;
+        if(test_bit(check->linked, c)) continue;
+        if(worker->headCount == worker->headCapacity){
+            worker->headCapacity = worker->headCapacity == 0 ? 64 : worker->headCapacity * 2;
+            worker->heads = realloc(worker->heads, sizeof(int) * worker->headCapacity);
+        }
+        worker->heads[worker->headCount++] = c;
+    }
+    STAT_ADD(STAT_FAT_READS, last - first);
+}
+
+static void* shard_worker(void* arg){
+    checkWorker* worker = (checkWorker*)arg;
+    checkShared* shared = worker->shared;
+    int shard;
+    while((shard = atomic_fetch_add(&shared->check->nextShard, 1)) < shared->shardCount){
+        int first = shard * CHECK_SHARD;
+        int last = first + CHECK_SHARD;
+        if(first < 2) first = 2;
+        if(last > shared->check->clusterCount) last = shared->check->clusterCount;
+        shared->shard(worker, first, last);
+    }
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+static void run_shards(checkShared* shared, void (*shard)(checkWorker*, int, int)){
+    shared->shard = shard;
+    atomic_store(&shared->check->nextShard, 0);
+    checkWorker* workers = shared->workers;
+    for(int w = 1; w < shared->workerCount; w++){
+        workers[w].started = pthread_create(&workers[w].thread, NULL, shard_worker, &workers[w]) == 0;
+    }
+    shard_worker(&workers[0]);
+    for(int w = 1; w < shared->workerCount; w++){
+        if(workers[w].started) pthread_join(workers[w].thread, NULL);
+    }
+}
+
+
+// live chains
+
+static void follow_chain(checkWorker* worker, int id, int start, int expected){
+    // claims the chain of entry id; expected is its length in clusters, -1 for a directory
+    volumeCheck* check = worker->shared->check;
+    int length = 0;
+    int cluster = start;
+    if(start == 0){
+        if(expected > 0) add_problem(worker, CHECK_SIZE, 0, id, 0, 0, expected);
+        return;
+    }
+    while(1){
+        if(cluster < 2 || cluster >= check->clusterCount){
+            add_problem(worker, CHECK_BROKEN, cluster, id, 0, length, 0);
+            return;
+        }
+        unsigned int value = check->fat[cluster] & FAT_ENTRY_MASK;
+        STAT_ADD(STAT_FAT_READS, 1);
+        if(value == 0 || value == FAT_BAD_CLUSTER){
+            add_problem(worker, CHECK_BROKEN, cluster, id, 0, length, 0);
+            return;
+        }
+        int holder = 0;
+        if(!atomic_compare_exchange_strong(&check->owner[cluster], &holder, id)){
+            if(holder == id){
+                add_problem(worker, CHECK_LOOP, cluster, id, 0, length, 0);
+            }else{
+                add_problem(worker, CHECK_CROSS_LINK, cluster, holder, id, 0, 0);
+                set_bit(check->crossed, cluster);
+            }
+            return;
+        }
+        worker->owned += 1;
+        length += 1;
+        if(value >= FAT_EOC_MIN) break;
+        cluster = (int)value;
+    }
+    if(expected >= 0 && length != expected){
+        add_problem(worker, CHECK_SIZE, start, id, 0, length, expected);
+    }
+}
+
+static void check_visit(void* arg, int worker, const char* dirPath, const entryPlace* place, struct DirEntry* entry){
+    (void)place;
+    checkShared* shared = (checkShared*)arg;
+    volumeCheck* check = shared->check;
+    // deleted entries own nothing, "." and ".." are their directories' own chains
+    if(entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.') return;
+
+    char name[13];
+    format_entry_name(entry, name);
+    char* path = malloc(strlen(dirPath) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dirPath, name);
+    int id = atomic_fetch_add(&check->nextId, 1);
+    add_entry(&shared->workers[worker], id, path, entry->DIR_FileSize);
+
+    int start = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+    if(start >= 2 && start < check->clusterCount) set_bit(check->started, start);
+    int expected = -1;
+    if(!(entry->DIR_Attr & 0x10)){
+        expected = (int)(((uint64_t)entry->DIR_FileSize + check->clusterSize - 1) / check->clusterSize);
+    }
+    follow_chain(&shared->workers[worker], id, start, expected);
+}
+
+static void follow_lost_chains(volumeCheck* check, checkWorker* worker){
+    // in cluster order, so a chain joining an earlier one stops where they meet
+    for(int h = 0; h < check->headCount; h++){
+        int length = 0;
+        int cluster = check->heads[h];
+        while(cluster >= 2 && cluster < check->clusterCount){
+            unsigned int value = check->fat[cluster] & FAT_ENTRY_MASK;
+            if(value == 0 || value == FAT_BAD_CLUSTER || atomic_load_explicit(&check->owner[cluster], memory_order_relaxed) != 0) break;
+            if((check->reached[cluster >> 6] >> (cluster & 63)) & 1) break;
+            check->reached[cluster >> 6] |= 1ULL << (cluster & 63);
+            length += 1;
+            if(value >= FAT_EOC_MIN) break;
+            cluster = (int)value;
+        }
+        add_problem(worker, CHECK_LOST, check->heads[h], 0, 0, length, 0);
+    }
+}
+
+
+// report
+
+static volumeCheck* sortCheck;      // qsort has no context argument
+
+static const char* entry_path(volumeCheck* check, int id){
+    return id > 0 && id < check->entryCount ? check->entries[id].path : "?";
+}
+
+static int compare_problems(const void* one, const void* two){
+    const checkProblem* x = (const checkProblem*)one;
+    const checkProblem* y = (const checkProblem*)two;
+    if(x->kind != y->kind) return x->kind - y->kind;
+    if(x->cluster != y->cluster) return x->cluster < y->cluster ? -1 : 1;
+    return strcmp(entry_path(sortCheck, x->first), entry_path(sortCheck, y->first));
+}
+
+static int compare_ints(const void* one, const void* two){
+    int x = *(const int*)one;
+    int y = *(const int*)two;
+    return (x > y) - (x < y);
+}
+
+static int cross_linked(volumeCheck* check, int id){
+    // which entry of a cross-link got further is a race, so neither one's size is judged
+    for(int p = 0; p < check->problemCount && check->problems[p].kind == CHECK_CROSS_LINK; p++){
+        if(check->problems[p].first == id || check->problems[p].second == id) return 1;
+    }
+    return 0;
+}
+
+static int print_problem(volumeCheck* check, checkProblem* problem){
+    // returns 0 when the problem is not worth reporting
+    const char* first = entry_path(check, problem->first);
+    switch(problem->kind)
+    {
+        case CHECK_CROSS_LINK: {
+            const char* second = entry_path(check, problem->second);
+            if(strcmp(first, second) > 0){
+                const char* swap = first;
+                first = second;
+                second = swap;
+            }
+            printf("Cross-linked cluster %d: %s and %s\n", problem->cluster, first, second);
+            break;
+        }
+        case CHECK_FAT_CROSS_LINK:
+            printf("Cross-linked cluster %d: more than one FAT entry points at it\n", problem->cluster);
+            break;
+        case CHECK_LOOP:
+            printf("Loop in %s at cluster %d\n", first, problem->cluster);
+            break;
+        case CHECK_BROKEN: {
+            const char* reason = "outside the volume";
+            if(problem->cluster >= 2 && problem->cluster < check->clusterCount){
+                reason = (check->fat[problem->cluster] & FAT_ENTRY_MASK) == 0 ? "free" : "bad";
+            }
+            printf("Broken chain: %s runs into %s cluster %d\n", first, reason, problem->cluster);
+            break;
+        }
+        case CHECK_BAD_LINK:
+            printf("FAT entry of cluster %d points outside the volume\n", problem->cluster);
+            break;
+        case CHECK_SIZE:
+            if(cross_linked(check, problem->first)) return 0;
+            printf("Size mismatch: %s (size = %u, %d clusters expected, chain has %d)\n", first,
+                   check->entries[problem->first].size, problem->expected, problem->length);
+            break;
+        case CHECK_LOST:
+            printf("Lost chain at cluster %d (%d clusters)\n", problem->cluster, problem->length);
+            break;
+    }
+    return 1;
+}
+
+static void print_report(volumeCheck* check){
+    int total = 0;
+    for(int p = 0; p < check->problemCount; p++){
+        total += print_problem(check, &check->problems[p]);
+    }
+    int onLostChains = 0;
+    for(int p = 0; p < check->problemCount; p++){
+        if(check->problems[p].kind == CHECK_LOST) onLostChains += check->problems[p].length;
+    }
+    if(check->lostCount > onLostChains){
+        printf("Lost clusters on loops = %d\n", check->lostCount - onLostChains);
+        total += 1;
+    }
+
+    // the free count the commit keeps up to date
+    struct BootEntry* boot = &check->disk->boot;
+    int freeCount = check->clusterCount - 2 - check->usedCount;
+    FSInfo info;
+    if(boot->BPB_FSInfo != 0 && boot->BPB_FSInfo < boot->BPB_RsvdSecCnt
+       && read_disk(check->disk, (uint64_t)boot->BPB_FSInfo * boot->BPB_BytsPerSec, &info, sizeof(FSInfo)) == 0
+       && info.FSI_LeadSig == FSINFO_LEAD_SIG && info.FSI_StrucSig == FSINFO_STRUC_SIG
+       && info.FSI_Free_Count != FSINFO_UNKNOWN && info.FSI_Free_Count != (unsigned int)freeCount){
+        printf("FSInfo free count = %u, FAT has %d free\n", info.FSI_Free_Count, freeCount);
+        total += 1;
+    }
+    printf("Clusters = %d, used = %d, free = %d, bad = %d, owned = %d, lost = %d\n", check->clusterCount - 2,
+           check->usedCount, freeCount, check->badCount, check->ownedCount, check->lostCount);
+    printf("Total number of problems = %d\n", total);
+}
+
+
+volumeCheck* check_volume(diskImage* disk, int workerCount){
+    // builds the ownership and in-degree maps and prints what is wrong with the volume
+    volumeCheck* check = calloc(1, sizeof(volumeCheck));
+    check->disk = disk;
+    check->fat = disk_fat(disk);
+    check->clusterCount = disk->clusterCount;
+    check->clusterSize = disk->clusterSize;
+    int words = (check->clusterCount + 63) / 64;
+    check->linked = calloc(words, sizeof(uint64_t));
+    check->linkedTwice = calloc(words, sizeof(uint64_t));
+    check->started = calloc(words, sizeof(uint64_t));
+    check->crossed = calloc(words, sizeof(uint64_t));
+    check->reached = calloc(words, sizeof(uint64_t));
+    check->owner = calloc(check->clusterCount, sizeof(atomic_int));
+    atomic_init(&check->nextId, 1);
+
+    checkShared shared;
+    shared.check = check;
+    shared.workerCount = workerCount;
+    shared.shardCount = (check->clusterCount + CHECK_SHARD - 1) / CHECK_SHARD;
+    shared.workers = calloc(workerCount, sizeof(checkWorker));
+    for(int w = 0; w < workerCount; w++){
+        shared.workers[w].id = w;
+        shared.workers[w].shared = &shared;
+    }
+
+    STAT_PHASE_BEGIN(PHASE_FAT_SCAN);
+    run_shards(&shared, link_shard);
+    STAT_PHASE_END(PHASE_FAT_SCAN);
+
+    // the root directory is entry 1, then everything below it
+    int root = atomic_fetch_add(&check->nextId, 1);
+    add_entry(&shared.workers[0], root, strdup("/"), 0);
+    follow_chain(&shared.workers[0], root, disk->boot.BPB_RootClus, -1);
+    walk_directory_tree(disk, workerCount, check_visit, &shared);
+
+    STAT_PHASE_BEGIN(PHASE_FAT_SCAN);
+    run_shards(&shared, orphan_shard);
+    STAT_PHASE_END(PHASE_FAT_SCAN);
+
+    // merge what the workers found
+    check->entryCount = atomic_load(&check->nextId);
+    check->entries = calloc(check->entryCount, sizeof(checkEntry));
+    int problemTotal = 0;
+    for(int w = 0; w < workerCount; w++){
+        checkWorker* worker = &shared.workers[w];
+        for(int e = 0; e < worker->entries.count; e++){
+            check->entries[worker->entries.items[e].id] = worker->entries.items[e];
+        }
+        free(worker->entries.items);
+        check->headCount += worker->headCount;
+        check->usedCount += worker->used;
+        check->badCount += worker->bad;
+        check->ownedCount += worker->owned;
+        check->lostCount += worker->lost;
+    }
+    check->heads = malloc(sizeof(int) * (check->headCount + 1));
+    int headCounter = 0;
+    for(int w = 0; w < workerCount; w++){
+        if(shared.workers[w].headCount > 0){
+            memcpy(check->heads + headCounter, shared.workers[w].heads, sizeof(int) * shared.workers[w].headCount);
+        }
+        headCounter += shared.workers[w].headCount;
+        free(shared.workers[w].heads);
+    }
+    qsort(check->heads, check->headCount, sizeof(int), compare_ints);
+    follow_lost_chains(check, &shared.workers[0]);
+
+    for(int w = 0; w < workerCount; w++) problemTotal += shared.workers[w].problems.count;
+    check->problems = malloc(sizeof(checkProblem) * (problemTotal + 1));
+    for(int w = 0; w < workerCount; w++){
+        if(shared.workers[w].problems.count > 0){
+            memcpy(check->problems + check->problemCount, shared.workers[w].problems.items,
+                   sizeof(checkProblem) * shared.workers[w].problems.count);
+        }
+        check->problemCount += shared.workers[w].problems.count;
+        free(shared.workers[w].problems.items);
+    }
+    sortCheck = check;
+    qsort(check->problems, check->problemCount, sizeof(checkProblem), compare_problems);
+    free(shared.workers);
+
+    print_report(check);
+    return check;
+}
+
+void destroy_volume_check(volumeCheck* check){
+    if(check == NULL) return;
+    for(int e = 0; e < check->entryCount; e++) free(check->entries[e].path);
+    free(check->entries);
+    free(check->problems);
+    free(check->heads);
+    free(check->linked);
+    free(check->linkedTwice);
+    free(check->started);
+    free(check->crossed);
+    free(check->reached);
+    free(check->owner);
+    free(check);
+}
+
+int check_planned_clusters(volumeCheck* check, const fatUpdate* updates, int count){
+    // 0 when every cluster the updates give a value is free, unlinked and no live file's start
+    int status = 0;
+    for(int i = 0; i < count; i++){
+        int cluster = updates[i].cluster;
+        if((check->fat[cluster] & FAT_ENTRY_MASK) != 0 || test_bit(check->linked, cluster) || test_bit(check->started, cluster)){
+            fprintf(stderr, "check: cluster %d wanted by the recovery is in use\n", cluster);
+            status = -1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,69 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "diskio.h"
+#include "commit.h"
+
+#define CHECK_SHARD 65536           // FAT entries per work item
+
+// kinds of problem, reported in this order
+#define CHECK_CROSS_LINK 0          // two live chains share a cluster
+#define CHECK_FAT_CROSS_LINK 1      // several FAT entries point at one cluster
+#define CHECK_LOOP 2
+#define CHECK_BROKEN 3              // chain runs into a free, bad or invalid cluster
+#define CHECK_BAD_LINK 4            // FAT entry points outside the volume
+#define CHECK_SIZE 5                // chain length does not match the file size
+#define CHECK_LOST 6                // allocated chain no live entry reaches
+
+typedef struct checkProblem{
+    int kind;
+    int cluster;
+    int first;                      // entry ids, 0 for none
+    int second;
+    int length;                     // chain length, or FAT entries pointing at cluster
+    int expected;
+} checkProblem;
+
+typedef struct checkEntry{
+    int id;
+    char* path;
+    unsigned int size;
+} checkEntry;
+
+typedef struct volumeCheck{
+    diskImage* disk;
+    unsigned int* fat;
+    int clusterCount;
+    int clusterSize;
+
+    // one bit per cluster, set from several workers at once
+    _Atomic uint64_t* linked;       // some FAT entry points at the cluster
+    _Atomic uint64_t* linkedTwice;  // at least two do
+    _Atomic uint64_t* started;      // a live entry starts at the cluster
+    _Atomic uint64_t* crossed;      // reported as shared by two live chains
+    uint64_t* reached;              // on a lost chain
+    atomic_int* owner;              // id of the live entry whose chain holds the cluster, 0 for none
+    atomic_int nextId;
+    atomic_int nextShard;
+
+    checkEntry* entries;            // by id, entries[0] unused
+    int entryCount;
+    checkProblem* problems;
+    int problemCount;
+
+    int usedCount;
+    int badCount;
+    int ownedCount;
+    int lostCount;
+    int* heads;                     // lost chain heads, ascending
+    int headCount;
+} volumeCheck;
+
+volumeCheck* check_volume(diskImage* disk, int workerCount);
+void destroy_volume_check(volumeCheck* check);
+int check_planned_clusters(volumeCheck* check, const fatUpdate* updates, int count);
+
+#endif
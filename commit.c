@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "fatscan.h"
+#include "commit.h"
+#include "check.h"
+#include "stats.h"
+
+// transactional commit of FAT and directory entry updates
+//
+// a recovery, or a whole batch of them, stages the FAT entries and directory
+// entries it changes and nothing reaches the image until commit_transaction.
+// the commit sorts the FAT updates and writes each run of consecutive
+// clusters once to every FAT copy, then syncs those pages before the
+// directory entries and the FSInfo free count and next-free hint go out and
+// are synced in turn, so a crash in between leaves allocated clusters no entry
+// points at, never an entry pointing at free ones. only the pages written
+// are synced: msync on the mapped FAT and data windows, sync_file_range where
+// the bytes went out with pwrite. every write first saves the bytes it
+// replaces, and when a write or sync fails they are put back in reverse order.
+
+static void* grow(void* items, int* capacity, int count, size_t size){
+    if(count < *capacity) return items;
+    *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    return realloc(items, (size_t)*capacity * size);
+}
+
+void begin_transaction(diskTransaction* txn, diskImage* disk){
+    memset(txn, 0, sizeof(diskTransaction));
+    txn->disk = disk;
+}
+
+void stage_fat(diskTransaction* txn, int cluster, unsigned int value){
+    txn->fat = grow(txn->fat, &txn->fatCapacity, txn->fatCount, sizeof(fatUpdate));
+    fatUpdate* update = &txn->fat[txn->fatCount];
+    update->cluster = cluster;
+    update->value = value;
+    update->order = txn->fatCount++;
+}
+
+void stage_entry(diskTransaction* txn, int dirCluster, int index, const struct DirEntry* entry){
+    txn->entries = grow(txn->entries, &txn->entryCapacity, txn->entryCount, sizeof(entryUpdate));
+    entryUpdate* update = &txn->entries[txn->entryCount];
+    update->cluster = dirCluster;
+    update->index = index;
+    update->entry = *entry;
+    update->order = txn->entryCount++;
+}
+
+void abort_transaction(diskTransaction* txn){
+    for(int p = 0; p < txn->pinnedCount; p++){
+        put_cluster(txn->disk, txn->pinned[p]);
+    }
+    for(int r = 0; r < txn->journalCount; r++){
+        free(txn->journal[r].saved);
+    }
+    free(txn->fat);
+    free(txn->entries);
+    free(txn->journal);
+    free(txn->pinned);
+    begin_transaction(txn, txn->disk);
+}
+
+
+static int compare_fat_updates(const void* a, const void* b){
+    const fatUpdate* x = (const fatUpdate*)a;
+    const fatUpdate* y = (const fatUpdate*)b;
+    if(x->cluster != y->cluster) return x->cluster < y->cluster ? -1 : 1;
+    return x->order - y->order;
+}
+
+static int compare_entry_updates(const void* a, const void* b){
+    const entryUpdate* x = (const entryUpdate*)a;
+    const entryUpdate* y = (const entryUpdate*)b;
+    if(x->cluster != y->cluster) return x->cluster < y->cluster ? -1 : 1;
+    if(x->index != y->index) return x->index - y->index;
+    return x->order - y->order;
+}
+
+static int drop_superseded(void* items, int count, size_t size, size_t keyBytes){
+    // sorted by key then order: keep the last update of every key
+    char* base = (char*)items;
+    int kept = 0;
+    for(int i = 0; i < count; i++){
+        if(i + 1 < count && memcmp(base + i * size, base + (i + 1) * size, keyBytes) == 0) continue;
+        if(kept != i) memcpy(base + kept * size, base + i * size, size);
+        kept++;
+    }
+    return kept;
+}
+
+
+// journaled writes
+
+static int journal_write(diskTransaction* txn, uint64_t offset, char* target, int mapped, const void* data, size_t length){
+    txn->journal = grow(txn->journal, &txn->journalCapacity, txn->journalCount, sizeof(journalRecord));
+    journalRecord* record = &txn->journal[txn->journalCount];
+    record->offset = offset;
+    record->length = length;
+    record->target = target;
+    record->mapped = mapped;
+    record->saved = malloc(length);
+    if(record->saved == NULL) return -1;
+    if(mapped){
+        memcpy(record->saved, target, length);
+    }else if(read_disk(txn->disk, offset, record->saved, length) < 0){
+        free(record->saved);
+        return -1;
+    }
+    txn->journalCount++;
+
+    if(mapped){
+        memcpy(target, data, length);
+        return 0;
+    }
+    if(write_disk(txn->disk, offset, data, length) < 0) return -1;
+    if(target != NULL) memcpy(target, data, length);
+    return 0;
+}
+
+static int sync_records(diskTransaction* txn, int first){
+    // the pages behind records first.., and nothing else
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    int status = 0;
+    for(int r = first; r < txn->journalCount; r++){
+        journalRecord* record = &txn->journal[r];
+        if(record->mapped){
+            uintptr_t start = (uintptr_t)record->target & ~(page - 1);
+            uintptr_t end = (uintptr_t)record->target + record->length;
+            // the next record on a page already in the range joins it
+            while(r + 1 < txn->journalCount && txn->journal[r+1].mapped
+                  && (uintptr_t)txn->journal[r+1].target >= start
+                  && ((uintptr_t)txn->journal[r+1].target & ~(page - 1)) < ((end + page - 1) & ~(page - 1))){
+                r++;
+                uintptr_t next = (uintptr_t)txn->journal[r].target + txn->journal[r].length;
+                if(next > end) end = next;
+            }
+            if(msync((void*)start, end - start, MS_SYNC) < 0){
+                perror("msync");
+                status = -1;
+            }
+        }else{
+            int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+            if(sync_file_range(txn->disk->fd, (off64_t)record->offset, (off64_t)record->length, flags) < 0
+               && fdatasync(txn->disk->fd) < 0){
+                perror("sync");
+                status = -1;
+            }
+        }
+    }
+    return status;
+}
+
+static void roll_back(diskTransaction* txn){
+    // newest first, so bytes written twice end up as they were before the first
+    for(int r = txn->journalCount - 1; r >= 0; r--){
+        journalRecord* record = &txn->journal[r];
+        if(record->mapped){
+            memcpy(record->target, record->saved, record->length);
+        }else{
+            if(write_disk(txn->disk, record->offset, record->saved, record->length) < 0) perror("roll back");
+            if(record->target != NULL) memcpy(record->target, record->saved, record->length);
+        }
+    }
+    sync_records(txn, 0);
+}
+
+
+// the three steps
+
+static int write_fat_copies(diskTransaction* txn){
+    // every run of consecutive clusters is one write per FAT copy
+    diskImage* disk = txn->disk;
+    uint64_t fatOffset = disk->fatOffset;
+    uint64_t fatBytes = disk->fatBytes;
+    // with mirroring off the geometry holds the active copy alone
+    int copies = disk->fatCount;
+    if(txn->fatCount == 0) return 0;
+    unsigned int* run = malloc(sizeof(unsigned int) * txn->fatCount);
+    if(run == NULL) return -1;
+    int status = 0;
+    for(int i = 0; i < txn->fatCount && status == 0; ){
+        int length = 1;
+        run[0] = txn->fat[i].value;
+        while(i + length < txn->fatCount && txn->fat[i + length].cluster == txn->fat[i].cluster + length){
+            run[length] = txn->fat[i + length].value;
+            length++;
+        }
+        uint64_t entryOffset = (uint64_t)txn->fat[i].cluster * 4;
+        for(int t = 0; t < copies && status == 0; t++){
+            uint64_t copyOffset = (uint64_t)t * fatBytes + entryOffset;
+            char* target = NULL;
+            if(disk->fatMapping != NULL){
+                target = (char*)disk->fat + copyOffset;
+            }else if(t == 0){
+                target = (char*)disk->fat + entryOffset;
+            }
+            status = journal_write(txn, fatOffset + copyOffset, target, disk->fatMapping != NULL, run, (size_t)length * 4);
+            STAT_ADD(STAT_FAT_WRITES, length);
+        }
+        i += length;
+    }
+    free(run);
+    if(status < 0) perror("write FAT");
+    return status;
+}
+
+static int write_entries(diskTransaction* txn){
+    diskImage* disk = txn->disk;
+    txn->pinned = malloc(sizeof(int) * (txn->entryCount + 1));
+    if(txn->pinned == NULL) return -1;
+    for(int e = 0; e < txn->entryCount; e++){
+        entryUpdate* update = &txn->entries[e];
+        char* data = get_cluster(disk, update->cluster);
+        if(data == NULL) return -1;
+        txn->pinned[txn->pinnedCount++] = update->cluster;
+        uint64_t slot = (uint64_t)update->index * sizeof(struct DirEntry);
+        uint64_t offset = disk->dataOffset + ((uint64_t)(update->cluster - 2) << disk->clusterShift) + slot;
+        // mmap: written through the window; pread: written out, and into the cached cluster
+        if(journal_write(txn, offset, data + slot, disk->backend == DISK_BACKEND_MMAP, &update->entry, sizeof(struct DirEntry)) < 0){
+            perror("write directory entry");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_fsinfo(diskTransaction* txn, int freeDelta){
+    // free count and next-free hint; a volume without a valid FSInfo sector is left alone
+    diskImage* disk = txn->disk;
+    struct BootEntry* boot = &disk->boot;
+    if(boot->BPB_FSInfo == 0 || boot->BPB_FSInfo == 0xFFFF || boot->BPB_FSInfo >= boot->BPB_RsvdSecCnt) return 0;
+    uint64_t offset = (uint64_t)boot->BPB_FSInfo * boot->BPB_BytsPerSec;
+    FSInfo info;
+    if(read_disk(disk, offset, &info, sizeof(FSInfo)) < 0) return -1;
+    if(info.FSI_LeadSig != FSINFO_LEAD_SIG || info.FSI_StrucSig != FSINFO_STRUC_SIG) return 0;
+
+    unsigned int counts[2] = { info.FSI_Free_Count, info.FSI_Nxt_Free };
+    if(counts[0] != FSINFO_UNKNOWN && counts[0] <= (unsigned int)disk->clusterCount){
+        int64_t count = (int64_t)counts[0] + freeDelta;
+        counts[0] = count < 0 ? 0 : (unsigned int)count;
+    }
+    // a hint that now points at a used cluster moves on to the next free one
+    unsigned int* fat = disk->fat;
+    unsigned int hint = counts[1];
+    if(hint >= 2 && hint < (unsigned int)disk->clusterCount && (fat[hint] & FAT_ENTRY_MASK) != 0){
+        while(hint < (unsigned int)disk->clusterCount && (fat[hint] & FAT_ENTRY_MASK) != 0) hint++;
+        counts[1] = hint < (unsigned int)disk->clusterCount ? hint : FSINFO_UNKNOWN;
+    }
+    if(counts[0] == info.FSI_Free_Count && counts[1] == info.FSI_Nxt_Free) return 0;
+    if(journal_write(txn, offset + offsetof(FSInfo, FSI_Free_Count), NULL, 0, counts, sizeof(counts)) < 0){
+        perror("write FSInfo");
+        return -1;
+    }
+    return 0;
+}
+
+int commit_transaction(diskTransaction* txn){
+    // applies every staged update, or none of them; 0 on success
+    STAT_PHASE_BEGIN(PHASE_COMMIT);
+    diskImage* disk = txn->disk;
+    unsigned int* fat = disk_fat(disk);
+    int status = fat != NULL ? 0 : -1;
+    // holes are about to be written into, from here on everything is read from the image
+    forget_holes(disk);
+
+    qsort(txn->fat, txn->fatCount, sizeof(fatUpdate), compare_fat_updates);
+    txn->fatCount = drop_superseded(txn->fat, txn->fatCount, sizeof(fatUpdate), sizeof(int));
+    qsort(txn->entries, txn->entryCount, sizeof(entryUpdate), compare_entry_updates);
+    txn->entryCount = drop_superseded(txn->entries, txn->entryCount, sizeof(entryUpdate), 2 * sizeof(int));
+
+    // the reserved top bits of every entry are kept, and the free count follows the low ones
+    int freeDelta = 0;
+    for(int i = 0; i < txn->fatCount && status == 0; i++){
+        fatUpdate* update = &txn->fat[i];
+        if(update->cluster < 2 || update->cluster >= disk->clusterCount){
+            fprintf(stderr, "commit: cluster %d outside the FAT\n", update->cluster);
+            status = -1;
+            break;
+        }
+        unsigned int old = fat[update->cluster];
+        update->value = (old & ~FAT_ENTRY_MASK) | (update->value & FAT_ENTRY_MASK);
+        if((old & FAT_ENTRY_MASK) == 0 && (update->value & FAT_ENTRY_MASK) != 0) freeDelta--;
+        if((old & FAT_ENTRY_MASK) != 0 && (update->value & FAT_ENTRY_MASK) == 0) freeDelta++;
+    }
+
+    // with -c the clusters must also be free as far as the rest of the volume is concerned
+    if(status == 0 && disk->check != NULL) status = check_planned_clusters(disk->check, txn->fat, txn->fatCount);
+
+    if(status == 0) status = write_fat_copies(txn);
+    if(status == 0) status = sync_records(txn, 0);
+    int synced = txn->journalCount;
+    if(status == 0) status = write_entries(txn);
+    if(status == 0) status = write_fsinfo(txn, freeDelta);
+    if(status == 0) status = sync_records(txn, synced);
+    if(status < 0 && txn->journalCount > 0){
+        roll_back(txn);
+        fprintf(stderr, "commit failed, changes rolled back\n");
+    }
+    abort_transaction(txn);
+    STAT_PHASE_END(PHASE_COMMIT);
+    return status;
+}
@@ -0,0 +1,57 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fsinfo.h"
+#include "diskio.h"
+
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUC_SIG 0x61417272
+#define FSINFO_UNKNOWN 0xFFFFFFFF   // free count or next-free hint not maintained
+
+typedef struct fatUpdate{
+    int cluster;
+    unsigned int value;
+    int order;                      // staging order, the last update of a cluster wins
+} fatUpdate;
+
+typedef struct entryUpdate{
+    int cluster;                    // directory cluster holding the entry
+    int index;                      // slot within that cluster
+    int order;
+    struct DirEntry entry;
+} entryUpdate;
+
+// bytes as they were before one write, for rollback
+typedef struct journalRecord{
+    uint64_t offset;                // in the image
+    size_t length;
+    char* target;                   // the same bytes in memory, NULL when only on disk
+    int mapped;                     // target is a shared mapping of offset, written in place
+    unsigned char* saved;
+} journalRecord;
+
+typedef struct diskTransaction{
+    diskImage* disk;
+    fatUpdate* fat;
+    int fatCount;
+    int fatCapacity;
+    entryUpdate* entries;
+    int entryCount;
+    int entryCapacity;
+    journalRecord* journal;
+    int journalCount;
+    int journalCapacity;
+    int* pinned;                    // directory clusters held while their entries are written
+    int pinnedCount;
+} diskTransaction;
+
+void begin_transaction(diskTransaction* txn, diskImage* disk);
+void stage_fat(diskTransaction* txn, int cluster, unsigned int value);
+void stage_entry(diskTransaction* txn, int dirCluster, int index, const struct DirEntry* entry);
+int commit_transaction(diskTransaction* txn);
+void abort_transaction(diskTransaction* txn);
+
+#endif
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "search.h"
+#include "freemap.h"
+#include "dirtree.h"
+#include "carve.h"
+#include "arena.h"
+#include "digest.h"
+#include "stats.h"
+
+// multi-digest matching (-S digests.txt)
+//
+// the known SHA-1s are loaded into an open-addressing table, so a candidate
+// is hashed once and looked up in one probe or two instead of being compared
+// against every target. the candidates are the deleted entries of the whole
+// volume, read as contiguous files, and the files -C would carve out of free
+// clusters; both are hashed by a pool of workers claiming them in turn. an
+// entry the contiguous read does not match is then searched like -R, with
+// every digest of the set as a target at once.
+
+typedef struct hashJob{
+    int cluster;                    // first cluster, the data is consecutive from here
+    uint64_t length;
+    int matched;                    // digest index, -1 for none
+} hashJob;
+
+typedef struct deletedRecord{
+    char* path;
+    unsigned int size;
+    int startCluster;
+    int job;                        // contiguous read in the job list, -1 when it cannot be read
+    int matched;
+    int* chain;                     // fragmented match, NULL for a contiguous one
+    int chainSize;
+} deletedRecord;
+
+typedef struct deletedList{
+    deletedRecord* records;
+    int count;
+    int capacity;
+} deletedList;
+
+typedef struct digestShared{
+    diskImage* disk;
+    const digestSet* set;
+    hashJob* jobs;
+    int jobCount;
+    atomic_int nextJob;
+} digestShared;
+
+typedef struct digestWorker{
+    int id;
+    pthread_t thread;
+    int started;
+    digestShared* shared;
+} digestWorker;
+
+
+static uint32_t digest_tag(const unsigned char* digest){
+    // SHA-1 output is uniform, its first bytes are as good a hash as any
+    uint32_t tag;
+    memcpy(&tag, digest, sizeof(tag));
+    return tag;
+}
+
+static int parse_digest(const char* text, unsigned char* digest){
+    // 40 hex digits in either case, returns 0 on anything else
+    for(int i = 0; i < DIGEST_LENGTH * 2; i++){
+        if(!isxdigit((unsigned char)text[i])) return 0;
+    }
+    for(int i = 0; i < DIGEST_LENGTH; i++){
+        digest[i] = (char_to_hex(tolower((unsigned char)text[i*2])) << 4) | char_to_hex(tolower((unsigned char)text[i*2+1]));
+    }
+    return 1;
+}
+
+static int insert_digest(digestSet* set, int index){
+    // returns 0 when the digest is already in the table
+    const unsigned char* digest = set->digests[index];
+    uint32_t tag = digest_tag(digest);
+    for(uint32_t slot = tag & set->mask;; slot = (slot + 1) & set->mask){
+        if(set->slots[slot].index < 0){
+            set->slots[slot].tag = tag;
+            set->slots[slot].index = index;
+            return 1;
+        }
+        if(set->slots[slot].tag == tag && memcmp(set->digests[set->slots[slot].index], digest, DIGEST_LENGTH) == 0){
+            return 0;
+        }
+    }
+}
+
+digestSet* load_digest_set(const char* path){
+    // one digest per line, optionally followed by a label as sha1sum prints it;
+    // blank lines and lines starting with # are skipped
+    FILE* file = fopen(path, "r");
+    if(file == NULL){
+        perror(path);
+        return NULL;
+    }
+    digestSet* set = calloc(1, sizeof(digestSet));
+    int capacity = 0;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    int lineNumber = 0;
+    int ok = 1;
+    while(getline(&line, &lineCapacity, file) >= 0){
+        lineNumber += 1;
+        line[strcspn(line, "\r\n")] = '\0';
+        char* text = line;
+        while(isspace((unsigned char)*text)) text++;
+        if(*text == '\0' || *text == '#') continue;
+        if(set->count == capacity){
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            set->digests = realloc(set->digests, sizeof(*set->digests) * capacity);
+            set->labels = realloc(set->labels, sizeof(char*) * capacity);
+        }
+        if(strlen(text) < DIGEST_LENGTH * 2 || !parse_digest(text, set->digests[set->count])
+           || (text[DIGEST_LENGTH * 2] != '\0' && !isspace((unsigned char)text[DIGEST_LENGTH * 2]))){
+            fprintf(stderr, "%s:%d: not a SHA-1 digest\n", path, lineNumber);
+            ok = 0;
+            break;
+        }
+        char* label = text + DIGEST_LENGTH * 2;
+        while(isspace((unsigned char)*label) || *label == '*') label++;
+        set->labels[set->count] = *label != '\0' ? strdup(label) : NULL;
+        set->count += 1;
+    }
+    free(line);
+    fclose(file);
+    if(!ok || set->count == 0){
+        if(ok) fprintf(stderr, "%s: no digests\n", path);
+        destroy_digest_set(set);
+        return NULL;
+    }
+
+    // at most half full, so a miss ends after a probe or two
+    uint32_t slotCount = 1;
+    while(slotCount < (uint32_t)set->count * DIGEST_LOAD) slotCount <<= 1;
+    set->mask = slotCount - 1;
+    set->slots = malloc(sizeof(digestSlot) * slotCount);
+    for(uint32_t s = 0; s < slotCount; s++) set->slots[s].index = -1;
+    int kept = 0;
+    for(int d = 0; d < set->count; d++){
+        // compact in file order, a repeated digest keeps its first label
+        if(kept != d){
+            memcpy(set->digests[kept], set->digests[d], DIGEST_LENGTH);
+            set->labels[kept] = set->labels[d];
+        }
+        if(insert_digest(set, kept)){
+            kept += 1;
+        }else{
+            free(set->labels[kept]);
+        }
+    }
+    set->count = kept;
+    return set;
+}
+
+void destroy_digest_set(digestSet* set){
+    if(set == NULL) return;
+    for(int d = 0; d < set->count; d++) free(set->labels[d]);
+    free(set->labels);
+    free(set->digests);
+    free(set->slots);
+    free(set);
+}
+
+int find_digest(const digestSet* set, const unsigned char* digest){
+    // index of digest in the set, -1 when it is not a target
+    uint32_t tag = digest_tag(digest);
+    for(uint32_t slot = tag & set->mask;; slot = (slot + 1) & set->mask){
+        const digestSlot* entry = &set->slots[slot];
+        if(entry->index < 0) return -1;
+        if(entry->tag == tag && memcmp(set->digests[entry->index], digest, DIGEST_LENGTH) == 0) return entry->index;
+    }
+}
+
+
+// candidates
+
+static int in_volume(diskImage* disk, int cluster, uint64_t length){
+    // every cluster of a consecutive read of length bytes from cluster exists
+    uint64_t clusters = (length + disk->clusterSize - 1) >> disk->clusterShift;
+    return cluster >= 2 && (uint64_t)cluster + clusters <= (uint64_t)disk->clusterCount;
+}
+
+static void collect_visit(void* arg, int worker, const char* dirPath, const entryPlace* place, struct DirEntry* entry){
+    (void)place;
+    deletedList* lists = (deletedList*)arg;
+    // every empty entry would match the empty file's digest, that says nothing
+    if(entry->DIR_Name[0] != 0xE5 || (entry->DIR_Attr & 0x10) || entry->DIR_Attr == 0x0F || entry->DIR_FileSize == 0) return;
+
+    deletedList* list = &lists[worker];
+    if(list->count == list->capacity){
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->records = realloc(list->records, sizeof(deletedRecord) * list->capacity);
+    }
+    deletedRecord* record = &list->records[list->count++];
+    // the first character of a deleted name is gone, show it as '?'
+    struct DirEntry shown = *entry;
+    shown.DIR_Name[0] = '?';
+    char name[13];
+    format_entry_name(&shown, name);
+    record->path = malloc(strlen(dirPath) + strlen(name) + 2);
+    sprintf(record->path, "%s/%s", dirPath, name);
+    record->size = entry->DIR_FileSize;
+    record->startCluster = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+    record->job = -1;
+    record->matched = -1;
+    record->chain = NULL;
+    record->chainSize = 0;
+}
+
+static int compare_records(const void* one, const void* two){
+    return strcmp(((const deletedRecord*)one)->path, ((const deletedRecord*)two)->path);
+}
+
+static int compare_ints(const void* one, const void* two){
+    int a = *(const int*)one;
+    int b = *(const int*)two;
+    return (a > b) - (a < b);
+}
+
+
+// hashing
+
+static void* hash_worker(void* arg){
+    digestWorker* worker = (digestWorker*)arg;
+    digestShared* shared = worker->shared;
+    diskImage* disk = shared->disk;
+    int job;
+    while((job = atomic_fetch_add(&shared->nextJob, 1)) < shared->jobCount){
+        hashJob* item = &shared->jobs[job];
+        SHA_CTX context;
+        SHA1_Init(&context);
+        uint64_t remaining = item->length;
+        for(int cluster = item->cluster; remaining > 0; cluster++){
+            char* data = get_cluster(disk, cluster);
+            if(data == NULL) break;
+            size_t length = remaining < (uint64_t)disk->clusterSize ? (size_t)remaining : (size_t)disk->clusterSize;
+            SHA1_Update(&context, data, length);
+            STAT_ADD(STAT_SHA_CALLS, 1);
+            STAT_ADD(STAT_SHA_BYTES, length);
+            put_cluster(disk, cluster);
+            remaining -= length;
+        }
+        unsigned char digest[DIGEST_LENGTH];
+        SHA1_Final(digest, &context);
+        item->matched = remaining == 0 ? find_digest(shared->set, digest) : -1;
+    }
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+static void hash_jobs(digestShared* shared, int workerCount){
+    digestWorker* workers = malloc(sizeof(digestWorker) * workerCount);
+    atomic_init(&shared->nextJob, 0);
+    for(int w = 0; w < workerCount; w++){
+        workers[w].id = w;
+        workers[w].shared = shared;
+        workers[w].started = 0;
+    }
+    for(int w = 1; w < workerCount; w++){
+        workers[w].started = pthread_create(&workers[w].thread, NULL, hash_worker, &workers[w]) == 0;
+    }
+    hash_worker(&workers[0]);
+    for(int w = 1; w < workerCount; w++){
+        if(workers[w].started) pthread_join(workers[w].thread, NULL);
+    }
+    free(workers);
+}
+
+static int search_entry(diskImage* disk, const digestSet* set, searchConfig* config, freeMap* freeClusters, arena* scratch, deletedRecord* record){
+    // one search of one entry on its own node budget, returns how it stopped
+    config->nodesUsed = 0;
+    config->stopped = SEARCH_STOP_NONE;
+    arena_reset(scratch);
+    int candidateCount = 0;
+    int* candidates = get_candidate_clusters(freeClusters, config, record->startCluster, &candidateCount, scratch);
+    record->chain = get_digest_set_match(disk, candidates, candidateCount, (int)record->size, set, &record->chainSize, &record->matched, config, scratch);
+    if(record->chain == NULL) record->matched = -1;
+    return config->stopped;
+}
+
+static void search_fragmented(diskImage* disk, const digestSet* set, searchConfig* config, deletedRecord* records, int count){
+    // entries the contiguous read missed, searched one at a time with every worker on each.
+    // every entry gets the ordered fast paths first, then the permutation search: on
+    // DIGEST_DEFAULT_BYTES of hashing per entry when no budget is given, on --max-nodes
+    // per entry, and with --deadline on a share of the time left
+    freeMap* freeClusters = build_free_map(disk);
+    arena scratch;
+    arena_init(&scratch, ARENA_DEFAULT_BLOCK);
+    int* pending = malloc(sizeof(int) * (count + 1));
+    int pendingCount = 0;
+    for(int r = 0; r < count; r++){
+        deletedRecord* record = &records[r];
+        // one cluster is all the contiguous read could have been, and a start
+        // cluster back in use no longer holds the file's first bytes
+        if(record->matched >= 0 || record->size <= (unsigned int)disk->clusterSize) continue;
+        if(record->startCluster < 2 || record->startCluster >= disk->clusterCount || !is_cluster_free(freeClusters, record->startCluster)) continue;
+        pending[pendingCount++] = r;
+    }
+
+    double deadlineAt = config->deadlineAt;
+    uint64_t maxNodes = config->maxNodes;
+    if(config->deadline <= 0 && maxNodes == 0) config->maxNodes = DIGEST_DEFAULT_BYTES >> disk->clusterShift;
+
+    config->scope = SEARCH_SCOPE_FAST;
+    for(int p = 0; p < pendingCount; p++){
+        search_entry(disk, set, config, freeClusters, &scratch, &records[pending[p]]);
+    }
+
+    // the full search goes round the entries still unmatched. each one gets what is left of
+    // the deadline over the entries still to go, recomputed as it starts; one that matches or
+    // runs out of orderings early leaves its time to the others, and those the deadline
+    // stopped are searched again next round with the time freed
+    config->scope = SEARCH_SCOPE_FULL;
+    int left = 0;
+    for(int p = 0; p < pendingCount; p++){
+        if(records[pending[p]].matched >= 0) pending[p] = -1;
+        else left += 1;
+    }
+    while(left > 0){
+        int settled = 0;
+        for(int p = 0; p < pendingCount && left > 0; p++){
+            if(pending[p] < 0) continue;
+            if(deadlineAt > 0){
+                double now = search_clock();
+                if(now >= deadlineAt) break;
+                config->deadlineAt = now + (deadlineAt - now) / left;
+            }
+            left -= 1;
+            if(search_entry(disk, set, config, freeClusters, &scratch, &records[pending[p]]) != SEARCH_STOP_DEADLINE){
+                pending[p] = -1;
+                settled += 1;
+            }
+        }
+        // without a deadline every entry has had its whole budget; with one, a round
+        // where every entry used its whole share leaves nothing to hand on
+        if(deadlineAt <= 0 || settled == 0 || search_clock() >= deadlineAt) break;
+        left = 0;
+        for(int p = 0; p < pendingCount; p++) left += pending[p] >= 0;
+    }
+    config->scope = 0;
+    config->deadlineAt = deadlineAt;
+    config->maxNodes = maxNodes;
+    free(pending);
+    arena_destroy(&scratch);
+    destroy_free_map(freeClusters);
+}
+
+
+// report
+
+static void print_match(const digestSet* set, int matched){
+    printf(" matches ");
+    for(int i = 0; i < DIGEST_LENGTH; i++) printf("%02x", set->digests[matched][i]);
+    if(set->labels[matched] != NULL) printf(" %s", set->labels[matched]);
+    printf("\n");
+}
+
+void match_digest_set(diskImage* disk, const digestSet* set, searchConfig* config, int workerCount){
+    // the deleted entries of the volume
+    deletedList* lists = calloc(workerCount, sizeof(deletedList));
+    walk_directory_tree(disk, workerCount, collect_visit, lists);
+    int recordCount = 0;
+    for(int w = 0; w < workerCount; w++) recordCount += lists[w].count;
+    deletedRecord* records = malloc(sizeof(deletedRecord) * (recordCount + 1));
+    int counter = 0;
+    for(int w = 0; w < workerCount; w++){
+        if(lists[w].count > 0) memcpy(records + counter, lists[w].records, sizeof(deletedRecord) * lists[w].count);
+        counter += lists[w].count;
+        free(lists[w].records);
+    }
+    free(lists);
+    qsort(records, recordCount, sizeof(deletedRecord), compare_records);
+
+    // the files carving would find, and one hash job for each of them and each entry
+    carvedFile* carved = NULL;
+    int carvedCount = find_carved_files(disk, workerCount, &carved);
+    digestShared shared;
+    shared.disk = disk;
+    shared.set = set;
+    shared.jobs = malloc(sizeof(hashJob) * (recordCount + carvedCount + 1));
+    shared.jobCount = 0;
+    for(int r = 0; r < recordCount; r++){
+        if(!in_volume(disk, records[r].startCluster, records[r].size)) continue;
+        records[r].job = shared.jobCount;
+        shared.jobs[shared.jobCount++] = (hashJob){ records[r].startCluster, records[r].size, -1 };
+    }
+    int carvedJobs = shared.jobCount;
+    for(int c = 0; c < carvedCount; c++){
+        shared.jobs[shared.jobCount++] = (hashJob){ carved[c].cluster, carved[c].length, -1 };
+    }
+    STAT_PHASE_BEGIN(PHASE_SEARCH);
+    hash_jobs(&shared, workerCount);
+    STAT_PHASE_END(PHASE_SEARCH);
+    for(int r = 0; r < recordCount; r++){
+        if(records[r].job >= 0) records[r].matched = shared.jobs[records[r].job].matched;
+    }
+
+    search_fragmented(disk, set, config, records, recordCount);
+
+    // a carved file where a matched entry starts is that entry again
+    int* matchedStarts = malloc(sizeof(int) * (recordCount + 1));
+    int matchedStartCount = 0;
+    int total = 0;
+    for(int r = 0; r < recordCount; r++){
+        deletedRecord* record = &records[r];
+        if(record->matched >= 0){
+            if(record->chain == NULL){
+                printf("%s (size = %u, starting cluster = %d, contiguous)", record->path, record->size, record->startCluster);
+            }else{
+                printf("%s (size = %u, clusters = ", record->path, record->size);
+                for(int c = 0; c < record->chainSize; c++) printf(c == 0 ? "%d" : ",%d", record->chain[c]);
+                printf(")");
+            }
+            print_match(set, record->matched);
+            matchedStarts[matchedStartCount++] = record->startCluster;
+            total += 1;
+        }
+        free(record->path);
+        free(record->chain);
+    }
+    qsort(matchedStarts, matchedStartCount, sizeof(int), compare_ints);
+    for(int c = 0; c < carvedCount; c++){
+        int matched = shared.jobs[carvedJobs + c].matched;
+        if(matched < 0 || bsearch(&carved[c].cluster, matchedStarts, matchedStartCount, sizeof(int), compare_ints) != NULL) continue;
+        char name[32];
+        carved_file_name(&carved[c], name, sizeof(name));
+        printf("%s (size = %llu, starting cluster = %d, carved)", name, (unsigned long long)carved[c].length, carved[c].cluster);
+        print_match(set, matched);
+        total += 1;
+    }
+    printf("Total number of matches = %d\n", total);
+
+    free(matchedStarts);
+    free(shared.jobs);
+    free(carved);
+    free(records);
+}
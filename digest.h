@@ -0,0 +1,33 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+
+#include "diskio.h"
+#include "search.h"
+
+#define DIGEST_LENGTH 20            // SHA-1
+#define DIGEST_LOAD 2               // table slots per digest, at least
+#define DIGEST_DEFAULT_BYTES (64 << 20)     // per fragmented entry, hashed by the full search when no budget is given
+
+// one slot of the open-addressing table
+typedef struct digestSlot{
+    uint32_t tag;                   // first four digest bytes, compared before the digest itself
+    int index;                      // into digests, -1 for an empty slot
+} digestSlot;
+
+// the known digests of a -S file
+typedef struct digestSet{
+    unsigned char (*digests)[DIGEST_LENGTH];    // in file order, duplicates dropped
+    char** labels;                  // rest of the line after the digest, NULL for none
+    int count;
+    digestSlot* slots;
+    uint32_t mask;                  // slot count - 1, a power of two
+} digestSet;
+
+digestSet* load_digest_set(const char* path);
+void destroy_digest_set(digestSet* set);
+int find_digest(const digestSet* set, const unsigned char* digest);
+void match_digest_set(diskImage* disk, const digestSet* set, searchConfig* config, int workerCount);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "nyufile.h"
+#include "dirscan.h"
+#include "kernels.h"
+#include "stats.h"
+
+// directory entry matching against a packed 8.3 key
+//
+// the user's filename is converted once; every directory cluster is then
+// scanned for entries whose first byte is the 0xE5 deleted marker and whose
+// bytes 1..10 equal the key, several entries per vector compare. each scan
+// has a copy per cluster size, so the loop over a cluster has a fixed count.
+
+#define ENTRY_SIZE 32
+#define NAME_MASK 0x7FF         // DIR_Name bytes 0..10
+
+typedef int (*scan_kernel)(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches);
+
+int make_name_key(const char* filename, nameKey* key){
+    // returns 0 when the name cannot be an 8.3 name
+    memset(key->name, ' ', sizeof(key->name));
+    const char* dot = strchr(filename, '.');
+    size_t nameLength = dot != NULL ? (size_t)(dot - filename) : strlen(filename);
+    if(nameLength == 0 || nameLength > 8){
+        return 0;
+    }
+    memcpy(key->name, filename, nameLength);
+    if(dot != NULL){
+        size_t extLength = strlen(dot + 1);
+        if(extLength > 3 || strchr(dot + 1, '.') != NULL){
+            return 0;
+        }
+        memcpy(key->name + 8, dot + 1, extLength);
+    }
+    return 1;
+}
+
+KERNEL_BODY int scan_scalar_body(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){
+    int found = 0;
+    for(int i = 0; i < entryCount; i++){
+        const unsigned char* entry = cluster + i*ENTRY_SIZE;
+        if(entry[0] == 0xE5 && memcmp(entry + 1, pattern + 1, 10) == 0){
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+KERNEL_BODY __attribute__((target("sse2")))
+int scan_sse2_body(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){
+    const __m128i key = _mm_loadu_si128((const __m128i*)pattern);
+    int found = 0;
+    for(int i = 0; i < entryCount; i++){
+        __m128i entry = _mm_loadu_si128((const __m128i*)(cluster + i*ENTRY_SIZE));
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(entry, key));
+        if((equal & NAME_MASK) == NAME_MASK){
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+
+KERNEL_BODY __attribute__((target("avx2")))
+int scan_avx2_body(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){
+    // the name halves of two neighbouring entries share one 256-bit compare
+    const __m128i half = _mm_loadu_si128((const __m128i*)pattern);
+    const __m256i key = _mm256_inserti128_si256(_mm256_castsi128_si256(half), half, 1);
+    int found = 0;
+    int i = 0;
+    for(; i + 1 < entryCount; i += 2){
+        const unsigned char* entry = cluster + i*ENTRY_SIZE;
+        __m256i names = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)entry)),
+                                                _mm_loadu_si128((const __m128i*)(entry + ENTRY_SIZE)), 1);
+        unsigned int equal = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(names, key));
+        if((equal & NAME_MASK) == NAME_MASK){
+            matches[found++] = i;
+        }
+        if(((equal >> 16) & NAME_MASK) == NAME_MASK){
+            matches[found++] = i + 1;
+        }
+    }
+    if(i < entryCount){
+        int tail;
+        if(scan_sse2_body(cluster + i*ENTRY_SIZE, 1, pattern, &tail) == 1){
+            matches[found++] = i;
+        }
+    }
+    return found;
+}
+#endif
+
+// a generic copy of each scan for any entry count, and one per cluster size
+// with the entry count a constant, picked through disk->kernel
+#define SCALAR_SCAN(SIZE) \
+    static int scan_scalar_##SIZE(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){ \
+        (void)entryCount; \
+        return scan_scalar_body(cluster, (SIZE) / ENTRY_SIZE, pattern, matches); \
+    }
+#define SCALAR_ENTRY(SIZE) scan_scalar_##SIZE,
+
+static int scan_scalar(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){
+    return scan_scalar_body(cluster, entryCount, pattern, matches);
+}
+FOR_EACH_CLUSTER_SIZE(SCALAR_SCAN)
+static const scan_kernel scalarKernels[CLUSTER_KERNELS] = { FOR_EACH_CLUSTER_SIZE(SCALAR_ENTRY) };
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VECTOR_SCAN(SIZE) \
+    __attribute__((target("sse2"))) \
+    static int scan_sse2_##SIZE(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){ \
+        (void)entryCount; \
+        return scan_sse2_body(cluster, (SIZE) / ENTRY_SIZE, pattern, matches); \
+    } \
+    __attribute__((target("avx2"))) \
+    static int scan_avx2_##SIZE(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){ \
+        (void)entryCount; \
+        return scan_avx2_body(cluster, (SIZE) / ENTRY_SIZE, pattern, matches); \
+    }
+#define SSE2_ENTRY(SIZE) scan_sse2_##SIZE,
+#define AVX2_ENTRY(SIZE) scan_avx2_##SIZE,
+
+__attribute__((target("sse2")))
+static int scan_sse2(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){
+    return scan_sse2_body(cluster, entryCount, pattern, matches);
+}
+__attribute__((target("avx2")))
+static int scan_avx2(const unsigned char* cluster, int entryCount, const unsigned char* pattern, int* matches){
+    return scan_avx2_body(cluster, entryCount, pattern, matches);
+}
+FOR_EACH_CLUSTER_SIZE(VECTOR_SCAN)
+static const scan_kernel sse2Kernels[CLUSTER_KERNELS] = { FOR_EACH_CLUSTER_SIZE(SSE2_ENTRY) };
+static const scan_kernel avx2Kernels[CLUSTER_KERNELS] = { FOR_EACH_CLUSTER_SIZE(AVX2_ENTRY) };
+#endif
+
+static scan_kernel selectedKernel = NULL;
+static const scan_kernel* selectedKernels = NULL;
+static const char* selectedKernelName = NULL;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+static void choose_kernel(void){
+    scan_kernel kernel = scan_scalar;
+    const scan_kernel* kernels = scalarKernels;
+    const char* name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        kernel = scan_avx2;
+        kernels = avx2Kernels;
+        name = "avx2";
+    }else if(__builtin_cpu_supports("sse2")){
+        kernel = scan_sse2;
+        kernels = sse2Kernels;
+        name = "sse2";
+    }
+#endif
+    selectedKernels = kernels;
+    selectedKernelName = name;
+    selectedKernel = kernel;
+}
+
+static void select_kernel(void){
+    pthread_once(&kernelOnce, choose_kernel);
+}
+
+const char* dir_scan_kernel(void){
+    select_kernel();
+    return selectedKernelName;
+}
+
+int find_deleted_entries(const unsigned char* cluster, int entryCount, int kernel, const nameKey* key, int* matches){
+    // writes the indices of deleted entries matching key to matches, returns how many.
+    // kernel is disk->kernel, entryCount the entries of one cluster of that image
+    unsigned char pattern[16];
+    memset(pattern, 0, sizeof(pattern));
+    pattern[0] = 0xE5;
+    memcpy(pattern + 1, key->name + 1, 10);
+    select_kernel();
+    scan_kernel scan = kernel >= 0 && kernel < CLUSTER_KERNELS ? selectedKernels[kernel] : selectedKernel;
+    int matchCount = scan(cluster, entryCount, pattern, matches);
+    STAT_ADD(STAT_DIR_CLUSTERS, 1);
+    STAT_ADD(STAT_DIR_ENTRIES, entryCount);
+    STAT_ADD(STAT_NAME_MATCHES, matchCount);
+    return matchCount;
+}
@@ -0,0 +1,12 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+typedef struct nameKey{
+    unsigned char name[11];     // space padded 8.3 name, as stored in DIR_Name
+} nameKey;
+
+int make_name_key(const char* filename, nameKey* key);
+int find_deleted_entries(const unsigned char* cluster, int entryCount, int kernel, const nameKey* key, int* matches);
+const char* dir_scan_kernel(void);
+
+#endif
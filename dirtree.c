@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "freemap.h"
+#include "dirscan.h"
+#include "dirtree.h"
+#include "sidecar.h"
+#include "stats.h"
+
+// whole-volume directory walker
+//
+// directories are jobs on a bounded queue shared by a pool of workers. a
+// worker scans one directory chain, hands every entry to the visitor and
+// queues the subdirectories it finds; when the queue is full it walks the
+// subdirectory itself instead, so memory stays bounded by the queue size
+// plus the recursion depth of the volume.
+
+#define QUEUE_CAPACITY 1024
+
+typedef struct dirJob{
+    int cluster;
+    char* path;             // "" for the root, otherwise "/A/B"
+} dirJob;
+
+typedef struct walkShared{
+    diskImage* disk;
+    unsigned int* fat;
+    int clusterSize;
+    int clusterCount;
+    entry_visitor visit;
+    void* ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    dirJob queue[QUEUE_CAPACITY];
+    int head;
+    int count;
+    int active;             // workers holding a job
+    uint64_t* visited;      // directory start clusters already walked
+} walkShared;
+
+typedef struct walkWorker{
+    int id;
+    pthread_t thread;
+    int started;
+    walkShared* shared;
+} walkWorker;
+
+
+void format_entry_name(struct DirEntry* entry, char* fileName){
+    // 8.3 name as printed by -l: trailing spaces dropped, "/" for directories
+    int j = 0;
+    while(j<8 && entry->DIR_Name[j] != ' '){
+        fileName[j] = entry->DIR_Name[j];
+        j++;
+    }
+    if(entry->DIR_Attr == 0x10){ // if directory
+        fileName[j++] = '/';
+    }else{
+        if(entry->DIR_Name[8] != ' '){ // if file has extension
+            fileName[j++] = '.';
+            int ext = 0;
+            while(ext<3 && entry->DIR_Name[ext+8] != ' '){
+                fileName[j++] = entry->DIR_Name[ext+8];
+                ext++;
+            }
+        }
+    }
+    fileName[j] = '\0';
+}
+
+static int is_subdirectory(struct DirEntry* entry){
+    if(entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.') return 0;
+    if(entry->DIR_Attr == 0x0F || !(entry->DIR_Attr & 0x10)) return 0;
+    return (entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO) >= 2;
+}
+
+static int claim_directory(walkShared* shared, int cluster){
+    // returns 1 the first time a directory cluster is seen, guards against cycles
+    if(cluster < 2 || cluster >= shared->clusterCount) return 0;
+    pthread_mutex_lock(&shared->lock);
+    int fresh = !((shared->visited[cluster >> 6] >> (cluster & 63)) & 1);
+    shared->visited[cluster >> 6] |= 1ULL << (cluster & 63);
+    pthread_mutex_unlock(&shared->lock);
+    return fresh;
+}
+
+static char* child_path(const char* parent, struct DirEntry* entry){
+    char name[13];
+    format_entry_name(entry, name);
+    size_t length = strlen(name);
+    if(length > 0 && name[length-1] == '/') name[length-1] = '\0';
+    char* path = malloc(strlen(parent) + strlen(name) + 2);
+    sprintf(path, "%s/%s", parent, name);
+    return path;
+}
+
+static void walk_directory(walkShared* shared, int worker, int cluster, const char* path){
+    int entriesPerCluster = shared->clusterSize / sizeof(struct DirEntry);
+    int hops = 0;
+    int ended = 0;
+    entryPlace place;
+    place.dirCluster = cluster;
+    place.ordinal = 0;
+    while(!ended && cluster >= 2 && cluster < 0x0FFFFFF7 && cluster < shared->clusterCount && hops++ < shared->clusterCount){
+        struct DirEntry* entries = (struct DirEntry*)get_cluster(shared->disk, cluster);
+        if(entries == NULL) return;
+        STAT_ADD(STAT_DIR_CLUSTERS, 1);
+        // let the next cluster of the directory read ahead while this one is visited
+        int next = shared->fat[cluster] & 0x0FFFFFFF;
+        STAT_ADD(STAT_FAT_READS, 1);
+        if(next >= 2 && next < shared->clusterCount) advise_clusters(shared->disk, next, 1, DISK_ADVICE_WILLNEED);
+        place.cluster = cluster;
+        for(int i = 0; i < entriesPerCluster; i++, place.ordinal++){
+            struct DirEntry* entry = &entries[i];
+            STAT_ADD(STAT_DIR_ENTRIES, 1);
+            if(entry->DIR_Name[0] == 0x00){
+                // end of directory
+                ended = 1;
+                break;
+            }
+            if(entry->DIR_Attr == 0x0F || (entry->DIR_Attr & 0x08)){
+                // long name slots and the volume label are not files
+                continue;
+            }
+            place.index = i;
+            shared->visit(shared->ctx, worker, path, &place, entry);
+            if(!is_subdirectory(entry)) continue;
+
+            int child = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+            if(!claim_directory(shared, child)) continue;
+            char* childPath = child_path(path, entry);
+            pthread_mutex_lock(&shared->lock);
+            if(shared->count < QUEUE_CAPACITY){
+                dirJob* job = &shared->queue[(shared->head + shared->count) % QUEUE_CAPACITY];
+                job->cluster = child;
+                job->path = childPath;
+                shared->count += 1;
+                pthread_cond_signal(&shared->changed);
+                pthread_mutex_unlock(&shared->lock);
+            }else{
+                // queue is full, walk it here
+                pthread_mutex_unlock(&shared->lock);
+                walk_directory(shared, worker, child, childPath);
+                free(childPath);
+            }
+        }
+        put_cluster(shared->disk, cluster);
+        cluster = next;
+    }
+}
+
+static void* walk_worker(void* arg){
+    walkWorker* worker = (walkWorker*)arg;
+    walkShared* shared = worker->shared;
+    pthread_mutex_lock(&shared->lock);
+    while(1){
+        while(shared->count == 0 && shared->active > 0){
+            pthread_cond_wait(&shared->changed, &shared->lock);
+        }
+        if(shared->count == 0){
+            // nothing queued and nobody left to queue more
+            pthread_cond_broadcast(&shared->changed);
+            break;
+        }
+        dirJob job = shared->queue[shared->head];
+        shared->head = (shared->head + 1) % QUEUE_CAPACITY;
+        shared->count -= 1;
+        shared->active += 1;
+        pthread_mutex_unlock(&shared->lock);
+
+        walk_directory(shared, worker->id, job.cluster, job.path);
+        free(job.path);
+
+        pthread_mutex_lock(&shared->lock);
+        shared->active -= 1;
+        if(shared->active == 0 && shared->count == 0){
+            pthread_cond_broadcast(&shared->changed);
+        }
+    }
+    pthread_mutex_unlock(&shared->lock);
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+void walk_directory_tree(diskImage* disk, int workerCount, entry_visitor visit, void* ctx){
+    struct BootEntry* fs = &disk->boot;
+    walkShared shared;
+    shared.disk = disk;
+    shared.fat = disk_fat(disk);
+    shared.clusterSize = disk->clusterSize;
+    shared.clusterCount = disk->clusterCount;
+    STAT_PHASE_BEGIN(PHASE_DIR_WALK);
+    shared.visit = visit;
+    shared.ctx = ctx;
+    pthread_mutex_init(&shared.lock, NULL);
+    pthread_cond_init(&shared.changed, NULL);
+    shared.visited = calloc((shared.clusterCount + 63) / 64, sizeof(uint64_t));
+    shared.head = 0;
+    shared.count = 0;
+    shared.active = 0;
+
+    if(claim_directory(&shared, fs->BPB_RootClus)){
+        shared.queue[0].cluster = fs->BPB_RootClus;
+        shared.queue[0].path = strdup("");
+        shared.count = 1;
+    }
+
+    walkWorker* workers = malloc(sizeof(walkWorker) * workerCount);
+    for(int w = 0; w < workerCount; w++){
+        workers[w].id = w;
+        workers[w].shared = &shared;
+        workers[w].started = 0;
+    }
+    for(int w = 1; w < workerCount; w++){
+        workers[w].started = pthread_create(&workers[w].thread, NULL, walk_worker, &workers[w]) == 0;
+    }
+    walk_worker(&workers[0]);
+    for(int w = 1; w < workerCount; w++){
+        if(workers[w].started) pthread_join(workers[w].thread, NULL);
+    }
+
+    free(workers);
+    free(shared.visited);
+    pthread_cond_destroy(&shared.changed);
+    pthread_mutex_destroy(&shared.lock);
+    STAT_PHASE_END(PHASE_DIR_WALK);
+}
+
+int resolve_directory(diskImage* disk, const char* path, int* dirCluster){
+    // follows the live directories named in path ("A/B" or "/A/B") from the root
+    struct BootEntry* fs = &disk->boot;
+    unsigned int* fat = disk_fat(disk);
+    int clusterCount = disk->clusterCount;
+    int entriesPerCluster = disk->clusterSize / sizeof(struct DirEntry);
+    int cluster = fs->BPB_RootClus;
+
+    char* copy = strdup(path);
+    char* save = NULL;
+    for(char* part = strtok_r(copy, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save)){
+        nameKey key;
+        int next = -1;
+        if(!make_name_key(part, &key)){
+            free(copy);
+            return 0;
+        }
+        if(disk->index != NULL){
+            // one lookup in the sidecar instead of a walk of the directory
+            if(!sidecar_find_directory(disk->index, cluster, &key, &next)) next = -1;
+        }
+        int walk = disk->index != NULL ? -1 : cluster;
+        int hops = 0;
+        while(next < 0 && walk >= 2 && walk < 0x0FFFFFF7 && walk < clusterCount && hops++ < clusterCount){
+            struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, walk);
+            if(entries == NULL) break;
+            STAT_ADD(STAT_DIR_CLUSTERS, 1);
+            STAT_ADD(STAT_DIR_ENTRIES, entriesPerCluster);
+            for(int i = 0; i < entriesPerCluster; i++){
+                if(entries[i].DIR_Name[0] == 0x00) break;
+                if(is_subdirectory(&entries[i]) && memcmp(entries[i].DIR_Name, key.name, 11) == 0){
+                    next = entries[i].DIR_FstClusHI << 16 | entries[i].DIR_FstClusLO;
+                    break;
+                }
+            }
+            put_cluster(disk, walk);
+            STAT_ADD(STAT_FAT_READS, 1);
+            walk = fat[walk] & 0x0FFFFFFF;
+        }
+        if(next < 0){
+            free(copy);
+            return 0;
+        }
+        cluster = next;
+    }
+    free(copy);
+    *dirCluster = cluster;
+    return 1;
+}
+
+int resolve_parent(diskImage* disk, char* path, int* dirCluster, char** leaf){
+    // splits DIR/SUB/NAME.EXT into the directory cluster and NAME.EXT
+    char* slash = strrchr(path, '/');
+    if(slash == NULL){
+        *dirCluster = disk->boot.BPB_RootClus;
+        *leaf = path;
+        return 1;
+    }
+    *leaf = slash + 1;
+    char* directory = strndup(path, slash - path);
+    int found = resolve_directory(disk, directory, dirCluster);
+    free(directory);
+    return found;
+}
+
+int deleted_entry_clusters(diskImage* disk, int dirCluster, const nameKey* key, int** clusters){
+    // the directory clusters worth scanning for deleted entries matching key, in chain order:
+    // only the ones the sidecar lists, or the whole chain without one
+    if(disk->index != NULL){
+        return sidecar_deleted_clusters(disk->index, dirCluster, key, clusters);
+    }
+    unsigned int* fat = disk_fat(disk);
+    int count = 0;
+    int capacity = 16;
+    *clusters = malloc(sizeof(int) * capacity);
+    int cluster = dirCluster;
+    while(cluster >= 2 && cluster < 0x0FFFFFF7 && cluster < disk->clusterCount && count < disk->clusterCount){
+        if(count == capacity){
+            capacity *= 2;
+            *clusters = realloc(*clusters, sizeof(int) * capacity);
+        }
+        (*clusters)[count++] = cluster;
+        STAT_ADD(STAT_FAT_READS, 1);
+        cluster = fat[cluster] & 0x0FFFFFFF;
+    }
+    return count;
+}
+
+
+// deleted-entry catalog (-L)
+
+typedef struct catalogRecord{
+    char* path;
+    unsigned int size;
+    int startCluster;
+    int contiguous;
+} catalogRecord;
+
+typedef struct catalogList{
+    catalogRecord* records;
+    int count;
+    int capacity;
+} catalogList;
+
+typedef struct catalogContext{
+    catalogList* lists;     // one per worker, merged at the end
+    freeMap* freeClusters;
+    int clusterSize;
+} catalogContext;
+
+static int likely_contiguous(catalogContext* ctx, int start, unsigned int size){
+    // every cluster a contiguous recovery would claim is still free
+    for(unsigned int offset = 0; offset < size; offset += ctx->clusterSize){
+        if(!is_cluster_free(ctx->freeClusters, start++)) return 0;
+    }
+    return 1;
+}
+
+static void catalog_visit(void* arg, int worker, const char* dirPath, const entryPlace* place, struct DirEntry* entry){
+    (void)place;
+    catalogContext* ctx = (catalogContext*)arg;
+    if(entry->DIR_Name[0] != 0xE5) return;
+
+    catalogList* list = &ctx->lists[worker];
+    if(list->count == list->capacity){
+        list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        list->records = realloc(list->records, sizeof(catalogRecord) * list->capacity);
+    }
+    catalogRecord* record = &list->records[list->count++];
+    // the first character of a deleted name is gone, show it as '?'
+    struct DirEntry shown = *entry;
+    shown.DIR_Name[0] = '?';
+    char name[13];
+    format_entry_name(&shown, name);
+    record->path = malloc(strlen(dirPath) + strlen(name) + 2);
+    sprintf(record->path, "%s/%s", dirPath, name);
+    record->size = entry->DIR_FileSize;
+    record->startCluster = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+    record->contiguous = likely_contiguous(ctx, record->startCluster, record->size);
+}
+
+static int compare_records(const void* one, const void* two){
+    return strcmp(((const catalogRecord*)one)->path, ((const catalogRecord*)two)->path);
+}
+
+void print_deleted_catalog(diskImage* disk, int workerCount){
+    catalogContext ctx;
+    ctx.lists = calloc(workerCount, sizeof(catalogList));
+    ctx.freeClusters = build_free_map(disk);
+    ctx.clusterSize = disk->clusterSize;
+
+    walk_directory_tree(disk, workerCount, catalog_visit, &ctx);
+
+    // merge the per-worker lists and print in path order
+    int total = 0;
+    for(int w = 0; w < workerCount; w++) total += ctx.lists[w].count;
+    catalogRecord* records = malloc(sizeof(catalogRecord) * (total + 1));
+    int counter = 0;
+    for(int w = 0; w < workerCount; w++){
+        if(ctx.lists[w].count > 0) memcpy(records + counter, ctx.lists[w].records, sizeof(catalogRecord) * ctx.lists[w].count);
+        counter += ctx.lists[w].count;
+        free(ctx.lists[w].records);
+    }
+    qsort(records, total, sizeof(catalogRecord), compare_records);
+    for(int r = 0; r < total; r++){
+        printf("%s (size = %u, starting cluster = %d, contiguous = %s)\n", records[r].path, records[r].size,
+               records[r].startCluster, records[r].contiguous ? "likely" : "no");
+        free(records[r].path);
+    }
+    printf("Total number of deleted entries = %d\n", total);
+
+    free(records);
+    free(ctx.lists);
+    destroy_free_map(ctx.freeClusters);
+}
@@ -0,0 +1,26 @@
+#ifndef DIRTREE_H
+#define DIRTREE_H
+
+#include "fsinfo.h"
+#include "diskio.h"
+#include "dirscan.h"
+
+// where a visited entry lives
+typedef struct entryPlace{
+    int dirCluster;         // first cluster of the directory
+    int cluster;            // directory cluster holding the entry
+    int index;              // slot within that cluster
+    int ordinal;            // slot within the whole directory
+} entryPlace;
+
+// called for every entry of every directory; may run on several workers at once
+typedef void (*entry_visitor)(void* ctx, int worker, const char* dirPath, const entryPlace* place, struct DirEntry* entry);
+
+void walk_directory_tree(diskImage* disk, int workerCount, entry_visitor visit, void* ctx);
+int resolve_directory(diskImage* disk, const char* path, int* dirCluster);
+int resolve_parent(diskImage* disk, char* path, int* dirCluster, char** leaf);
+int deleted_entry_clusters(diskImage* disk, int dirCluster, const nameKey* key, int** clusters);
+void format_entry_name(struct DirEntry* entry, char* fileName);
+void print_deleted_catalog(diskImage* disk, int workerCount);
+
+#endif
@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "kernels.h"
+#include "stats.h"
+
+// image I/O with 64-bit offsets
+//
+// two backends sit behind get_cluster/put_cluster:
+//  - mmap: the image is mapped lazily in 64 MB windows, each overlapping the
+//    next by the largest legal cluster, or by one cluster of an out-of-spec
+//    volume with larger ones, so no cluster straddles two mappings.
+//    windows stay mapped, so pointers stay valid, but once more than the
+//    cache budget is resident the coldest window is dropped with MADV_DONTNEED.
+//  - pread: clusters are read into a bounded cache. get_cluster pins a slot
+//    and put_cluster releases it; eviction is clock order over unpinned
+//    slots, and dirty slots are written back when evicted or flushed.
+// the FAT is kept whole in both: mapped with sequential read-ahead, or read
+// into memory once on first use.
+// a sparse image has its holes listed once at open with SEEK_HOLE/SEEK_DATA;
+// clusters wholly inside one are answered from a shared zero cluster, so
+// neither backend faults in or reads pages that are known to be zeros.
+
+#define WINDOW_SHIFT 26
+#define WINDOW_SIZE (1ULL << WINDOW_SHIFT)
+#define WINDOW_OVERLAP (32ULL << 10)
+#define MIN_CACHE_SLOTS 64
+
+static uint64_t device_size(int fd, struct stat* sb){
+    if(S_ISBLK(sb->st_mode)){
+        uint64_t bytes = 0;
+        if(ioctl(fd, BLKGETSIZE64, &bytes) == 0) return bytes;
+        off_t end = lseek(fd, 0, SEEK_END);
+        return end > 0 ? (uint64_t)end : 0;
+    }
+    return (uint64_t)sb->st_size;
+}
+
+static int pread_full(int fd, void* buffer, size_t length, uint64_t offset){
+    // reads past the end of the image come back as zeros
+    char* out = (char*)buffer;
+    while(length > 0){
+        ssize_t got = pread(fd, out, length, (off_t)offset);
+        if(got < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(got == 0){
+            memset(out, 0, length);
+            return 0;
+        }
+        out += got;
+        offset += (uint64_t)got;
+        length -= (size_t)got;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void* buffer, size_t length, uint64_t offset){
+    const char* in = (const char*)buffer;
+    while(length > 0){
+        ssize_t put = pwrite(fd, in, length, (off_t)offset);
+        if(put < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        in += put;
+        offset += (uint64_t)put;
+        length -= (size_t)put;
+    }
+    return 0;
+}
+
+int read_disk(diskImage* disk, uint64_t offset, void* buffer, size_t length){
+    return pread_full(disk->fd, buffer, length, offset);
+}
+
+int write_disk(diskImage* disk, uint64_t offset, const void* buffer, size_t length){
+    return pwrite_full(disk->fd, buffer, length, offset);
+}
+
+static void set_bits(uint64_t* bits, uint64_t first, uint64_t end){
+    // bits first..end-1, whole words at a time in the middle
+    for(; first < end && (first & 63) != 0; first++) bits[first >> 6] |= 1ULL << (first & 63);
+    for(; first + 64 <= end; first += 64) bits[first >> 6] = ~0ULL;
+    for(; first < end; first++) bits[first >> 6] |= 1ULL << (first & 63);
+}
+
+static void add_hole(diskImage* disk, int* capacity, uint64_t offset, uint64_t length){
+    if(disk->holeCount == *capacity){
+        *capacity = *capacity == 0 ? 16 : *capacity * 2;
+        disk->holes = realloc(disk->holes, sizeof(diskExtent) * (*capacity));
+    }
+    disk->holes[disk->holeCount].offset = offset;
+    disk->holes[disk->holeCount].length = length;
+    disk->holeCount += 1;
+}
+
+static void find_holes(diskImage* disk){
+    // a filesystem without hole tracking reports a single hole at the end, so finds none
+    int capacity = 0;
+    uint64_t position = 0;
+    while(position < disk->size){
+        off_t hole = lseek(disk->fd, (off_t)position, SEEK_HOLE);
+        if(hole < 0 || (uint64_t)hole >= disk->size) break;
+        off_t data = lseek(disk->fd, hole, SEEK_DATA);
+        if(data < 0 && errno != ENXIO) break;
+        // ENXIO: no data after the hole, it runs to the end
+        uint64_t end = data < 0 || (uint64_t)data > disk->size ? disk->size : (uint64_t)data;
+        add_hole(disk, &capacity, (uint64_t)hole, end - (uint64_t)hole);
+        position = end;
+    }
+    if(disk->holeCount == 0) return;
+
+    disk->zeroCluster = mmap(NULL, disk->clusterSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(disk->zeroCluster == MAP_FAILED){
+        disk->zeroCluster = NULL;
+        forget_holes(disk);
+        return;
+    }
+    disk->holeClusters = calloc(((size_t)disk->clusterCount + 63) / 64, sizeof(uint64_t));
+    uint64_t clusters = disk->clusterCount > 2 ? (uint64_t)disk->clusterCount - 2 : 0;
+    for(int h = 0; h < disk->holeCount; h++){
+        uint64_t start = disk->holes[h].offset;
+        uint64_t end = start + disk->holes[h].length;
+        if(end <= disk->dataOffset) continue;
+        if(start < disk->dataOffset) start = disk->dataOffset;
+        // whole clusters only, a cluster partly holding data is read as usual
+        uint64_t first = (start - disk->dataOffset + disk->clusterSize - 1) >> disk->clusterShift;
+        uint64_t last = (end - disk->dataOffset) >> disk->clusterShift;
+        if(last > clusters) last = clusters;
+        if(first < last) set_bits(disk->holeClusters, first + 2, last + 2);
+    }
+}
+
+diskImage* open_disk(const char* path, int writable, int backend, size_t cacheBytes){
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if(fd < 0){
+        perror(path);
+        return NULL;
+    }
+    struct stat sb;
+    if(fstat(fd, &sb) < 0){
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+
+    diskImage* disk = calloc(1, sizeof(diskImage));
+    disk->fd = fd;
+    disk->writable = writable;
+    disk->size = device_size(fd, &sb);
+    disk->backend = backend;
+    if(backend == DISK_BACKEND_AUTO){
+        disk->backend = S_ISBLK(sb.st_mode) ? DISK_BACKEND_PREAD : DISK_BACKEND_MMAP;
+    }
+    if(cacheBytes == 0) cacheBytes = DISK_DEFAULT_CACHE;
+
+    if(disk->size < sizeof(struct BootEntry) || pread_full(fd, &disk->boot, sizeof(struct BootEntry), 0) < 0
+       || disk->boot.BPB_BytsPerSec == 0 || disk->boot.BPB_SecPerClus == 0 || disk->boot.BPB_FATSz32 == 0
+       || (disk->boot.BPB_BytsPerSec & (disk->boot.BPB_BytsPerSec - 1)) != 0 || (disk->boot.BPB_SecPerClus & (disk->boot.BPB_SecPerClus - 1)) != 0){
+        fprintf(stderr, "%s: not a FAT32 image\n", path);
+        close(fd);
+        free(disk);
+        return NULL;
+    }
+    disk->clusterSize = bytes_per_cluster(disk);
+    disk->clusterShift = __builtin_ctz((unsigned int)disk->clusterSize);
+    disk->dataOffset = data_area_offset(disk);
+    disk->clusterCount = cluster_count(disk);
+    disk->fatOffset = fat_area_offset(disk);
+    disk->fatBytes = fat_per_table_offset(disk);
+    disk->fatCount = num_fat_tables(disk);
+    int active = disk->boot.BPB_ExtFlags & FAT_ACTIVE_MASK;
+    if((disk->boot.BPB_ExtFlags & FAT_MIRROR_OFF) && active < disk->fatCount){
+        // mirroring off: only the active copy is read and written, the others are stale
+        disk->fatOffset += (uint64_t)active * disk->fatBytes;
+        disk->fatCount = 1;
+    }
+    disk->kernel = -1;
+    if(disk->clusterShift >= CLUSTER_SHIFT_MIN && disk->clusterShift <= CLUSTER_SHIFT_MAX){
+        disk->kernel = disk->clusterShift - CLUSTER_SHIFT_MIN;
+    }
+    pthread_mutex_init(&disk->lock, NULL);
+    if(S_ISREG(sb.st_mode)) find_holes(disk);
+
+    if(disk->backend == DISK_BACKEND_MMAP){
+        disk->windowCount = (int)(disk->size >> WINDOW_SHIFT) + 1;
+        disk->windows = calloc(disk->windowCount, sizeof(diskWindow));
+        disk->windowBudget = (int)(cacheBytes / WINDOW_SIZE);
+        if(disk->windowBudget < 2) disk->windowBudget = 2;
+    }else{
+        disk->slotLimit = (int)(cacheBytes / disk->clusterSize);
+        if(disk->slotLimit < MIN_CACHE_SLOTS) disk->slotLimit = MIN_CACHE_SLOTS;
+        disk->slotCapacity = MIN_CACHE_SLOTS;
+        disk->slots = calloc(disk->slotCapacity, sizeof(cacheSlot));
+        // the index doubles with the slots, see grow_slots
+        disk->slotIndexSize = 256;
+        disk->slotIndex = malloc(sizeof(int) * disk->slotIndexSize);
+        for(int i = 0; i < disk->slotIndexSize; i++) disk->slotIndex[i] = -1;
+    }
+    return disk;
+}
+
+
+// mmap backend
+
+static void trim_windows(diskImage* disk, int keep){
+    // caller holds the lock; drop the coldest resident windows over budget, never keep
+    while(disk->residentWindows > disk->windowBudget){
+        int coldest = -1;
+        for(int w = 0; w < disk->windowCount; w++){
+            if(w == keep || disk->windows[w].base == NULL || !disk->windows[w].resident) continue;
+            if(coldest < 0 || disk->windows[w].lastUse < disk->windows[coldest].lastUse) coldest = w;
+        }
+        if(coldest < 0) return;
+        madvise(disk->windows[coldest].base, disk->windows[coldest].length, MADV_DONTNEED);
+        __atomic_store_n(&disk->windows[coldest].resident, 0, __ATOMIC_RELEASE);
+        disk->residentWindows -= 1;
+    }
+}
+
+static char* window_pointer(diskImage* disk, uint64_t offset){
+    int w = (int)(offset >> WINDOW_SHIFT);
+    diskWindow* window = &disk->windows[w];
+    char* base = __atomic_load_n(&window->base, __ATOMIC_ACQUIRE);
+    unsigned long tick = __atomic_add_fetch(&disk->tick, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&window->lastUse, tick, __ATOMIC_RELAXED);
+    if(base != NULL && __atomic_load_n(&window->resident, __ATOMIC_ACQUIRE)){
+        return base + (offset - ((uint64_t)w << WINDOW_SHIFT));
+    }
+
+    pthread_mutex_lock(&disk->lock);
+    if(window->base == NULL){
+        uint64_t start = (uint64_t)w << WINDOW_SHIFT;
+        uint64_t overlap = (uint64_t)disk->clusterSize > WINDOW_OVERLAP ? (uint64_t)disk->clusterSize : WINDOW_OVERLAP;
+        uint64_t length = WINDOW_SIZE + overlap;
+        if(start + length > disk->size) length = disk->size - start;
+        int protection = PROT_READ | (disk->writable ? PROT_WRITE : 0);
+        char* mapping = mmap(NULL, length, protection, MAP_SHARED, disk->fd, (off_t)start);
+        if(mapping == MAP_FAILED){
+            pthread_mutex_unlock(&disk->lock);
+            return NULL;
+        }
+        window->length = length;
+        __atomic_store_n(&window->base, mapping, __ATOMIC_RELEASE);
+    }
+    if(!window->resident){
+        STAT_ADD(STAT_WINDOW_MAPS, 1);
+        disk->residentWindows += 1;
+        trim_windows(disk, w);
+        __atomic_store_n(&window->resident, 1, __ATOMIC_RELEASE);
+    }
+    base = window->base;
+    pthread_mutex_unlock(&disk->lock);
+    return base + (offset - ((uint64_t)w << WINDOW_SHIFT));
+}
+
+
+// pread backend
+
+static uint32_t slot_hash(int cluster, int size){
+    return ((uint32_t)cluster * 2654435761u) & (uint32_t)(size - 1);
+}
+
+static int find_slot(diskImage* disk, int cluster){
+    uint32_t i = slot_hash(cluster, disk->slotIndexSize);
+    while(disk->slotIndex[i] >= 0){
+        if(disk->slots[disk->slotIndex[i]].cluster == cluster) return disk->slotIndex[i];
+        i = (i + 1) & (disk->slotIndexSize - 1);
+    }
+    return -1;
+}
+
+static void index_insert(diskImage* disk, int slot){
+    uint32_t i = slot_hash(disk->slots[slot].cluster, disk->slotIndexSize);
+    while(disk->slotIndex[i] >= 0) i = (i + 1) & (disk->slotIndexSize - 1);
+    disk->slotIndex[i] = slot;
+}
+
+static void index_remove(diskImage* disk, int cluster){
+    // backward-shift deletion keeps probe chains intact without tombstones
+    int mask = disk->slotIndexSize - 1;
+    uint32_t i = slot_hash(cluster, disk->slotIndexSize);
+    while(disk->slotIndex[i] >= 0 && disk->slots[disk->slotIndex[i]].cluster != cluster) i = (i + 1) & mask;
+    if(disk->slotIndex[i] < 0) return;
+    uint32_t hole = i;
+    uint32_t j = i;
+    while(1){
+        j = (j + 1) & mask;
+        if(disk->slotIndex[j] < 0) break;
+        uint32_t home = slot_hash(disk->slots[disk->slotIndex[j]].cluster, disk->slotIndexSize);
+        if(((j - home) & mask) >= ((j - hole) & mask)){
+            disk->slotIndex[hole] = disk->slotIndex[j];
+            hole = j;
+        }
+    }
+    disk->slotIndex[hole] = -1;
+}
+
+static uint64_t cluster_offset(diskImage* disk, int cluster){
+    return disk->dataOffset + ((uint64_t)(cluster - 2) << disk->clusterShift);
+}
+
+static void write_back(diskImage* disk, cacheSlot* slot){
+    if(slot->dirty && slot->cluster >= 0){
+        if(pwrite_full(disk->fd, slot->data, disk->clusterSize, cluster_offset(disk, slot->cluster)) < 0){
+            perror("write back");
+        }
+        slot->dirty = 0;
+    }
+}
+
+static int grow_slots(diskImage* disk){
+    // only when every slot is pinned; buffers are separate so pinned pointers survive
+    if(disk->slotCount == disk->slotCapacity){
+        disk->slotCapacity *= 2;
+        disk->slots = realloc(disk->slots, sizeof(cacheSlot) * disk->slotCapacity);
+    }
+    if(disk->slotCount * 2 >= disk->slotIndexSize){
+        free(disk->slotIndex);
+        disk->slotIndexSize *= 2;
+        disk->slotIndex = malloc(sizeof(int) * disk->slotIndexSize);
+        for(int i = 0; i < disk->slotIndexSize; i++) disk->slotIndex[i] = -1;
+        for(int s = 0; s < disk->slotCount; s++){
+            if(disk->slots[s].cluster >= 0) index_insert(disk, s);
+        }
+    }
+    cacheSlot* slot = &disk->slots[disk->slotCount];
+    slot->cluster = -1;
+    slot->pins = 0;
+    slot->dirty = 0;
+    slot->referenced = 0;
+    slot->data = malloc(disk->clusterSize);
+    return disk->slotCount++;
+}
+
+static int choose_victim(diskImage* disk){
+    if(disk->slotCount < disk->slotLimit){
+        return grow_slots(disk);
+    }
+    // two sweeps of the clock: the first clears reference bits
+    for(int step = 0; step < disk->slotCount * 2; step++){
+        int s = disk->clockHand;
+        disk->clockHand = (disk->clockHand + 1) % disk->slotCount;
+        cacheSlot* slot = &disk->slots[s];
+        if(slot->pins > 0) continue;
+        if(slot->referenced){
+            slot->referenced = 0;
+            continue;
+        }
+        return s;
+    }
+    return grow_slots(disk);
+}
+
+static char* cached_cluster(diskImage* disk, int cluster){
+    // the lock is held across the read, so misses are serialized
+    pthread_mutex_lock(&disk->lock);
+    int s = find_slot(disk, cluster);
+    if(s < 0){
+        STAT_ADD(STAT_CACHE_MISSES, 1);
+        s = choose_victim(disk);
+        cacheSlot* slot = &disk->slots[s];
+        write_back(disk, slot);
+        if(slot->cluster >= 0) index_remove(disk, slot->cluster);
+        if(pread_full(disk->fd, slot->data, disk->clusterSize, cluster_offset(disk, cluster)) < 0){
+            slot->cluster = -1;
+            pthread_mutex_unlock(&disk->lock);
+            return NULL;
+        }
+        slot->cluster = cluster;
+        index_insert(disk, s);
+    }
+    disk->slots[s].pins += 1;
+    disk->slots[s].referenced = 1;
+    char* data = disk->slots[s].data;
+    pthread_mutex_unlock(&disk->lock);
+    return data;
+}
+
+
+// cluster access, shared by both backends
+
+char* get_cluster(diskImage* disk, int cluster){
+    // pinned pointer to the cluster, NULL if it is outside the volume
+    if(cluster < 2 || cluster >= disk->clusterCount) return NULL;
+    STAT_ADD(STAT_CLUSTER_READS, 1);
+    if(cluster_in_hole(disk, cluster)){
+        STAT_ADD(STAT_HOLE_READS, 1);
+        return disk->zeroCluster;
+    }
+    if(disk->backend == DISK_BACKEND_MMAP){
+        uint64_t offset = cluster_offset(disk, cluster);
+        if(offset + (uint64_t)disk->clusterSize > disk->size) return NULL;
+        return window_pointer(disk, offset);
+    }
+    return cached_cluster(disk, cluster);
+}
+
+void put_cluster(diskImage* disk, int cluster){
+    if(disk->backend == DISK_BACKEND_MMAP || cluster < 2 || cluster_in_hole(disk, cluster)) return;
+    pthread_mutex_lock(&disk->lock);
+    int s = find_slot(disk, cluster);
+    if(s >= 0 && disk->slots[s].pins > 0) disk->slots[s].pins -= 1;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+void mark_cluster_dirty(diskImage* disk, int cluster){
+    if(disk->backend == DISK_BACKEND_MMAP) return;
+    pthread_mutex_lock(&disk->lock);
+    int s = find_slot(disk, cluster);
+    if(s >= 0) disk->slots[s].dirty = 1;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+void advise_clusters(diskImage* disk, int cluster, int count, int advice){
+    if(cluster < 2 || count <= 0) return;
+    uint64_t offset = cluster_offset(disk, cluster);
+    uint64_t length = (uint64_t)count << disk->clusterShift;
+    if(offset >= disk->size) return;
+    if(offset + length > disk->size) length = disk->size - offset;
+    if(disk->backend == DISK_BACKEND_MMAP){
+        char* start = window_pointer(disk, offset);
+        if(start == NULL) return;
+        // stay inside the window the first cluster lives in
+        uint64_t windowEnd = ((offset >> WINDOW_SHIFT) << WINDOW_SHIFT) + disk->windows[offset >> WINDOW_SHIFT].length;
+        if(offset + length > windowEnd) length = windowEnd - offset;
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t alignedStart = (uintptr_t)start & ~(page - 1);
+        madvise((void*)alignedStart, length + ((uintptr_t)start - alignedStart),
+                advice == DISK_ADVICE_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_WILLNEED);
+    }else{
+        posix_fadvise(disk->fd, (off_t)offset, (off_t)length,
+                      advice == DISK_ADVICE_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_WILLNEED);
+    }
+}
+
+
+// holes
+
+int cluster_in_hole(diskImage* disk, int cluster){
+    if(disk->holeClusters == NULL || cluster < 2 || cluster >= disk->clusterCount) return 0;
+    return (disk->holeClusters[cluster >> 6] >> (cluster & 63)) & 1;
+}
+
+int next_data_cluster(diskImage* disk, int cluster, int end){
+    // first cluster in cluster..end-1 that is not a hole, end if there is none
+    if(disk->holeClusters == NULL) return cluster;
+    while(cluster < end){
+        uint64_t data = ~disk->holeClusters[cluster >> 6] >> (cluster & 63);
+        if(data != 0){
+            cluster += __builtin_ctzll(data);
+            return cluster < end ? cluster : end;
+        }
+        cluster = (cluster | 63) + 1;
+    }
+    return end;
+}
+
+int range_in_hole(diskImage* disk, uint64_t offset, uint64_t length){
+    // 1 when every byte of the range lies inside one hole
+    int low = 0, high = disk->holeCount;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(disk->holes[middle].offset <= offset) low = middle + 1;
+        else high = middle;
+    }
+    if(low == 0) return 0;
+    const diskExtent* hole = &disk->holes[low - 1];
+    return offset + length <= hole->offset + hole->length;
+}
+
+void forget_holes(diskImage* disk){
+    // before the image is written; pointers to the zero cluster stay valid until close
+    free(disk->holes);
+    free(disk->holeClusters);
+    disk->holes = NULL;
+    disk->holeClusters = NULL;
+    disk->holeCount = 0;
+}
+
+
+// FAT access
+
+unsigned int* disk_fat(diskImage* disk){
+    // the FAT in use, kept whole for the lifetime of the image
+    pthread_mutex_lock(&disk->lock);
+    if(disk->fat == NULL){
+        STAT_PHASE_BEGIN(PHASE_MAP);
+        uint64_t fatOffset = disk->fatOffset;
+        uint64_t fatBytes = disk->fatBytes;
+        if(disk->backend == DISK_BACKEND_MMAP){
+            uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+            uint64_t start = fatOffset & ~(page - 1);
+            uint64_t length = fatOffset - start + fatBytes * disk->fatCount;
+            int protection = PROT_READ | (disk->writable ? PROT_WRITE : 0);
+            char* mapping = mmap(NULL, length, protection, MAP_SHARED, disk->fd, (off_t)start);
+            if(mapping != MAP_FAILED){
+                madvise(mapping, length, MADV_WILLNEED);
+                madvise(mapping, length, MADV_SEQUENTIAL);
+                disk->fatMapping = mapping;
+                disk->fatMappingLength = length;
+                disk->fat = (unsigned int*)(mapping + (fatOffset - start));
+            }
+        }
+        if(disk->fat == NULL){
+            // pread backend, or the mapping failed: read the copy in use
+            disk->fat = malloc(fatBytes);
+            if(disk->fat != NULL && pread_full(disk->fd, disk->fat, fatBytes, fatOffset) < 0){
+                perror("read FAT");
+            }
+        }
+        STAT_PHASE_END(PHASE_MAP);
+    }
+    unsigned int* fat = disk->fat;
+    pthread_mutex_unlock(&disk->lock);
+    return fat;
+}
+
+int flush_disk(diskImage* disk){
+    int status = 0;
+    pthread_mutex_lock(&disk->lock);
+    for(int s = 0; s < disk->slotCount; s++){
+        write_back(disk, &disk->slots[s]);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return status;
+}
+
+void close_disk(diskImage* disk){
+    if(disk->writable) flush_disk(disk);
+    if(disk->fatMapping != NULL){
+        munmap(disk->fatMapping, disk->fatMappingLength);
+    }else{
+        free(disk->fat);
+    }
+    for(int w = 0; w < disk->windowCount; w++){
+        if(disk->windows[w].base != NULL) munmap(disk->windows[w].base, disk->windows[w].length);
+    }
+    free(disk->windows);
+    for(int s = 0; s < disk->slotCount; s++){
+        free(disk->slots[s].data);
+    }
+    free(disk->slots);
+    free(disk->slotIndex);
+    forget_holes(disk);
+    if(disk->zeroCluster != NULL) munmap(disk->zeroCluster, disk->clusterSize);
+    pthread_mutex_destroy(&disk->lock);
+    close(disk->fd);
+    free(disk);
+}
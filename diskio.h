@@ -0,0 +1,110 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "fsinfo.h"
+
+#define DISK_BACKEND_AUTO 0         // pread for block devices, mmap windows otherwise
+#define DISK_BACKEND_MMAP 1
+#define DISK_BACKEND_PREAD 2
+
+#define DISK_ADVICE_WILLNEED 1
+#define DISK_ADVICE_SEQUENTIAL 2
+
+#define DISK_DEFAULT_CACHE (1024UL << 20)
+
+#define FAT_MIRROR_OFF 0x80         // BPB_ExtFlags: only the active FAT is in use
+#define FAT_ACTIVE_MASK 0x0F        // BPB_ExtFlags: which FAT that is
+
+typedef struct diskWindow{
+    char* base;                     // mapping of one window plus the overlap, NULL until touched
+    uint64_t length;
+    int resident;                   // pages may be resident, cleared when trimmed
+    unsigned long lastUse;
+} diskWindow;
+
+typedef struct diskExtent{
+    uint64_t offset;
+    uint64_t length;
+} diskExtent;
+
+typedef struct cacheSlot{
+    int cluster;                    // -1 while unused
+    int pins;
+    int dirty;
+    int referenced;                 // clock bit
+    char* data;
+} cacheSlot;
+
+typedef struct diskImage{
+    int fd;
+    int writable;
+    int backend;
+    uint64_t size;
+    struct BootEntry boot;          // copy of the boot sector
+    // geometry, parsed from the boot sector once when the image is opened
+    uint64_t dataOffset;
+    int clusterSize;
+    int clusterShift;               // clusterSize is 1 << clusterShift
+    int clusterCount;
+    uint64_t fatOffset;             // the FAT in use: the first, or the active one when mirroring is off
+    uint64_t fatBytes;              // one FAT copy
+    int fatCount;                   // copies kept in step from fatOffset on, 1 when mirroring is off
+    int kernel;                     // index into the FOR_EACH_CLUSTER_SIZE kernels, -1 for the generic ones
+
+    pthread_mutex_t lock;
+
+    // FAT area, every copy: one mapping (mmap) or the first copy read into memory (pread)
+    unsigned int* fat;
+    char* fatMapping;
+    uint64_t fatMappingLength;
+
+    // mmap backend: lazily mapped windows, cold ones trimmed with MADV_DONTNEED
+    diskWindow* windows;
+    int windowCount;
+    int residentWindows;
+    int windowBudget;
+    unsigned long tick;
+
+    // pread backend: bounded cluster cache with pinning and clock eviction
+    cacheSlot* slots;
+    int slotCount;
+    int slotCapacity;
+    int slotLimit;
+    int* slotIndex;                 // open addressing, cluster -> slot
+    int slotIndexSize;
+    int clockHand;
+
+    // sparse regular files: holes found once at open and served as zeros without touching the file
+    diskExtent* holes;              // sorted, NULL when the image has none
+    int holeCount;
+    uint64_t* holeClusters;         // bit per cluster lying wholly inside a hole
+    char* zeroCluster;              // read-only zeros handed out for hole clusters
+
+    struct sidecarIndex* index;     // attached by open_sidecar when --index is given, NULL otherwise
+    struct volumeCheck* check;      // attached for a recovery run with -c, NULL otherwise
+} diskImage;
+
+diskImage* open_disk(const char* path, int writable, int backend, size_t cacheBytes);
+void close_disk(diskImage* disk);
+int flush_disk(diskImage* disk);
+
+char* get_cluster(diskImage* disk, int cluster);
+void put_cluster(diskImage* disk, int cluster);
+void mark_cluster_dirty(diskImage* disk, int cluster);
+void advise_clusters(diskImage* disk, int cluster, int count, int advice);
+
+int cluster_in_hole(diskImage* disk, int cluster);
+int next_data_cluster(diskImage* disk, int cluster, int end);
+int range_in_hole(diskImage* disk, uint64_t offset, uint64_t length);
+void forget_holes(diskImage* disk);
+
+unsigned int* disk_fat(diskImage* disk);
+
+int read_disk(diskImage* disk, uint64_t offset, void* buffer, size_t length);
+int write_disk(diskImage* disk, uint64_t offset, const void* buffer, size_t length);
+
+#endif
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "extract.h"
+
+// extraction to the host (-x outdir)
+//
+// the image is opened read-only and the recovered file is written to
+// outdir/DIR/NAME instead of being linked back into the volume. the data never
+// passes through a buffer of ours: a run of consecutive clusters is copied
+// file to file by the kernel with copy_file_range, or sendfile where the
+// filesystems do not allow it, and with the mmap backend a fragmented chain
+// is gathered straight out of the mapped windows into pwritev. the pread
+// backend has no mapping to gather from, so it copies every run of the chain
+// like a contiguous file.
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static uint64_t data_offset(diskImage* disk, int cluster){
+    return disk->dataOffset + ((uint64_t)(cluster - 2) << disk->clusterShift);
+}
+
+static int make_directory(const char* path){
+    if(mkdir(path, 0755) < 0 && errno != EEXIST){
+        perror(path);
+        return 0;
+    }
+    return 1;
+}
+
+static int open_output(const char* outDir, const char* name){
+    // a name given as DIR/SUB/NAME.EXT lands as outdir/DIR/SUB/NAME.EXT, so
+    // the same NAME.EXT from two directories does not end up in one file
+    if(!make_directory(outDir)) return -1;
+    char* path = malloc(strlen(outDir) + strlen(name) + 2);
+    int length = sprintf(path, "%s/", outDir);
+    const char* component = name;
+    const char* slash;
+    while((slash = strchr(component, '/')) != NULL){
+        int size = slash - component;
+        if(size == 0){
+            component = slash + 1;
+            continue;
+        }
+        if((size == 1 && component[0] == '.') || (size == 2 && strncmp(component, "..", 2) == 0)){
+            // an image path could otherwise climb out of outdir
+            fprintf(stderr, "%s: refusing to extract outside %s\n", name, outDir);
+            free(path);
+            return -1;
+        }
+        length += sprintf(path + length, "%.*s", size, component);
+        if(!make_directory(path)){
+            free(path);
+            return -1;
+        }
+        path[length++] = '/';
+        component = slash + 1;
+    }
+    strcpy(path + length, component);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) perror(path);
+    free(path);
+    return fd;
+}
+
+static int copy_span(diskImage* disk, int out, uint64_t from, uint64_t length, uint64_t to){
+    // length bytes of the image at from to out at to, inside the kernel
+    loff_t in = (loff_t)from;
+    loff_t at = (loff_t)to;
+    uint64_t remaining = length;
+    while(remaining > 0){
+        ssize_t copied = copy_file_range(disk->fd, &in, out, &at, remaining, 0);
+        if(copied < 0 && errno == EINTR) continue;
+        if(copied <= 0) break;
+        remaining -= (uint64_t)copied;
+    }
+    if(remaining > 0){
+        // across filesystems or on kernels without copy_file_range
+        off_t offset = (off_t)in;
+        if(lseek(out, (off_t)at, SEEK_SET) < 0) return -1;
+        while(remaining > 0){
+            ssize_t copied = sendfile(out, disk->fd, &offset, remaining);
+            if(copied < 0 && errno == EINTR) continue;
+            if(copied <= 0) return -1;
+            remaining -= (uint64_t)copied;
+        }
+    }
+    return 0;
+}
+
+static int write_spans(int out, struct iovec* spans, int count, uint64_t to){
+    // pwritev until every span is out, resuming after short writes
+    int first = 0;
+    while(first < count){
+        ssize_t written = pwritev(out, spans + first, count - first, (off_t)to);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return -1;
+        to += (uint64_t)written;
+        while(first < count && (size_t)written >= spans[first].iov_len){
+            written -= (ssize_t)spans[first].iov_len;
+            first++;
+        }
+        if(first < count){
+            spans[first].iov_base = (char*)spans[first].iov_base + written;
+            spans[first].iov_len -= (size_t)written;
+        }
+    }
+    return 0;
+}
+
+static int gather_chain(diskImage* disk, int out, const int* chain, int chainSize, unsigned int fileSize){
+    // mmap backend: the chain's clusters, mapped, as the iovecs of one pwritev per batch
+    struct iovec spans[EXTRACT_SPANS < IOV_MAX ? EXTRACT_SPANS : IOV_MAX];
+    uint64_t written = 0;
+    int next = 0;
+    while(next < chainSize && written < fileSize){
+        int count = 0;
+        uint64_t batch = 0;
+        int first = next;
+        for(; next < chainSize && written + batch < fileSize && count < (int)(sizeof(spans) / sizeof(spans[0])); next++){
+            char* data = get_cluster(disk, chain[next]);
+            if(data == NULL) break;
+            uint64_t left = fileSize - written - batch;
+            size_t length = left < (uint64_t)disk->clusterSize ? (size_t)left : (size_t)disk->clusterSize;
+            // neighbours in one window make one span
+            if(count > 0 && (char*)spans[count-1].iov_base + spans[count-1].iov_len == data){
+                spans[count-1].iov_len += length;
+            }else{
+                spans[count].iov_base = data;
+                spans[count].iov_len = length;
+                count++;
+            }
+            batch += length;
+        }
+        int status = count > 0 ? write_spans(out, spans, count, written) : -1;
+        for(int c = first; c < next; c++) put_cluster(disk, chain[c]);
+        if(status < 0) return -1;
+        written += batch;
+    }
+    return written == fileSize ? 0 : -1;
+}
+
+static int copy_chain(diskImage* disk, int out, const int* chain, int chainSize, unsigned int fileSize){
+    // pread backend: every run of consecutive clusters is one kernel copy
+    uint64_t written = 0;
+    int c = 0;
+    while(c < chainSize && written < fileSize){
+        int run = 1;
+        while(c + run < chainSize && chain[c + run] == chain[c] + run) run++;
+        uint64_t length = (uint64_t)run << disk->clusterShift;
+        if(length > fileSize - written) length = fileSize - written;
+        if(chain[c] < 2 || chain[c] + run > disk->clusterCount) return -1;
+        if(copy_span(disk, out, data_offset(disk, chain[c]), length, written) < 0) return -1;
+        written += length;
+        c += run;
+    }
+    return written == fileSize ? 0 : -1;
+}
+
+static int finish_output(int out, int status){
+    if(close(out) < 0) status = -1;
+    return status == 0;
+}
+
+int extract_contiguous(diskImage* disk, struct DirEntry* entry, const char* name, const char* outDir){
+    // writes the clusters a contiguous recovery would claim to outDir/name, returns 0 on failure
+    int start = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+    uint64_t size = entry->DIR_FileSize;
+    uint64_t clusters = (size + disk->clusterSize - 1) / disk->clusterSize;
+    int out = open_output(outDir, name);
+    if(out < 0) return 0;
+    int status = 0;
+    if(size > 0){
+        if(start < 2 || (uint64_t)start + clusters > (uint64_t)disk->clusterCount){
+            status = -1;
+        }else{
+            status = copy_span(disk, out, data_offset(disk, start), size, 0);
+        }
+    }
+    return finish_output(out, status);
+}
+
+int extract_chain(diskImage* disk, const int* chain, int chainSize, unsigned int fileSize, const char* name, const char* outDir){
+    // writes the first fileSize bytes of the cluster chain to outDir/name, returns 0 on failure
+    int out = open_output(outDir, name);
+    if(out < 0) return 0;
+    int status = 0;
+    if(fileSize > 0){
+        if(disk->backend == DISK_BACKEND_MMAP){
+            status = gather_chain(disk, out, chain, chainSize, fileSize);
+        }else{
+            status = copy_chain(disk, out, chain, chainSize, fileSize);
+        }
+    }
+    return finish_output(out, status);
+}
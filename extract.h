@@ -0,0 +1,12 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "fsinfo.h"
+#include "diskio.h"
+
+#define EXTRACT_SPANS 256           // clusters gathered into one pwritev
+
+int extract_contiguous(diskImage* disk, struct DirEntry* entry, const char* name, const char* outDir);
+int extract_chain(diskImage* disk, const int* chain, int chainSize, unsigned int fileSize, const char* name, const char* outDir);
+
+#endif
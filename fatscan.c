@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "nyufile.h"
+#include "fatscan.h"
+#include "stats.h"
+
+// FAT analysis in one streaming pass over the first FAT
+//
+// a kernel classifies 64 entries at a time into free / end-of-chain / bad
+// masks; the masks are folded into counts, the free bitmap, free-run extents
+// and the marker lists while they are still in registers. the widest kernel
+// the CPU supports is picked once, on first use.
+
+#define BLOCK_ENTRIES 64
+#define CHUNK_BLOCKS 64
+
+typedef void (*classify_kernel)(const uint32_t* fat, int blocks, uint64_t* freeMask, uint64_t* eocMask, uint64_t* badMask);
+
+static void classify_scalar(const uint32_t* fat, int blocks, uint64_t* freeMask, uint64_t* eocMask, uint64_t* badMask){
+    for(int b = 0; b < blocks; b++){
+        uint64_t f = 0, e = 0, x = 0;
+        for(int i = 0; i < BLOCK_ENTRIES; i++){
+            uint32_t v = fat[b*BLOCK_ENTRIES + i] & FAT_ENTRY_MASK;
+            f |= (uint64_t)(v == 0) << i;
+            e |= (uint64_t)(v >= FAT_EOC_MIN) << i;
+            x |= (uint64_t)(v == FAT_BAD_CLUSTER) << i;
+        }
+        freeMask[b] = f;
+        eocMask[b] = e;
+        badMask[b] = x;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void classify_sse2(const uint32_t* fat, int blocks, uint64_t* freeMask, uint64_t* eocMask, uint64_t* badMask){
+    const __m128i mask = _mm_set1_epi32(FAT_ENTRY_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bad = _mm_set1_epi32(FAT_BAD_CLUSTER);
+    for(int b = 0; b < blocks; b++){
+        uint64_t f = 0, e = 0, x = 0;
+        const uint32_t* p = fat + b*BLOCK_ENTRIES;
+        for(int k = 0; k < BLOCK_ENTRIES/4; k++){
+            // masked values are below 2^28, so the signed compare is safe
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(p + k*4)), mask);
+            f |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << (k*4);
+            e |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, bad))) << (k*4);
+            x |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, bad))) << (k*4);
+        }
+        freeMask[b] = f;
+        eocMask[b] = e;
+        badMask[b] = x;
+    }
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const uint32_t* fat, int blocks, uint64_t* freeMask, uint64_t* eocMask, uint64_t* badMask){
+    const __m256i mask = _mm256_set1_epi32(FAT_ENTRY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bad = _mm256_set1_epi32(FAT_BAD_CLUSTER);
+    for(int b = 0; b < blocks; b++){
+        uint64_t f = 0, e = 0, x = 0;
+        const uint32_t* p = fat + b*BLOCK_ENTRIES;
+        for(int k = 0; k < BLOCK_ENTRIES/8; k++){
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + k*8)), mask);
+            f |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << (k*8);
+            e |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, bad))) << (k*8);
+            x |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, bad))) << (k*8);
+        }
+        freeMask[b] = f;
+        eocMask[b] = e;
+        badMask[b] = x;
+    }
+}
+#endif
+
+static classify_kernel selectedKernel = NULL;
+static const char* selectedKernelName = NULL;
+
+static void select_kernel(void){
+    if(selectedKernel != NULL) return;
+    selectedKernel = classify_scalar;
+    selectedKernelName = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        selectedKernel = classify_avx2;
+        selectedKernelName = "avx2";
+    }else if(__builtin_cpu_supports("sse2")){
+        selectedKernel = classify_sse2;
+        selectedKernelName = "sse2";
+    }
+#endif
+}
+
+const char* fat_scan_kernel(void){
+    select_kernel();
+    return selectedKernelName;
+}
+
+static void append_cluster(int** list, int* count, int* capacity, int cluster){
+    if(*count == *capacity){
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        *list = realloc(*list, sizeof(int) * (*capacity));
+    }
+    (*list)[(*count)++] = cluster;
+}
+
+static void append_run(fatScan* scan, int* capacity, int start, int end){
+    if(scan->freeRunCount == *capacity){
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        scan->freeRuns = realloc(scan->freeRuns, sizeof(fatExtent) * (*capacity));
+    }
+    scan->freeRuns[scan->freeRunCount].start = start;
+    scan->freeRuns[scan->freeRunCount].length = end - start;
+    scan->freeRunCount += 1;
+}
+
+fatScan* scan_fat(diskImage* disk, int flags){
+    select_kernel();
+    STAT_PHASE_BEGIN(PHASE_FAT_SCAN);
+
+    fatScan* scan = calloc(1, sizeof(fatScan));
+    scan->clusterCount = disk->clusterCount;
+    int words = (scan->clusterCount + BLOCK_ENTRIES - 1) / BLOCK_ENTRIES;
+    if(flags & FAT_SCAN_FREE_BITS){
+        scan->freeBits = calloc(words, sizeof(uint64_t));
+    }
+    int runCapacity = 0, eocCapacity = 0, badCapacity = 0;
+    int eocListed = 0, badListed = 0;
+    int runStart = -1;
+
+    const uint32_t* fat = disk_fat(disk);
+    int fullBlocks = scan->clusterCount / BLOCK_ENTRIES;
+    uint64_t freeMask[CHUNK_BLOCKS], eocMask[CHUNK_BLOCKS], badMask[CHUNK_BLOCKS];
+
+    for(int chunk = 0; chunk < words; chunk += CHUNK_BLOCKS){
+        int blocks = words - chunk < CHUNK_BLOCKS ? words - chunk : CHUNK_BLOCKS;
+        int vectorBlocks = fullBlocks - chunk < blocks ? fullBlocks - chunk : blocks;
+        int entries = scan->clusterCount - chunk*BLOCK_ENTRIES;
+        if(entries > blocks*BLOCK_ENTRIES) entries = blocks*BLOCK_ENTRIES;
+        if(disk->holes != NULL && range_in_hole(disk, disk->fatOffset + (uint64_t)chunk*BLOCK_ENTRIES*sizeof(uint32_t), (uint64_t)entries*sizeof(uint32_t))){
+            // FAT pages inside a hole of a sparse image are zeros: every entry free, nothing read
+            for(int b = 0; b < blocks; b++){
+                int left = entries - b*BLOCK_ENTRIES;
+                freeMask[b] = left >= BLOCK_ENTRIES ? ~0ULL : (1ULL << left) - 1;
+                eocMask[b] = 0;
+                badMask[b] = 0;
+            }
+            vectorBlocks = blocks;
+        }else if(vectorBlocks > 0){
+            selectedKernel(fat + (size_t)chunk*BLOCK_ENTRIES, vectorBlocks, freeMask, eocMask, badMask);
+        }
+        if(vectorBlocks < blocks){
+            // trailing partial block, classified entry by entry
+            int base = (chunk + vectorBlocks) * BLOCK_ENTRIES;
+            uint64_t f = 0, e = 0, x = 0;
+            for(int c = base; c < scan->clusterCount; c++){
+                uint32_t v = fat[c] & FAT_ENTRY_MASK;
+                f |= (uint64_t)(v == 0) << (c - base);
+                e |= (uint64_t)(v >= FAT_EOC_MIN) << (c - base);
+                x |= (uint64_t)(v == FAT_BAD_CLUSTER) << (c - base);
+            }
+            freeMask[vectorBlocks] = f;
+            eocMask[vectorBlocks] = e;
+            badMask[vectorBlocks] = x;
+        }
+        if(chunk == 0){
+            // entries 0 and 1 hold the media byte and flags, not clusters
+            freeMask[0] &= ~3ULL;
+            eocMask[0] &= ~3ULL;
+            badMask[0] &= ~3ULL;
+        }
+
+        // fold the masks while they are still hot
+        for(int b = 0; b < blocks; b++){
+            int base = (chunk + b) * BLOCK_ENTRIES;
+            uint64_t f = freeMask[b];
+            scan->freeCount += __builtin_popcountll(f);
+            scan->eocCount += __builtin_popcountll(eocMask[b]);
+            scan->badCount += __builtin_popcountll(badMask[b]);
+            if(scan->freeBits != NULL){
+                scan->freeBits[chunk + b] = f;
+            }
+            if(flags & FAT_SCAN_FREE_RUNS){
+                // walk the 0/1 transitions of the free mask
+                int bit = 0;
+                while(bit < BLOCK_ENTRIES){
+                    uint64_t rest = f >> bit;
+                    if(runStart < 0){
+                        if(rest == 0) break;
+                        bit += __builtin_ctzll(rest);
+                        runStart = base + bit;
+                    }else{
+                        uint64_t used = ~rest;
+                        if(bit > 0) used &= ~0ULL >> bit;
+                        if(used == 0) break;
+                        bit += __builtin_ctzll(used);
+                        append_run(scan, &runCapacity, runStart, base + bit);
+                        runStart = -1;
+                    }
+                }
+            }
+            if(flags & FAT_SCAN_EOC_LIST){
+                for(uint64_t e = eocMask[b]; e != 0; e &= e - 1){
+                    append_cluster(&scan->eocClusters, &eocListed, &eocCapacity, base + __builtin_ctzll(e));
+                }
+            }
+            if(flags & FAT_SCAN_BAD_LIST){
+                for(uint64_t x = badMask[b]; x != 0; x &= x - 1){
+                    append_cluster(&scan->badClusters, &badListed, &badCapacity, base + __builtin_ctzll(x));
+                }
+            }
+        }
+    }
+    if(runStart >= 0){
+        append_run(scan, &runCapacity, runStart, scan->clusterCount);
+    }
+    STAT_ADD(STAT_FAT_READS, scan->clusterCount);
+    STAT_PHASE_END(PHASE_FAT_SCAN);
+    return scan;
+}
+
+void destroy_fat_scan(fatScan* scan){
+    free(scan->freeBits);
+    free(scan->freeRuns);
+    free(scan->eocClusters);
+    free(scan->badClusters);
+    free(scan);
+}
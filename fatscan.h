@@ -0,0 +1,41 @@
+#ifndef FATSCAN_H
+#define FATSCAN_H
+
+#include <stdint.h>
+
+#include "diskio.h"
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_BAD_CLUSTER 0x0FFFFFF7
+#define FAT_EOC_MIN 0x0FFFFFF8
+
+// what scan_fat should collect besides the counts
+#define FAT_SCAN_FREE_BITS 0x1
+#define FAT_SCAN_FREE_RUNS 0x2
+#define FAT_SCAN_EOC_LIST  0x4
+#define FAT_SCAN_BAD_LIST  0x8
+
+typedef struct fatExtent{
+    int start;
+    int length;
+} fatExtent;
+
+typedef struct fatScan{
+    int clusterCount;       // entries scanned are 2..clusterCount-1
+    int freeCount;
+    int eocCount;
+    int badCount;
+
+    // optional outputs, NULL unless requested
+    uint64_t* freeBits;     // bit c is set when cluster c is free
+    fatExtent* freeRuns;    // maximal runs of free clusters, ascending
+    int freeRunCount;
+    int* eocClusters;       // clusters holding an end-of-chain marker
+    int* badClusters;       // clusters marked bad
+} fatScan;
+
+fatScan* scan_fat(diskImage* disk, int flags);
+void destroy_fat_scan(fatScan* scan);
+const char* fat_scan_kernel(void);
+
+#endif
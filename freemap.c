@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nyufile.h"
+#include "freemap.h"
+#include "fatscan.h"
+#include "sidecar.h"
+
+// free-cluster bitmap, built once per run from the first FAT so candidate
+// windows can be produced densely instead of probing the FAT slot by slot
+
+freeMap* build_free_map(diskImage* disk){
+    if(disk->index != NULL){
+        // the sidecar already holds the bitmap, copied since callers claim clusters in it
+        sidecarHeader* header = disk->index->header;
+        size_t bytes = (size_t)(header->clusterCount + 63) / 64 * sizeof(uint64_t);
+        freeMap* map = malloc(sizeof(freeMap));
+        map->clusterCount = header->clusterCount;
+        map->freeCount = header->freeCount;
+        map->bits = malloc(bytes);
+        memcpy(map->bits, disk->index->freeBits, bytes);
+        return map;
+    }
+    fatScan* scan = scan_fat(disk, FAT_SCAN_FREE_BITS);
+    freeMap* map = malloc(sizeof(freeMap));
+    map->clusterCount = scan->clusterCount;
+    map->freeCount = scan->freeCount;
+    map->bits = scan->freeBits;
+    scan->freeBits = NULL;
+    destroy_fat_scan(scan);
+    return map;
+}
+
+void destroy_free_map(freeMap* map){
+    free(map->bits);
+    free(map);
+}
+
+int is_cluster_free(freeMap* map, int cluster){
+    if(cluster < 2 || cluster >= map->clusterCount) return 0;
+    return (map->bits[cluster >> 6] >> (cluster & 63)) & 1;
+}
+
+void mark_cluster_used(freeMap* map, int cluster){
+    // claims a cluster for a planned recovery so later candidate lists skip it
+    if(is_cluster_free(map, cluster)){
+        map->bits[cluster >> 6] &= ~(1ULL << (cluster & 63));
+        map->freeCount -= 1;
+    }
+}
+
+int collect_free_clusters(freeMap* map, int first, int last, int skip, int* out, int max){
+    // writes the free clusters in [first, last] except skip to out, in ascending order
+    if(first < 2) first = 2;
+    if(last >= map->clusterCount) last = map->clusterCount - 1;
+    int counter = 0;
+    if(first > last) return 0;
+
+    for(int w = first >> 6; w <= last >> 6 && counter < max; w++){
+        uint64_t word = map->bits[w];
+        if(w == first >> 6) word &= ~0ULL << (first & 63);
+        if(w == last >> 6 && (last & 63) != 63) word &= (1ULL << ((last & 63) + 1)) - 1;
+        while(word != 0 && counter < max){
+            int cluster = (w << 6) | __builtin_ctzll(word);
+            word &= word - 1;
+            if(cluster != skip) out[counter++] = cluster;
+        }
+    }
+    return counter;
+}
@@ -0,0 +1,20 @@
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+#include <stdint.h>
+
+#include "diskio.h"
+
+typedef struct freeMap{
+    uint64_t* bits;         // bit c is set when cluster c is free in the FAT
+    int clusterCount;       // valid cluster numbers are 2..clusterCount-1
+    int freeCount;
+} freeMap;
+
+freeMap* build_free_map(diskImage* disk);
+void destroy_free_map(freeMap* map);
+int is_cluster_free(freeMap* map, int cluster);
+void mark_cluster_used(freeMap* map, int cluster);
+int collect_free_clusters(freeMap* map, int first, int last, int skip, int* out, int max);
+
+#endif
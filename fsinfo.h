@@ -1,3 +1,6 @@
+#ifndef FSINFO_H
+#define FSINFO_H
+
 #pragma pack(push,1)
 typedef struct BootEntry {
   unsigned char  BS_jmpBoot[3];     // Assembly instruction to jump to boot code
@@ -45,4 +48,18 @@ typedef struct DirEntry {
   unsigned short DIR_FstClusLO;     // Low 2 bytes of the first cluster address
   unsigned int   DIR_FileSize;      // File size in bytes. (0 for directories)
 } DirEntry;
-#pragma pack(pop)
\ No newline at end of file
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct FSInfo {
+  unsigned int   FSI_LeadSig;       // 0x41615252
+  unsigned char  FSI_Reserved1[480];
+  unsigned int   FSI_StrucSig;      // 0x61417272
+  unsigned int   FSI_Free_Count;    // Last known count of free clusters, 0xFFFFFFFF if unknown
+  unsigned int   FSI_Nxt_Free;      // Cluster to start looking for free clusters from, 0xFFFFFFFF if unknown
+  unsigned char  FSI_Reserved2[12];
+  unsigned int   FSI_TrailSig;      // 0xAA550000
+} FSInfo;
+#pragma pack(pop)
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+// per-cluster-size kernels: a module writes its loop once as an always-inline
+// body taking the cluster size, instantiates it for every size FAT32 allows
+// with FOR_EACH_CLUSTER_SIZE, and picks its copy with disk->kernel, set when
+// the image is opened. -1 there means an out-of-spec size and the generic body.
+
+#define CLUSTER_SHIFT_MIN 9         // 512 B
+#define CLUSTER_SHIFT_MAX 15        // 32 KB
+#define CLUSTER_KERNELS (CLUSTER_SHIFT_MAX - CLUSTER_SHIFT_MIN + 1)
+
+#define FOR_EACH_CLUSTER_SIZE(X) X(512) X(1024) X(2048) X(4096) X(8192) X(16384) X(32768)
+
+#define KERNEL_BODY static inline __attribute__((always_inline))
+
+#endif
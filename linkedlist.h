@@ -1,13 +0,0 @@
-typedef struct node{
-    int clusterId;
-    char* data;
-    struct node* next;
-    struct node* prev;
-} node;
-
-typedef struct linkedList{
-    struct node* head;
-    struct node* tail;
-    int clusterSize;
-    int blockCount;
-} linkedList;
\ No newline at end of file
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+
+#include "fsinfo.h"
+
+// synthetic FAT32 image generator (make bench)
+//
+// the layout is deliberately simple: 32 reserved sectors, two FATs, the
+// root directory at cluster 2 followed by the subdirectories, then the
+// file data laid out according to the requested fragmentation pattern.
+// a manifest line is written per file so the harness knows what to ask for.
+
+#define SECTOR_SIZE 512
+#define RESERVED_SECTORS 32
+#define EOC 0x0FFFFFF8
+
+#define LAYOUT_CONTIGUOUS 0
+#define LAYOUT_INTERLEAVED 1
+#define LAYOUT_REVERSED 2
+#define LAYOUT_RANDOM 3
+
+#define CONTENT_RANDOM 0
+#define CONTENT_TEXT 1
+
+typedef struct genFile{
+    char name[12];          // packed 8.3 name
+    char display[13];
+    int dir;                // 0 = root, otherwise subdirectory index
+    unsigned int size;
+    int clusterCount;
+    int* chain;
+    int deleted;
+    unsigned char sha[SHA_DIGEST_LENGTH];
+} genFile;
+
+typedef struct genDir{
+    char name[12];
+    int firstCluster;
+    int clusterCount;
+    int entryCount;
+    int entryCapacity;
+} genDir;
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void){
+    // xorshift64*
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned int rng_range(unsigned int lo, unsigned int hi){
+    if(hi <= lo) return lo;
+    return lo + (unsigned int)(rng_next() % (uint64_t)(hi - lo + 1));
+}
+
+static void usage(void){
+    fprintf(stderr, "Usage: ./mkimage -o image [options]\n");
+    fprintf(stderr, "  -o image               Output image path.\n");
+    fprintf(stderr, "  -m manifest            Write the file manifest here (default stdout).\n");
+    fprintf(stderr, "  -c bytes               Cluster size, 512..65536 (default 4096).\n");
+    fprintf(stderr, "  -n clusters            Data clusters in the volume (default 4096).\n");
+    fprintf(stderr, "  -f count               Number of files (default 16).\n");
+    fprintf(stderr, "  -s min[-max]           File size range in bytes (default 1-16384).\n");
+    fprintf(stderr, "  -e entries             Extra live filler entries per directory (default 0).\n");
+    fprintf(stderr, "  -D dirs                Number of subdirectories (default 0).\n");
+    fprintf(stderr, "  -p pattern             contiguous|interleaved|reversed|random (default contiguous).\n");
+    fprintf(stderr, "  -w window              Window for the random pattern (default 20).\n");
+    fprintf(stderr, "  -d ratio               Fraction of files to delete, 0..1 (default 0.5).\n");
+    fprintf(stderr, "  -k content             random|text (default random).\n");
+    fprintf(stderr, "  -S seed                RNG seed.\n");
+}
+
+static void make_name(char* packed, char* display, const char* base, int index, const char* ext){
+    char stem[9];
+    snprintf(stem, sizeof(stem), "%s%04d", base, index % 10000);
+    memset(packed, ' ', 11);
+    packed[11] = '\0';
+    memcpy(packed, stem, strlen(stem));
+    if(ext != NULL){
+        memcpy(packed + 8, ext, strlen(ext));
+        snprintf(display, 13, "%s.%s", stem, ext);
+    }else{
+        snprintf(display, 13, "%s", stem);
+    }
+}
+
+static void fill_content(unsigned char* buf, unsigned int size, int kind){
+    static const char* words[] = {"cluster", "sector", "fat", "entry", "volume", "restore",
+                                  "chain", "bitmap", "search", "digest", "offset", "window"};
+    if(kind == CONTENT_RANDOM){
+        for(unsigned int i = 0; i < size; i++) buf[i] = (unsigned char)rng_next();
+        return;
+    }
+    unsigned int i = 0;
+    int column = 0;
+    while(i < size){
+        const char* w = words[rng_next() % (sizeof(words)/sizeof(words[0]))];
+        for(int j = 0; w[j] != '\0' && i < size; j++){
+            buf[i++] = (unsigned char)w[j];
+            column++;
+        }
+        if(i < size){
+            buf[i++] = column > 60 ? '\n' : ' ';
+            if(column > 60) column = 0;
+        }
+    }
+}
+
+int main(int argc, char* argv[]){
+    const char* imagePath = NULL;
+    const char* manifestPath = NULL;
+    int clusterSize = 4096;
+    int dataClusters = 4096;
+    int fileCount = 16;
+    unsigned int minSize = 1, maxSize = 16384;
+    int fillerEntries = 0;
+    int dirCount = 0;
+    int pattern = LAYOUT_CONTIGUOUS;
+    int window = 20;
+    double deleteRatio = 0.5;
+    int kind = CONTENT_RANDOM;
+
+    int opt;
+    while((opt = getopt(argc, argv, "o:m:c:n:f:s:e:D:p:w:d:k:S:")) != -1){
+        switch(opt){
+            case 'o': imagePath = optarg; break;
+            case 'm': manifestPath = optarg; break;
+            case 'c': clusterSize = atoi(optarg); break;
+            case 'n': dataClusters = atoi(optarg); break;
+            case 'f': fileCount = atoi(optarg); break;
+            case 's': {
+                char* dash = strchr(optarg, '-');
+                minSize = (unsigned int)strtoul(optarg, NULL, 10);
+                maxSize = dash != NULL ? (unsigned int)strtoul(dash + 1, NULL, 10) : minSize;
+                break;
+            }
+            case 'e': fillerEntries = atoi(optarg); break;
+            case 'D': dirCount = atoi(optarg); break;
+            case 'p':
+                if(strcmp(optarg, "contiguous") == 0) pattern = LAYOUT_CONTIGUOUS;
+                else if(strcmp(optarg, "interleaved") == 0) pattern = LAYOUT_INTERLEAVED;
+                else if(strcmp(optarg, "reversed") == 0) pattern = LAYOUT_REVERSED;
+                else if(strcmp(optarg, "random") == 0) pattern = LAYOUT_RANDOM;
+                else{ usage(); return 1; }
+                break;
+            case 'w': window = atoi(optarg); break;
+            case 'd': deleteRatio = atof(optarg); break;
+            case 'k':
+                if(strcmp(optarg, "random") == 0) kind = CONTENT_RANDOM;
+                else if(strcmp(optarg, "text") == 0) kind = CONTENT_TEXT;
+                else{ usage(); return 1; }
+                break;
+            case 'S': rngState = strtoull(optarg, NULL, 0) * 0x9E3779B97F4A7C15ULL + 1; break;
+            default: usage(); return 1;
+        }
+    }
+    if(imagePath == NULL || clusterSize < 512 || clusterSize > 65536 || (clusterSize & (clusterSize - 1)) != 0
+       || fileCount < 0 || dirCount < 0 || minSize > maxSize){
+        usage();
+        return 1;
+    }
+
+    int secPerClus = clusterSize / SECTOR_SIZE;
+    unsigned int fatEntries = (unsigned int)dataClusters + 2;
+    unsigned int fatSectors = (fatEntries * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    unsigned long long totalSectors = RESERVED_SECTORS + 2ULL * fatSectors + (unsigned long long)dataClusters * secPerClus;
+    unsigned long long imageSize = totalSectors * SECTOR_SIZE;
+    unsigned long long dataOffset = (RESERVED_SECTORS + 2ULL * fatSectors) * SECTOR_SIZE;
+
+    unsigned char* image = calloc(1, imageSize);
+    unsigned int* fat = calloc(fatEntries, sizeof(unsigned int));
+    if(image == NULL || fat == NULL){
+        fprintf(stderr, "mkimage: out of memory\n");
+        return 1;
+    }
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = 0x0FFFFFFF;
+
+    // directories: root plus subdirectories, each sized for its entries
+    int entriesPerCluster = clusterSize / (int)sizeof(DirEntry);
+    genDir* dirs = calloc((size_t)dirCount + 1, sizeof(genDir));
+    genFile* files = calloc((size_t)fileCount + 1, sizeof(genFile));
+    for(int i = 0; i < fileCount; i++){
+        files[i].dir = dirCount > 0 ? i % (dirCount + 1) : 0;
+        make_name(files[i].name, files[i].display, "FILE", i, "BIN");
+        files[i].size = rng_range(minSize, maxSize);
+        files[i].clusterCount = (int)((files[i].size + (unsigned int)clusterSize - 1) / (unsigned int)clusterSize);
+        files[i].chain = malloc(sizeof(int) * (size_t)(files[i].clusterCount + 1));
+        dirs[files[i].dir].entryCount++;
+    }
+    for(int d = 0; d <= dirCount; d++){
+        dirs[d].entryCount += fillerEntries + (d == 0 ? dirCount : 2);
+        dirs[d].clusterCount = (dirs[d].entryCount + 1 + entriesPerCluster - 1) / entriesPerCluster;
+        if(dirs[d].clusterCount == 0) dirs[d].clusterCount = 1;
+        dirs[d].entryCapacity = dirs[d].clusterCount * entriesPerCluster;
+        if(d > 0){
+            char display[13];
+            make_name(dirs[d].name, display, "DIR", d, NULL);
+        }
+    }
+
+    int nextCluster = 2;
+    for(int d = 0; d <= dirCount; d++){
+        dirs[d].firstCluster = nextCluster;
+        for(int c = 0; c < dirs[d].clusterCount; c++){
+            fat[nextCluster + c] = c + 1 < dirs[d].clusterCount ? (unsigned int)(nextCluster + c + 1) : EOC;
+        }
+        nextCluster += dirs[d].clusterCount;
+    }
+
+    // lay the file data out according to the pattern
+    for(int i = 0; i < fileCount; i++){
+        genFile* f = &files[i];
+        int k = f->clusterCount;
+        if(k == 0) continue;
+        if(pattern == LAYOUT_INTERLEAVED && i + 1 < fileCount && files[i+1].clusterCount > 0){
+            genFile* g = &files[i+1];
+            int a = 0, b = 0, c = nextCluster;
+            while(a < k || b < g->clusterCount){
+                if(a < k) f->chain[a++] = c++;
+                if(b < g->clusterCount) g->chain[b++] = c++;
+            }
+            nextCluster = c;
+            i++;
+            continue;
+        }
+        if(pattern == LAYOUT_REVERSED){
+            f->chain[0] = nextCluster;
+            for(int c = 1; c < k; c++) f->chain[c] = nextCluster + k - c;
+            nextCluster += k;
+        }else if(pattern == LAYOUT_RANDOM){
+            int span = window + 1 > k ? window + 1 : k;
+            int* slots = malloc(sizeof(int) * (size_t)span);
+            for(int c = 0; c < span; c++) slots[c] = nextCluster + c;
+            for(int c = span - 1; c > 1; c--){
+                int r = 1 + (int)(rng_next() % (uint64_t)c);
+                int t = slots[c]; slots[c] = slots[r]; slots[r] = t;
+            }
+            for(int c = 0; c < k; c++) f->chain[c] = slots[c];
+            // leftover window clusters hold stale garbage, free in the FAT
+            for(int c = k; c < span; c++){
+                unsigned char* p = image + dataOffset + (unsigned long long)(slots[c] - 2) * clusterSize;
+                fill_content(p, (unsigned int)clusterSize, kind);
+            }
+            free(slots);
+            nextCluster += span;
+        }else{
+            for(int c = 0; c < k; c++) f->chain[c] = nextCluster + c;
+            nextCluster += k;
+        }
+    }
+    for(int i = 0; i < fileCount; i++){
+        for(int c = 0; c < files[i].clusterCount; c++){
+            if(files[i].chain[c] >= (int)fatEntries){
+                fprintf(stderr, "mkimage: volume too small, raise -n\n");
+                return 1;
+            }
+        }
+    }
+
+    // file content, digests, FAT chains
+    unsigned char* buf = malloc((size_t)maxSize + 1);
+    for(int i = 0; i < fileCount; i++){
+        genFile* f = &files[i];
+        fill_content(buf, f->size, kind);
+        SHA1(buf, f->size, f->sha);
+        for(int c = 0; c < f->clusterCount; c++){
+            unsigned int chunk = f->size - (unsigned int)c * (unsigned int)clusterSize;
+            if(chunk > (unsigned int)clusterSize) chunk = (unsigned int)clusterSize;
+            unsigned char* p = image + dataOffset + (unsigned long long)(f->chain[c] - 2) * clusterSize;
+            memcpy(p, buf + (size_t)c * (size_t)clusterSize, chunk);
+            fat[f->chain[c]] = c + 1 < f->clusterCount ? (unsigned int)f->chain[c+1] : EOC;
+        }
+        f->deleted = (double)(rng_next() % 1000000) / 1000000.0 < deleteRatio;
+    }
+
+    // directory entries
+    for(int d = 0; d <= dirCount; d++) dirs[d].entryCount = 0;
+    #define NEXT_ENTRY(d) ((DirEntry*)(image + dataOffset + (unsigned long long)(dirs[d].firstCluster - 2) * clusterSize) + dirs[d].entryCount++)
+    for(int d = 1; d <= dirCount; d++){
+        DirEntry* dot = NEXT_ENTRY(d);
+        memcpy(dot->DIR_Name, ".          ", 11);
+        dot->DIR_Attr = 0x10;
+        dot->DIR_FstClusHI = (unsigned short)(dirs[d].firstCluster >> 16);
+        dot->DIR_FstClusLO = (unsigned short)(dirs[d].firstCluster & 0xFFFF);
+        DirEntry* dotdot = NEXT_ENTRY(d);
+        memcpy(dotdot->DIR_Name, "..         ", 11);
+        dotdot->DIR_Attr = 0x10;
+        DirEntry* link = NEXT_ENTRY(0);
+        memcpy(link->DIR_Name, dirs[d].name, 11);
+        link->DIR_Attr = 0x10;
+        link->DIR_FstClusHI = (unsigned short)(dirs[d].firstCluster >> 16);
+        link->DIR_FstClusLO = (unsigned short)(dirs[d].firstCluster & 0xFFFF);
+    }
+    for(int d = 0; d <= dirCount; d++){
+        for(int e = 0; e < fillerEntries; e++){
+            DirEntry* filler = NEXT_ENTRY(d);
+            char display[13];
+            char packed[12];
+            make_name(packed, display, "PAD", e, "DAT");
+            memcpy(filler->DIR_Name, packed, 11);
+            filler->DIR_Attr = 0x20;
+        }
+    }
+    for(int i = 0; i < fileCount; i++){
+        genFile* f = &files[i];
+        DirEntry* entry = NEXT_ENTRY(f->dir);
+        memcpy(entry->DIR_Name, f->name, 11);
+        entry->DIR_Attr = 0x20;
+        int start = f->clusterCount > 0 ? f->chain[0] : 0;
+        entry->DIR_FstClusHI = (unsigned short)(start >> 16);
+        entry->DIR_FstClusLO = (unsigned short)(start & 0xFFFF);
+        entry->DIR_FileSize = f->size;
+        if(f->deleted){
+            entry->DIR_Name[0] = 0xE5;
+            for(int c = 0; c < f->clusterCount; c++) fat[f->chain[c]] = 0;
+        }
+    }
+    #undef NEXT_ENTRY
+
+    // boot sector, FSInfo, FATs
+    BootEntry* boot = (BootEntry*)image;
+    boot->BS_jmpBoot[0] = 0xEB; boot->BS_jmpBoot[1] = 0x58; boot->BS_jmpBoot[2] = 0x90;
+    memcpy(boot->BS_OEMName, "MSWIN4.1", 8);
+    boot->BPB_BytsPerSec = SECTOR_SIZE;
+    boot->BPB_SecPerClus = (unsigned char)secPerClus;
+    boot->BPB_RsvdSecCnt = RESERVED_SECTORS;
+    boot->BPB_NumFATs = 2;
+    boot->BPB_Media = 0xF8;
+    boot->BPB_SecPerTrk = 32;
+    boot->BPB_NumHeads = 64;
+    boot->BPB_TotSec32 = (unsigned int)totalSectors;
+    boot->BPB_FATSz32 = fatSectors;
+    boot->BPB_RootClus = 2;
+    boot->BPB_FSInfo = 1;
+    boot->BPB_BkBootSec = 6;
+    boot->BS_DrvNum = 0x80;
+    boot->BS_BootSig = 0x29;
+    boot->BS_VolID = (unsigned int)rng_next();
+    memcpy(boot->BS_VolLab, "NO NAME    ", 11);
+    memcpy(boot->BS_FilSysType, "FAT32   ", 8);
+    image[510] = 0x55;
+    image[511] = 0xAA;
+    memcpy(image + 6 * SECTOR_SIZE, image, SECTOR_SIZE);
+
+    unsigned int freeCount = 0;
+    for(unsigned int c = 2; c < fatEntries; c++) if(fat[c] == 0) freeCount++;
+    unsigned char* fsInfo = image + SECTOR_SIZE;
+    *(unsigned int*)(fsInfo + 0) = 0x41615252;
+    *(unsigned int*)(fsInfo + 484) = 0x61417272;
+    *(unsigned int*)(fsInfo + 488) = freeCount;
+    *(unsigned int*)(fsInfo + 492) = (unsigned int)nextCluster;
+    *(unsigned int*)(fsInfo + 508) = 0xAA550000;
+
+    for(int t = 0; t < 2; t++){
+        memcpy(image + (unsigned long long)(RESERVED_SECTORS + t * fatSectors) * SECTOR_SIZE, fat, fatEntries * 4);
+    }
+
+    FILE* out = fopen(imagePath, "wb");
+    if(out == NULL || fwrite(image, 1, imageSize, out) != imageSize){
+        perror(imagePath);
+        return 1;
+    }
+    fclose(out);
+
+    FILE* manifest = manifestPath != NULL ? fopen(manifestPath, "w") : stdout;
+    if(manifest == NULL){
+        perror(manifestPath);
+        return 1;
+    }
+    for(int i = 0; i < fileCount; i++){
+        genFile* f = &files[i];
+        if(f->dir > 0){
+            char dirName[13];
+            char packed[12];
+            make_name(packed, dirName, "DIR", f->dir, NULL);
+            fprintf(manifest, "/%s/%s", dirName, f->display);
+        }else{
+            fprintf(manifest, "/%s", f->display);
+        }
+        fprintf(manifest, " %u %d %s ", f->size, f->clusterCount > 0 ? f->chain[0] : 0, f->deleted ? "deleted" : "live");
+        int contiguous = 1;
+        for(int c = 1; c < f->clusterCount; c++) if(f->chain[c] != f->chain[c-1] + 1) contiguous = 0;
+        fprintf(manifest, "%s ", contiguous ? "contiguous" : "fragmented");
+        for(int b = 0; b < SHA_DIGEST_LENGTH; b++) fprintf(manifest, "%02x", f->sha[b]);
+        for(int c = 0; c < f->clusterCount; c++) fprintf(manifest, "%c%d", c == 0 ? ' ' : ',', f->chain[c]);
+        fprintf(manifest, "\n");
+    }
+    if(manifest != stdout) fclose(manifest);
+    return 0;
+}
@@ -2,148 +2,348 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
-#include <openssl/sha.h>
-#define SHA_DIGEST_LENGTH 20
 
-#include "fsinfo.h"
-#include "linkedlist.h"
-
-
-unsigned char *SHA1(const unsigned char *d, size_t n, unsigned char *md);
-
-void print_file_system_info(char* diskMap);
+#include "nyufile.h"
+#include "diskio.h"
+#include "search.h"
+#include "freemap.h"
+#include "fatscan.h"
+#include "dirscan.h"
+#include "batch.h"
+#include "dirtree.h"
+#include "carve.h"
+#include "digest.h"
+#include "extract.h"
+#include "validate.h"
+#include "arena.h"
+#include "commit.h"
+#include "check.h"
+#include "sidecar.h"
+#include "server.h"
+#include "stats.h"
+
+
+void print_file_system_info(diskImage* disk);
 void printDefault();
-void print_root_directory(char* diskMap);
-void recover_continguous_file(char* diskMap, char* filename, char* shaSignature);
-void recover_uncontinguous_file(char* diskMap, char* filename, char* shaSignature);
-void reset_fat_table(char* diskMap, struct DirEntry* fileEntry, int isContiguous, int* clusterList, int clusterCount);
-void undelete_file(char* diskMap, struct DirEntry** fileInfoRef, char* filename);
-void undelete_uncontiguous_file(char* diskMap, struct DirEntry** fileInfoRef, char* filename, int* clusterList, int clusterCount);
-int* get_uncontinguous_block_match(char* diskMap, int* possibleClusters, int count, int fileSize, char* shaSignature, int* resultSize);
-
-int data_area_offset(char* diskMap);
-int root_directory_offset(char* diskMap);
-int fat_area_offset(char* diskMap);
-int num_fat_tables(char* diskMap);
-int fat_per_table_offset(char* diskMap);
-int bytes_per_cluster(char* diskMap);
-int compare_file_name(unsigned char* one, char* two, int offset);
-char* get_contiguous_deleted_hash(char* diskMap, struct DirEntry* fileEntry);
-int compare_hash(char* hash1, char* hash2);
-char* input_to_hash(char* input);
-char* fetch_data_by_cluster(char* diskMap, int clusterId);
-char char_to_hex(char c);
+void print_root_directory(diskImage* disk);
+void print_root_entry(struct DirEntry* dirInfo);
+void recover_continguous_file(char* filename, diskImage* disk, char* shaSignature, const char* extractDir);
+void recover_uncontinguous_file(char* filename, diskImage* disk, char* shaSignature, searchConfig* config, const char* extractDir);
 
 
 
 int main(int argc, char *argv[])
 {
     // parse input
-    if(argc<3){
+    commandLine command;
+    if(!parse_command(argc, argv, &command)){
         printDefault();
         return 0;
     }
+    if(command.servePath != NULL){
+        return serve_images(&command);
+    }
 
-    int fd = open(argv[1], O_RDWR);
-    struct stat sb;
-    fstat(fd, &sb);
-    int diskSize = sb.st_size;
+    // only the recovery modes write to the image
+    diskImage* disk = open_image(&command, command.image, is_write_command(&command));
+    if(disk == NULL){
+        return 1;
+    }
+    run_command(disk, &command);
 
-    char* diskMap = mmap(NULL, diskSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    STAT_PHASE_BEGIN(PHASE_COMMIT);
+    close_image(disk);
+    STAT_PHASE_END(PHASE_COMMIT);
+    if(command.statsFormat != 0){
+        stats_report(command.statsFormat);
+    }
+    return 0;
+}
 
-    // switch on input based on flag
+int parse_command(int argc, char* argv[], commandLine* command){
+    // fills command from argv, returns 0 when the usage should be printed instead
+    if(argc<3){
+        return 0;
+    }
+
+    memset(command, 0, sizeof(commandLine));
+    command->image = argv[1];
+    command->config = (searchConfig){ .threadCount = 0, .window = 0, .rangeStart = 0, .rangeEnd = 0,
+                                      .validate = VALIDATE_FORMAT, .order = SEARCH_ORDER_SCORED };
+    command->backend = DISK_BACKEND_AUTO;
+    command->cacheBytes = DISK_DEFAULT_CACHE;
+    searchConfig* config = &command->config;
+    int mode = 0;
+    int validateGiven = 0;
+    int orderGiven = 0;
+    int anytimeGiven = 0;
+
+    static struct option longOptions[] = {
+        {"window", required_argument, NULL, 'w'},
+        {"range", required_argument, NULL, 'a'},
+        {"io", required_argument, NULL, 'o'},
+        {"cache", required_argument, NULL, 'k'},
+        {"stats", optional_argument, NULL, 'y'},
+        {"validate", required_argument, NULL, 'v'},
+        {"order", required_argument, NULL, 'd'},
+        {"index", optional_argument, NULL, 'n'},
+        {"serve", required_argument, NULL, 'e'},
+        {"deadline", required_argument, NULL, 'D'},
+        {"max-nodes", required_argument, NULL, 'N'},
+        {"progress", no_argument, NULL, 'P'},
+        {"checkpoint", required_argument, NULL, 'K'},
+        {0, 0, 0, 0}
+    };
+
+    // the disk always comes first, options follow it in any order; getopt sees
+    // it as the program name and starts over from scratch on every call
+    argc -= 1;
+    argv += 1;
     opterr = 0;
-    int options = getopt(argc, argv, "r:R:ils:");
-    switch(options)
-    {
-        case 'i':
-            if(argc != 3){
-                printDefault();
+    optind = 0;
+    int options;
+    while((options = getopt_long(argc, argv, "ilLr:R:b:C:S:cs:t:x:", longOptions, NULL)) != -1){
+        switch(options)
+        {
+            case 'i':
+            case 'l':
+            case 'L':
+            case 'r':
+            case 'R':
+            case 'b':
+            case 'C':
+            case 'S':
+                if(mode != 0){
+                    return 0;
+                }
+                mode = options;
+                if(options == 'r' || options == 'R'){
+                    command->filename = optarg;
+                }else if(options == 'b'){
+                    command->manifestPath = optarg;
+                }else if(options == 'C'){
+                    command->outDir = optarg;
+                }else if(options == 'S'){
+                    command->digestPath = optarg;
+                }
                 break;
-            }
-            print_file_system_info(diskMap);
-            break;
-        case 'l':
-            print_root_directory(diskMap);
-            break;
-        case 's': ;
-            char* hash = (char*)malloc(sizeof(char)*41);
-            options = getopt(argc, argv, "r:R:");
-            if(options == 'r'){
-                recover_continguous_file(optarg, diskMap, hash);
-            }
-            else if(options == 'R'){
-                recover_uncontinguous_file(optarg, diskMap, hash);
-            }
-            else{
-                printDefault();
-            }
-            break;
-        case 'r':
-            if(argc==4){
-                optind -= 1;
-                if(argv[3][0] == '-'){
-                    printDefault();
-                    break;
+            case 's':
+                command->shaSignature = optarg;
+                break;
+            case 'x':
+                command->extractDir = optarg;
+                break;
+            case 'c':
+                command->check = 1;
+                break;
+            case 't':
+                config->threadCount = atoi(optarg);
+                if(config->threadCount < 1){
+                    return 0;
+                }
+                break;
+            case 'w':
+                config->window = atoi(optarg);
+                if(config->window < 1 || config->rangeEnd != 0){
+                    return 0;
                 }
-                recover_continguous_file(argv[3], diskMap, NULL);
                 break;
-            }else if(argc==6){
-                char* filename = malloc(sizeof(char)*13);
-                strcpy(filename, optarg);
-                options = getopt(argc, argv, "s:");
-                if(options=='s'){
-                    // printf("here!");
-                    // printf("%s\n", filename);
-                    recover_continguous_file(filename, diskMap, optarg);
+            case 'a':
+                if(sscanf(optarg, "%d-%d", &config->rangeStart, &config->rangeEnd) != 2
+                   || config->rangeStart < 2 || config->rangeEnd < config->rangeStart || config->window != 0){
+                    return 0;
+                }
+                break;
+            case 'o':
+                if(strcmp(optarg, "mmap") == 0){
+                    command->backend = DISK_BACKEND_MMAP;
+                }else if(strcmp(optarg, "pread") == 0){
+                    command->backend = DISK_BACKEND_PREAD;
                 }else{
-                    printDefault();
+                    return 0;
                 }
                 break;
-            }else{
-                printDefault();
+            case 'k':
+                if(atoi(optarg) < 1){
+                    return 0;
+                }
+                command->cacheBytes = (size_t)atoi(optarg) << 20;
                 break;
-            }
-            break;
-        case 'R':
-            if(argc==6){
-                char* filename = malloc(sizeof(char)*13);
-                strcpy(filename, optarg);
-                options = getopt(argc, argv, "s:");
-                if(options=='s'){
-                    // printf("here!");
-                    // printf("%s\n", filename);
-                    recover_uncontinguous_file(filename, diskMap, optarg);
+            case 'y':
+                if(optarg == NULL){
+                    command->statsFormat = STATS_TEXT;
+                }else if(strcmp(optarg, "json") == 0){
+                    command->statsFormat = STATS_JSON;
                 }else{
-                    printDefault();
+                    return 0;
                 }
                 break;
-            }else{
-                printDefault();
+            case 'v':
+                if(!parse_validate_flags(optarg, &config->validate)){
+                    return 0;
+                }
+                validateGiven = 1;
+                break;
+            case 'd':
+                if(strcmp(optarg, "scored") == 0){
+                    config->order = SEARCH_ORDER_SCORED;
+                }else if(strcmp(optarg, "raw") == 0){
+                    config->order = SEARCH_ORDER_RAW;
+                }else{
+                    return 0;
+                }
+                orderGiven = 1;
+                break;
+            case 'n':
+                command->indexGiven = 1;
+                command->indexPath = optarg;
+                break;
+            case 'e':
+                command->servePath = optarg;
+                break;
+            case 'D':{
+                char* end = NULL;
+                config->deadline = strtod(optarg, &end);
+                if(end == optarg || *end != '\0' || !(config->deadline > 0)){
+                    return 0;
+                }
+                anytimeGiven = 1;
                 break;
             }
-            break;
+            case 'N':{
+                char* end = NULL;
+                config->maxNodes = strtoull(optarg, &end, 10);
+                if(end == optarg || *end != '\0' || config->maxNodes == 0 || optarg[0] == '-'){
+                    return 0;
+                }
+                anytimeGiven = 1;
+                break;
+            }
+            case 'P':
+                config->progress = 1;
+                anytimeGiven = 1;
+                break;
+            case 'K':
+                config->checkpointPath = optarg;
+                break;
+            default:
+                return 0;
+        }
+    }
+    // -c on its own is the check mode, with a recovery it is the pre-flight
+    if(command->check && mode == 0 && command->servePath == NULL){
+        mode = 'c';
+    }
+    command->mode = mode;
+
+    // validate the flag combination; the server takes its modes from the requests
+    char* filename = command->filename;
+    char* shaSignature = command->shaSignature;
+    if((mode == 0) != (command->servePath != NULL) || optind < argc
+       || (filename != NULL && filename[0] == '-')
+       || (shaSignature != NULL && mode != 'r' && mode != 'R')
+       || (command->extractDir != NULL && mode != 'r' && mode != 'R' && mode != 'b')
+       || (mode == 'R' && shaSignature == NULL)
+       || (command->check && mode != 'c' && mode != 'r' && mode != 'R' && mode != 'b')
+       || (config->threadCount != 0 && mode != 'R' && mode != 'b' && mode != 'L' && mode != 'C' && mode != 'c' && mode != 'S')
+       || ((config->window != 0 || config->rangeEnd != 0 || validateGiven || orderGiven || anytimeGiven) && mode != 'R' && mode != 'b' && mode != 'S')
+       || (config->checkpointPath != NULL && mode != 'R')
+       || (command->indexGiven && mode != 'l' && mode != 'r' && mode != 'R' && mode != 'b' && mode != 0)
+       || (command->servePath != NULL && command->statsFormat != 0)){
+        return 0;
+    }
+    return 1;
+}
+
+int is_write_command(commandLine* command){
+    // only the recovery modes write to the image, and only when not extracting
+    return (command->mode == 'r' || command->mode == 'R' || command->mode == 'b') && command->extractDir == NULL;
+}
+
+diskImage* open_image(commandLine* command, const char* path, int writable){
+    // opens path the way command asks, with the sidecar attached when --index was given
+    STAT_PHASE_BEGIN(PHASE_MAP);
+    diskImage* disk = open_disk(path, writable, command->backend, command->cacheBytes);
+    STAT_PHASE_END(PHASE_MAP);
+    if(disk == NULL){
+        return NULL;
+    }
+    if(command->indexGiven){
+        // the index sits next to the image unless a path was given
+        char* defaultPath = NULL;
+        const char* indexPath = command->indexPath;
+        if(indexPath == NULL){
+            defaultPath = malloc(strlen(path) + strlen(SIDECAR_SUFFIX) + 1);
+            sprintf(defaultPath, "%s%s", path, SIDECAR_SUFFIX);
+            indexPath = defaultPath;
+        }
+        open_sidecar(disk, indexPath, worker_count(command->config.threadCount));
+        free(defaultPath);
+    }
+    return disk;
+}
+
+void close_image(diskImage* disk){
+    close_sidecar(disk);
+    close_disk(disk);
+}
 
-        case -1:
-            printDefault();
+void run_command(diskImage* disk, commandLine* command){
+    // the search budget runs from here, for every search the command makes
+    command->config.deadlineAt = command->config.deadline > 0 ? search_clock() + command->config.deadline : 0;
+    command->config.nodesUsed = 0;
+    command->config.stopped = SEARCH_STOP_NONE;
+    if(command->check && command->mode != 'c'){
+        // the commit refuses clusters the check finds in use
+        disk->check = check_volume(disk, worker_count(command->config.threadCount));
+    }
+    // switch on input based on flag
+    switch(command->mode)
+    {
+        case 'i':
+            print_file_system_info(disk);
+            break;
+        case 'l':
+            print_root_directory(disk);
+            break;
+        case 'L':
+            print_deleted_catalog(disk, worker_count(command->config.threadCount));
+            break;
+        case 'r':
+            recover_continguous_file(command->filename, disk, command->shaSignature, command->extractDir);
+            break;
+        case 'R':
+            recover_uncontinguous_file(command->filename, disk, command->shaSignature, &command->config, command->extractDir);
+            break;
+        case 'b':
+            recover_batch(command->manifestPath, disk, &command->config, command->extractDir);
             break;
-        default:
-            printDefault();
+        case 'C':
+            carve_free_clusters(disk, command->outDir, worker_count(command->config.threadCount));
             break;
+        case 'c':
+            destroy_volume_check(check_volume(disk, worker_count(command->config.threadCount)));
+            break;
+        case 'S':{
+            digestSet* set = load_digest_set(command->digestPath);
+            if(set != NULL){
+                match_digest_set(disk, set, &command->config, worker_count(command->config.threadCount));
+                destroy_digest_set(set);
+            }
+            break;
+        }
     }
-
-    return 0;
+    destroy_volume_check(disk->check);
+    disk->check = NULL;
 }
 
-void print_file_system_info(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
+void print_file_system_info(diskImage* disk){
+    struct BootEntry* fsinfo = &disk->boot;
     printf("Number of FATs = %d\n", fsinfo->BPB_NumFATs);
     printf("Number of bytes per sector = %d\n", fsinfo->BPB_BytsPerSec);
     printf("Number of sectors per cluster = %d\n", fsinfo->BPB_SecPerClus);
@@ -154,59 +354,107 @@ void printDefault(){
     printf("Usage: ./nyufile disk <options>\n");
     printf("  -i                     Print the file system information.\n");
     printf("  -l                     List the root directory.\n");
-    printf("  -r filename [-s sha1]  Recover a contiguous file.\n");
+    printf("  -L                     List every deleted entry on the volume.\n");
+    printf("  -r filename [-s sha1]  Recover a contiguous file (filename may be DIR/NAME.EXT).\n");
     printf("  -R filename -s sha1    Recover a possibly non-contiguous file.\n");
+    printf("  -b manifest            Recover every name[,sha1][,contiguous|fragmented] line of a manifest (name may be DIR/NAME.EXT).\n");
+    printf("  -C outdir              Carve JPEG, PNG, PDF, ZIP and SQLite files out of free clusters into outdir.\n");
+    printf("  -S digests.txt         Match every deleted entry, fragmented chain and carvable file against a list of SHA-1s.\n");
+    printf("                         Fragmented chains get the likeliest orderings, then a full search of 64 MB hashed per\n");
+    printf("                         entry; --max-nodes sets that limit per entry, --deadline shares its time out instead.\n");
+    printf("  -c                     Check the FAT for cross-links, loops, lost chains and size mismatches.\n");
+    printf("                         With -r, -R or -b: check first and only recover into clusters nothing uses.\n");
+    printf("  -x outdir              With -r, -R or -b: write recovered files under outdir, leave the image untouched.\n");
+    printf("  -t threads             Worker threads for -R, -b, -L, -C, -S and -c (default: one per CPU).\n");
+    printf("  --window N             Search N clusters after the start cluster for -R and -S (default: 20).\n");
+    printf("  --range a-b            Search clusters a..b for -R and -S instead of a window.\n");
+    printf("  --validate LIST        Prune -R and -S chains: none or format,slack (default: format).\n");
+    printf("  --order scored|raw     Try -R and -S successors by continuity score or in cluster order (default: scored).\n");
+    printf("  --deadline SECONDS     Stop the -R, -b and -S searches after this long, widening the candidates as they go.\n");
+    printf("  --max-nodes N          Stop the -R, -b and -S searches after N search nodes.\n");
+    printf("  --progress             Report search progress to stderr once a second.\n");
+    printf("  --checkpoint file      Save a stopped or interrupted -R search to file and resume from it.\n");
+    printf("  --io mmap|pread        Image access: mapped windows or a cluster cache (default: pread for devices).\n");
+    printf("  --cache MB             Memory budget for mapped windows or cached clusters (default: 1024).\n");
+    printf("  --stats[=json]         Print counters, phase times and page faults to stderr at exit.\n");
+    printf("  --index[=path]         Answer -l, -r, -R and -b from a sidecar index (default: <disk>.idx).\n");
+    printf("  --serve socket         Keep images open and answer \"disk <options>\" request lines on a Unix socket.\n");
 }
 
 // milestone 4
-void recover_continguous_file(char* filename, char* diskMap, char* shaSignature){
-    struct BootEntry* fs = (struct BootEntry*)diskMap;
-
-    // find the file in the root directory
-    int byteOffset = root_directory_offset(diskMap);
-    struct DirEntry* fileEntry = (struct DirEntry*)(diskMap + byteOffset);
+void recover_continguous_file(char* filename, diskImage* disk, char* shaSignature, const char* extractDir){
+    // find the file in its directory, the root unless a path was given
+    struct DirEntry* fileEntry = NULL;
     struct DirEntry* target = NULL;
-    int fatOffset = fat_area_offset(diskMap);
-    int* fat = (int*)(diskMap + fatOffset);
-    int rootCluster = fs->BPB_RootClus;
+    int targetCluster = -1;     // directory cluster holding target, kept pinned
+    int targetIndex = -1;
+    int rootCluster = disk->boot.BPB_RootClus;
+    char* leaf = filename;
+
+    // pack the name once, then match whole clusters of entries against it
+    nameKey key;
+    STAT_PHASE_BEGIN(PHASE_DIR_WALK);
+    if(!resolve_parent(disk, filename, &rootCluster, &leaf) || !make_name_key(leaf, &key)){
+        STAT_PHASE_END(PHASE_DIR_WALK);
+        printf("%s: file not found\n", filename);
+        return;
+    }
+    int entriesPerCluster = disk->clusterSize / sizeof(struct DirEntry);
+    int* matches = malloc(sizeof(int)*entriesPerCluster);
+    char inputHash[SHA_DIGEST_LENGTH];
+    if(shaSignature != NULL) input_to_hash(shaSignature, inputHash);
+    // the whole directory chain, or only the clusters the sidecar points at
+    int* dirClusters = NULL;
+    int dirClusterCount = deleted_entry_clusters(disk, rootCluster, &key, &dirClusters);
 
     int found = 0;
-    while(rootCluster < 0x0FFFFFF7){
-        byteOffset = data_area_offset(diskMap) + (rootCluster - 2) * bytes_per_cluster(diskMap);
-        fileEntry = (struct DirEntry*)(diskMap + byteOffset);
-        for(int i = 0; i < bytes_per_cluster(diskMap); i+=sizeof(struct DirEntry)){
-            // printf("%c\n", fileEntry->DIR_Name[8]);
-            if(fileEntry->DIR_Name[0] == 0xE5 && compare_file_name(fileEntry->DIR_Name, filename, 1) == 1){
-                // found the file
-                if(shaSignature == NULL){
-                    // no sha signature
-                    // printf("filename: %s\n", filename);
-                    target = *(&fileEntry);
+    for(int d = 0; d < dirClusterCount; d++){
+        rootCluster = dirClusters[d];
+        struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, rootCluster);
+        if(entries == NULL) break;
+        int matchCount = find_deleted_entries((unsigned char*)entries, entriesPerCluster, disk->kernel, &key, matches);
+        int keep = 0;
+        for(int m = 0; m < matchCount; m++){
+            // found the file
+            fileEntry = entries + matches[m];
+            if(shaSignature == NULL){
+                // no sha signature
+                target = fileEntry;
+                targetIndex = matches[m];
+                found += 1;
+                keep = 1;
+            }else{
+                // check the hash
+                char hash[SHA_DIGEST_LENGTH];
+                get_contiguous_deleted_hash(disk, fileEntry, hash);
+                if(compare_hash(hash, inputHash) == 1){
+                    target = fileEntry;
+                    targetIndex = matches[m];
                     found += 1;
-                }else{
-                    // check the hash
-                    char* hash = get_contiguous_deleted_hash(diskMap, fileEntry);
-                    char* inputHash = input_to_hash(shaSignature);
-                    
-
-                    if(compare_hash(hash, inputHash) == 1){
-                        // printf("found\n");
-                        target = *(&fileEntry);
-                        found += 1;
-                    }
+                    keep = 1;
                 }
             }
-            fileEntry++;
+        }
+        if(keep){
+            if(targetCluster >= 0) put_cluster(disk, targetCluster);
+            targetCluster = rootCluster;
+        }else{
+            put_cluster(disk, rootCluster);
         }
 
         if(found>=2) break;
-        rootCluster = fat[rootCluster];
     }
+    STAT_PHASE_END(PHASE_DIR_WALK);
+    free(dirClusters);
+    free(matches);
     
     if(found==0){
         printf("%s: file not found\n", filename);
+    }else if(found==1 && extractDir != NULL && !extract_contiguous(disk, target, filename, extractDir)){
+        printf("%s: extraction failed\n", filename);
+    }else if(found==1 && extractDir == NULL && !commit_recovery(disk, targetCluster, targetIndex, target, leaf, NULL, 0)){
+        printf("%s: recovery failed, image unchanged\n", filename);
     }else if(found==1){
-        undelete_file(diskMap, &target, filename);
         if(shaSignature != NULL){
             printf("%s: successfully recovered with SHA-1\n", filename);
         }else{
@@ -215,409 +463,306 @@ void recover_continguous_file(char* filename, char* diskMap, char* shaSignature)
     }else{
         printf("%s: multiple candidates found\n", filename);
     }
+    if(targetCluster >= 0) put_cluster(disk, targetCluster);
 
 }
 
 // milestone 8
-void recover_uncontinguous_file(char* filename, char* diskMap, char* shaSignature){
-    struct BootEntry* fs = (struct BootEntry*)diskMap;
-
-    // find the file in the root directory
-    int byteOffset = root_directory_offset(diskMap);
-    struct DirEntry* fileEntry = (struct DirEntry*)(diskMap + byteOffset);
+void recover_uncontinguous_file(char* filename, diskImage* disk, char* shaSignature, searchConfig* config, const char* extractDir){
+    // find the file in its directory, the root unless a path was given
+    struct DirEntry* fileEntry = NULL;
     struct DirEntry* target = NULL;
-    int fatOffset = fat_area_offset(diskMap);
-    int* fat = (int*)(diskMap + fatOffset);
-    int totalClusters = fs->BPB_FATSz32 * fs->BPB_BytsPerSec / 4;
-    int rootCluster = fs->BPB_RootClus;
+    int targetIndex = -1;
+    int rootCluster = disk->boot.BPB_RootClus;
     int* resultChain = NULL;
     int resultChainSize = 0;
+    char* leaf = filename;
 
-    int found = 0;
-    while(rootCluster < 0x0FFFFFF7){
-        byteOffset = data_area_offset(diskMap) + (rootCluster - 2) * bytes_per_cluster(diskMap);
-        fileEntry = (struct DirEntry*)(diskMap + byteOffset);
-        for(int i = 0; i < bytes_per_cluster(diskMap); i+=sizeof(struct DirEntry)){
-            // printf("%c\n", fileEntry->DIR_Name[8]);
-            if(fileEntry->DIR_Name[0] == 0xE5 && compare_file_name(fileEntry->DIR_Name, filename, 1) == 1){
-                // found the file, check hash
-                char* inputHash = input_to_hash(shaSignature);
-
-                // extract cluster
-                int startingCluster = fileEntry->DIR_FstClusHI << 16 | fileEntry->DIR_FstClusLO;
-                int* clusterList = malloc(sizeof(int)*21);
-                clusterList[0] = startingCluster;
-                int counter = 1;
-                // get all deleted clusters within next 20 clusters -> in array
-                for(int i = 1; i < 21; i++){
-                    int cluster = fat[startingCluster+i];
-                    if(cluster == 0 && startingCluster+1<totalClusters+2){
-                        clusterList[i] = startingCluster+i;
-                        counter += 1;
-                    }
-                }
-                // call recursive function using backtracking
-                resultChain = get_uncontinguous_block_match(diskMap, clusterList, counter, fileEntry->DIR_FileSize, inputHash, &resultChainSize);
+    // pack the name once, then match whole clusters of entries against it
+    nameKey key;
+    STAT_PHASE_BEGIN(PHASE_DIR_WALK);
+    if(!resolve_parent(disk, filename, &rootCluster, &leaf) || !make_name_key(leaf, &key)){
+        STAT_PHASE_END(PHASE_DIR_WALK);
+        printf("%s: file not found\n", filename);
+        return;
+    }
+    int entriesPerCluster = disk->clusterSize / sizeof(struct DirEntry);
+    int* matches = malloc(sizeof(int)*entriesPerCluster);
+
+    // candidates come from the free-cluster bitmap, built once for every entry
+    freeMap* freeClusters = build_free_map(disk);
+    char inputHash[SHA_DIGEST_LENGTH];
+    input_to_hash(shaSignature, inputHash);
+    // search scratch, rewound for every matching entry so memory stays flat
+    arena scratch;
+    arena_init(&scratch, ARENA_DEFAULT_BLOCK);
+    // the whole directory chain, or only the clusters the sidecar points at
+    int* dirClusters = NULL;
+    int dirClusterCount = deleted_entry_clusters(disk, rootCluster, &key, &dirClusters);
 
-                // if found, break
-                if(resultChain != NULL){
-                    target = *(&fileEntry);
-                    found += 1;
-                    break;
-                }
-                free(clusterList);
+    int found = 0;
+    for(int d = 0; d < dirClusterCount; d++){
+        rootCluster = dirClusters[d];
+        struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, rootCluster);
+        if(entries == NULL) break;
+        int matchCount = find_deleted_entries((unsigned char*)entries, entriesPerCluster, disk->kernel, &key, matches);
+        for(int m = 0; m < matchCount; m++){
+            // found the file, extract cluster
+            fileEntry = entries + matches[m];
+            int startingCluster = fileEntry->DIR_FstClusHI << 16 | fileEntry->DIR_FstClusLO;
+            int counter = 0;
+            arena_reset(&scratch);
+            // get all free clusters in the window or range, packed densely after the start
+            int* clusterList = get_candidate_clusters(freeClusters, config, startingCluster, &counter, &scratch);
+            // call recursive function using backtracking
+            resultChain = get_uncontinguous_block_match(disk, clusterList, counter, fileEntry->DIR_FileSize, inputHash, &resultChainSize, config, &scratch);
+
+            // if found, break
+            if(resultChain != NULL){
+                target = fileEntry;
+                targetIndex = matches[m];
+                found += 1;
+                break;
             }
-            fileEntry++;
         }
 
+        // the cluster holding target stays pinned until it is undeleted
         if(found>=1) break;
-        rootCluster = fat[rootCluster];
+        put_cluster(disk, rootCluster);
     }
+    STAT_PHASE_END(PHASE_DIR_WALK);
+    free(dirClusters);
+    destroy_free_map(freeClusters);
+    arena_destroy(&scratch);
+    free(matches);
     
-    if(found==0){
+    if(found==0 && config->stopped != SEARCH_STOP_NONE){
+        printf("%s: search stopped before a match was found\n", filename);
+    }else if(found==0){
         printf("%s: file not found\n", filename);
+    }else if(extractDir != NULL){
+        int extracted = extract_chain(disk, resultChain, resultChainSize, target->DIR_FileSize, filename, extractDir);
+        put_cluster(disk, rootCluster);
+        free(resultChain);
+        if(extracted){
+            printf("%s: successfully recovered with SHA-1\n", filename);
+        }else{
+            printf("%s: extraction failed\n", filename);
+        }
     }else if(found>=1){
-        undelete_uncontiguous_file(diskMap, &target, filename, resultChain, resultChainSize);
-        printf("%s: successfully recovered with SHA-1\n", filename);
-    }
-}
-
-
-char* get_linkedList_hash(struct linkedList* list, int size, char* diskMap){
-    // returns the hash of the linked list
-    char* content = (char*)malloc(sizeof(char)*size);
-    int counter = 0;
-    struct node* walk = list->head;
-    while(walk != NULL){
-        // concatenate the content
-        // printf("%d>", walk->clusterId);
-        char* dataPtr = fetch_data_by_cluster(diskMap, walk->clusterId);
-        for(int i = 0; i < list->clusterSize; i++){
-            if(counter >= size) break;
-            content[counter] = *(dataPtr + i);
-            counter += 1;
+        int committed = commit_recovery(disk, rootCluster, targetIndex, target, leaf, resultChain, resultChainSize);
+        put_cluster(disk, rootCluster);
+        free(resultChain);
+        if(committed){
+            printf("%s: successfully recovered with SHA-1\n", filename);
+        }else{
+            printf("%s: recovery failed, image unchanged\n", filename);
         }
-        walk = walk->next;
     }
-    // printf("\n");
-    // printf("read size: %d\n", counter);
-    // printf("file size: %d\n", size);
-    char* hash = (char*)SHA1((unsigned char*)content, counter*sizeof(char), NULL);
-    // int i;
-    // for (i = 0; i < 20; i++)
-    // {
-    //     printf("%02X", hash[i]);
-    // }
-    // printf("\n");
-    return hash;
 }
 
-int block_match_helper(int* arr, int arrSize, int curr, char* targetHash, struct linkedList** list, int fileSize, char* diskMap){
-    // base case: check current block
-    char* fileHash = get_linkedList_hash(*list, fileSize, diskMap);
-    // int i;
-    // for (i = 0; i < 20; i++)
-    // {
-    //     printf("%02X", targetHash[i]);
-    // }
-    // printf("\n\n");
-    if(compare_hash(fileHash, targetHash) == 1){
-        // found the hash
-        return 1;
-    }
-    if((*list)->blockCount * ((*list)->clusterSize) > fileSize){
-        // no more room for more blocks
-        return 0;
-    }
-    if(curr >= arrSize){
-        // no more blocks to add
-        return 0;
-    }
-
-    // recursive case:
-    // if hit size limit -> return
-    // else
-    //  for loop to push each block into array
-    for(int i = 0;i<arrSize;i++){
-        if(i == curr) continue;
-        // push block into array
-        struct node* temp = (struct node*)malloc(sizeof(struct node));
-        temp->data = fetch_data_by_cluster(diskMap, arr[i]);
-        temp->clusterId = arr[i];
-        (*list)->tail->next = temp;
-        temp->prev = (*list)->tail;
-        temp->next = NULL;
-        (*list)->tail = temp;
-        (*list)->blockCount += 1;
-
-        // call recursive function
-        if(block_match_helper(arr, arrSize, i, targetHash, list, fileSize, diskMap) == 1){
-            return 1;
-        }
-        // pop block from array
-        (*list)->tail->prev->next = NULL;
-        struct node* temp2 = (*list)->tail;
-        (*list)->tail = (*list)->tail->prev;
-        (*list)->blockCount -= 1;
-        free(temp2);
-    }
-    // pop block from array
-    return 0;
 
+// file recovery: used in milestone 4-8
+// updates are staged in txn and reach the image when it commits
+void undelete_file(diskTransaction* txn, int dirCluster, int index, struct DirEntry* fileEntry, char* filename){
+    struct DirEntry restored = *fileEntry;
+    restored.DIR_Name[0] = filename[0];
+    stage_entry(txn, dirCluster, index, &restored);
+    reset_fat_table(txn, fileEntry, 1, NULL, 0);
+}
 
+void undelete_uncontiguous_file(diskTransaction* txn, int dirCluster, int index, struct DirEntry* fileEntry, char* filename, int* clusterList, int clusterCount){
+    struct DirEntry restored = *fileEntry;
+    restored.DIR_Name[0] = filename[0];
+    stage_entry(txn, dirCluster, index, &restored);
+    reset_fat_table(txn, fileEntry, 0, clusterList, clusterCount);
 }
 
-int* get_uncontinguous_block_match(char* diskMap, int* possibleClusters, int count, int fileSize, char* shaSignature, int* resultSize){
-    // returns an array of clusters that match the hash
-    struct linkedList* stack = malloc(sizeof(struct linkedList));
-
-    stack->head = (struct node*)malloc(sizeof(struct node));
-    stack->head->data = fetch_data_by_cluster(diskMap, possibleClusters[0]);
-    stack->head->clusterId = possibleClusters[0];
-    stack->head->next = NULL;
-    stack->head->prev = NULL;
-    stack->tail = stack->head;
-    stack->clusterSize = bytes_per_cluster(diskMap);
-    stack->blockCount = 1;
-
-
-    int result = block_match_helper(possibleClusters, count, 0, shaSignature, &stack, fileSize, diskMap);
-    if(result == 1){
-        // found the hash
-        struct node* walk = stack->head;
-        int* result = (int*)malloc(sizeof(int)*stack->blockCount);
-        int counter = 0;
-        while(walk != NULL){
-            result[counter] = walk->clusterId;
-            counter += 1;
-            walk = walk->next;
-        }
-        *resultSize = stack->blockCount;
-        return result;
+int commit_recovery(diskImage* disk, int dirCluster, int index, struct DirEntry* fileEntry, char* filename, int* clusterList, int clusterCount){
+    // one recovery in its own transaction, clusterList NULL for a contiguous file; 1 once it is on the image
+    diskTransaction txn;
+    begin_transaction(&txn, disk);
+    if(clusterList == NULL){
+        undelete_file(&txn, dirCluster, index, fileEntry, filename);
     }else{
-        return NULL;
+        undelete_uncontiguous_file(&txn, dirCluster, index, fileEntry, filename, clusterList, clusterCount);
     }
-
-}
-
-// file recovery: used in milestone 4-8
-void undelete_file(char* diskMap, struct DirEntry** fileInfoRef, char* filename){
-    (*fileInfoRef)->DIR_Name[0] = filename[0];
-    reset_fat_table(diskMap, *fileInfoRef, 1, NULL, 0);
-}
-
-void undelete_uncontiguous_file(char* diskMap, struct DirEntry** fileInfoRef, char* filename, int* clusterList, int clusterCount){
-    (*fileInfoRef)->DIR_Name[0] = filename[0];
-    reset_fat_table(diskMap, *fileInfoRef, 0, clusterList, clusterCount);
+    return commit_transaction(&txn) == 0;
 }
 
 // milestone 5
-void reset_fat_table(char* diskMap, struct DirEntry* fileEntry, int isContiguous, int* clusterList, int clusterCount){
+void reset_fat_table(diskTransaction* txn, struct DirEntry* fileEntry, int isContiguous, int* clusterList, int clusterCount){
+    // stages the file's chain; commit_transaction writes it to every FAT copy
     int startingCluster = (fileEntry->DIR_FstClusHI << 16) | fileEntry->DIR_FstClusLO;
-    int fileSize = fileEntry->DIR_FileSize;
-    int bytesPerCluster = bytes_per_cluster(diskMap);
-
-    int fatOffset = fat_area_offset(diskMap);
-    int perTableOffset = fat_per_table_offset(diskMap)/4;
-    int numFATs = num_fat_tables(diskMap);
-
-    int* FAT = (int*)(diskMap + fatOffset);
-    int clusterNum = startingCluster;
-
-    for(int t = 0; t < numFATs; t++){
-        if(isContiguous == 1){
-            for(int i = 0; i < fileSize; i+=bytesPerCluster){
-                FAT[clusterNum] = clusterNum + 1;
-                clusterNum++;
-            }
-            if(fileSize%bytesPerCluster==0){
-                FAT[clusterNum-1] = 0x0FFFFFF8;
-            }else{
-                FAT[clusterNum] = 0x0FFFFFF8;
-            }
-        }else{
-            for(int i = 0; i < clusterCount-1; i++){
-                FAT[clusterList[i]] = clusterList[i+1];
-            }
-            FAT[clusterList[clusterCount-1]] = 0x0FFFFFF8;
+    unsigned int fileSize = fileEntry->DIR_FileSize;
+    unsigned int bytesPerCluster = txn->disk->clusterSize;
+
+    if(isContiguous == 1){
+        // the clusters holding fileSize bytes from the start, an empty file has none
+        int clusters = (int)((fileSize + bytesPerCluster - 1) / bytesPerCluster);
+        for(int i = 0; i < clusters - 1; i++){
+            stage_fat(txn, startingCluster + i, startingCluster + i + 1);
+        }
+        if(clusters > 0) stage_fat(txn, startingCluster + clusters - 1, FAT_EOC_MIN);
+    }else{
+        for(int i = 0; i < clusterCount-1; i++){
+            stage_fat(txn, clusterList[i], clusterList[i+1]);
         }
-        fatOffset += perTableOffset;
+        stage_fat(txn, clusterList[clusterCount-1], FAT_EOC_MIN);
     }
-
-    
 }
-    
 
 
-// milestone 3
-void print_root_directory(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
-    
-    int rootCluster = fsinfo->BPB_RootClus; // identify root cluster
 
-    // find root directory
-    // note: -2 because root cluster is 2, but index starts at 0
-    int rootDirSectorOffset = fsinfo->BPB_RsvdSecCnt + fsinfo->BPB_NumFATs * fsinfo->BPB_FATSz32 + (rootCluster-2) * fsinfo->BPB_SecPerClus;
-    int rootDirByteOffset = fsinfo->BPB_BytsPerSec * rootDirSectorOffset;
-    int BYTEPERCLUSTER = bytes_per_cluster(diskMap);
+// milestone 3
+void print_root_directory(diskImage* disk){
+    int BYTEPERCLUSTER = disk->clusterSize;
 
     // find FAT
-    int FATByteOffset = fsinfo->BPB_RsvdSecCnt * fsinfo->BPB_BytsPerSec;
-    int* FAT = (int*)(diskMap + FATByteOffset);
+    unsigned int* FAT = disk_fat(disk);
 
 
     // iterate through root directory
-    struct DirEntry* dirInfo = (struct DirEntry*)(diskMap + rootDirByteOffset);
-    int cluster = fsinfo->BPB_RootClus;
+    int cluster = disk->boot.BPB_RootClus;
     int totalEntries = 0;
+    STAT_PHASE_BEGIN(PHASE_DIR_WALK);
+
+    if(disk->index != NULL){
+        // the sidecar keeps the printed entries, no directory cluster is read
+        totalEntries = disk->index->header->rootCount;
+        for(int e = 0; e < totalEntries; e++){
+            print_root_entry(&disk->index->root[e]);
+        }
+        cluster = 0;
+    }
 
     while(cluster< 0x0FFFFFF7 && cluster != 0){
+        struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, cluster);
+        if(entries == NULL) break;
+        struct DirEntry* dirInfo = entries;
+        STAT_ADD(STAT_DIR_CLUSTERS, 1);
+
         // iterate through directory entries in the given cluster
         int i = 0;
         for(i=0; i<BYTEPERCLUSTER/32; i++){
+            STAT_ADD(STAT_DIR_ENTRIES, 1);
             if(dirInfo->DIR_Name[0] == 0x00){
                 break;
             }else{
                 if(dirInfo->DIR_Name[0] != 0xE5 && dirInfo->DIR_Name[0]!= 0){ // check if entry is deleted
                     totalEntries++;
-
-                    // print file name
-                    char fileName[13];
-                    int j = 0;
-                    while(j<8 && dirInfo->DIR_Name[j] != ' '){
-                        fileName[j] = dirInfo->DIR_Name[j];
-                        j++;
-                    }
-
-                    if(dirInfo->DIR_Attr == 0x10){ // if directory
-                        fileName[j++] = '/';
-                    }else{
-                        if(dirInfo->DIR_Name[8] != ' '){ // if file has extension
-                            fileName[j++] = '.';
-                            int ext = 0;
-                            while(ext<3 && dirInfo->DIR_Name[ext+8] != ' '){
-                                fileName[j++] = dirInfo->DIR_Name[ext+8];
-                                ext++;
-                            }
-                        }
-                    }
-
-                    
-                    fileName[j] = '\0';
-                    printf("%s ", fileName);
-
-                    
-                    // print file size
-                    printf("(size = %d, ", dirInfo->DIR_FileSize);
-
-                    // print file starting cluster
-                    printf("starting cluster = %d)\n", dirInfo->DIR_FstClusHI << 16 | dirInfo->DIR_FstClusLO);
+                    print_root_entry(dirInfo);
                 }
             }
             dirInfo++;
         }
+        put_cluster(disk, cluster);
 
         // move to next cluster
+        STAT_ADD(STAT_FAT_READS, 1);
         cluster = FAT[cluster];
-        int nextClusterByteOffset = data_area_offset(diskMap) + (cluster-2) * BYTEPERCLUSTER;
-        dirInfo = (struct DirEntry*)(diskMap + nextClusterByteOffset);
     }
+    STAT_PHASE_END(PHASE_DIR_WALK);
     printf("Total number of entries = %d\n", totalEntries);
     
     
 }
 
+void print_root_entry(struct DirEntry* dirInfo){
+    // print file name
+    char fileName[13];
+    format_entry_name(dirInfo, fileName);
+    printf("%s ", fileName);
+
+    // print file size
+    printf("(size = %d, ", dirInfo->DIR_FileSize);
+
+    // print file starting cluster
+    printf("starting cluster = %d)\n", dirInfo->DIR_FstClusHI << 16 | dirInfo->DIR_FstClusLO);
+}
+
 
 
 
 
 // following are utility functions
-int root_directory_offset(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
-    return data_area_offset(diskMap) + (fsinfo->BPB_RootClus-2) * bytes_per_cluster(diskMap);
+// offsets are 64-bit, images and devices may be larger than 2 GB; open_disk
+// parses the geometry with these once, everything after reads it from the diskImage
+uint64_t root_directory_offset(diskImage* disk){
+    struct BootEntry* fsinfo = &disk->boot;
+    return disk->dataOffset + ((uint64_t)(fsinfo->BPB_RootClus-2) << disk->clusterShift);
 }
 
-int data_area_offset(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
+uint64_t data_area_offset(diskImage* disk){
+    struct BootEntry* fsinfo = &disk->boot;
 
     // find data area
-    int dataDirSectorOffset = fsinfo->BPB_RsvdSecCnt + fsinfo->BPB_NumFATs * fsinfo->BPB_FATSz32;
-    int dataDirByteOffset = fsinfo->BPB_BytsPerSec * dataDirSectorOffset;
+    uint64_t dataDirSectorOffset = fsinfo->BPB_RsvdSecCnt + (uint64_t)fsinfo->BPB_NumFATs * fsinfo->BPB_FATSz32;
+    uint64_t dataDirByteOffset = fsinfo->BPB_BytsPerSec * dataDirSectorOffset;
     return dataDirByteOffset;
 }
 
-int fat_area_offset(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
-    int FATByteOffset = fsinfo->BPB_RsvdSecCnt * fsinfo->BPB_BytsPerSec;
+uint64_t fat_area_offset(diskImage* disk){
+    struct BootEntry* fsinfo = &disk->boot;
+    uint64_t FATByteOffset = (uint64_t)fsinfo->BPB_RsvdSecCnt * fsinfo->BPB_BytsPerSec;
     return FATByteOffset;
 }
 
-int num_fat_tables(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
+int num_fat_tables(diskImage* disk){
+    struct BootEntry* fsinfo = &disk->boot;
     return fsinfo->BPB_NumFATs;
 }
 
-int fat_per_table_offset(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
-    return fsinfo->BPB_FATSz32 * fsinfo->BPB_BytsPerSec;
+uint64_t fat_per_table_offset(diskImage* disk){
+    struct BootEntry* fsinfo = &disk->boot;
+    return (uint64_t)fsinfo->BPB_FATSz32 * fsinfo->BPB_BytsPerSec;
 }
 
-int bytes_per_cluster(char* diskMap){
-    struct BootEntry* fsinfo = (struct BootEntry*)diskMap;
-    int BYTEPERCLUSTER = fsinfo->BPB_BytsPerSec * fsinfo->BPB_SecPerClus;
-    return BYTEPERCLUSTER;
+int cluster_count(diskImage* disk){
+    // one past the highest cluster number that has both a FAT entry and a data cluster
+    struct BootEntry* fsinfo = &disk->boot;
+    uint64_t totalSectors = fsinfo->BPB_TotSec16 != 0 ? fsinfo->BPB_TotSec16 : fsinfo->BPB_TotSec32;
+    uint64_t dataSectors = totalSectors - (fsinfo->BPB_RsvdSecCnt + (uint64_t)fsinfo->BPB_NumFATs * fsinfo->BPB_FATSz32);
+    uint64_t clusters = dataSectors / fsinfo->BPB_SecPerClus + 2;
+    uint64_t fatEntries = fat_per_table_offset(disk) / 4;
+    uint64_t count = clusters < fatEntries ? clusters : fatEntries;
+    return (int)(count < 0x0FFFFFF7 ? count : 0x0FFFFFF7);
 }
 
-int compare_file_name(unsigned char* one, char* two, int offset){
-    // one from fat32 two from user input
-    char* temp = malloc(sizeof(char)*(strlen(two)+1));
-    temp = strcpy(temp, two);
-
-    char* name = strtok(temp, ".");
-    char* ext = strtok(NULL, ".");
-
-    int i = offset;
-    if(strlen(name) > 8){
-        return 0;
-    }
-    while(i<(int)strlen(name)){
-        if(one[i] != name[i]){
-            return 0;
-        }
-        i++;
-    }
-    if(i<8){
-        if(one[i] != ' '){
-            return 0;
-        }
-    }
-
-    if(ext == 0){
-        return one[8] == ' ';
-    }
-
-    for(int j=8; j<11; j++){
-        if(one[j] != ext[j-8]){
-            return 0;
-        }
-    }
-    free(temp);
-    return 1;
+int worker_count(int requested){
+    // requested thread count, or one per online CPU when not given
+    if(requested > 0) return requested;
+    int online = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? online : 1;
 }
 
-char* get_contiguous_deleted_hash(char* diskMap, struct DirEntry* fileEntry){
-    int BYTEPERCLUSTER = bytes_per_cluster(diskMap);
-    int dataAreaByteOffset = data_area_offset(diskMap);
+int bytes_per_cluster(diskImage* disk){
+    struct BootEntry* fsinfo = &disk->boot;
+    int BYTEPERCLUSTER = fsinfo->BPB_BytsPerSec * fsinfo->BPB_SecPerClus;
+    return BYTEPERCLUSTER;
+}
 
+void get_contiguous_deleted_hash(diskImage* disk, struct DirEntry* fileEntry, char* hash){
+    // hashed a cluster at a time, the file need not be mapped in one piece
     int cluster = fileEntry->DIR_FstClusHI << 16 | fileEntry->DIR_FstClusLO;
-    int offset = dataAreaByteOffset + (cluster-2) * BYTEPERCLUSTER;
-    unsigned char* ptr = (unsigned char*)(diskMap + offset);
-
-    int fileSize = fileEntry->DIR_FileSize;
-    unsigned char* res = malloc(sizeof(char)*20);
-    
-    SHA1(ptr, (size_t)(fileSize*sizeof(char)), res);
-    return (char*)res;
+    uint64_t remaining = fileEntry->DIR_FileSize;
+
+    STAT_PHASE_BEGIN(PHASE_SEARCH);
+    SHA_CTX context;
+    SHA1_Init(&context);
+    while(remaining > 0){
+        char* data = get_cluster(disk, cluster);
+        if(data == NULL) break;
+        size_t length = remaining < (uint64_t)disk->clusterSize ? (size_t)remaining : (size_t)disk->clusterSize;
+        SHA1_Update(&context, data, length);
+        STAT_ADD(STAT_SHA_CALLS, 1);
+        STAT_ADD(STAT_SHA_BYTES, length);
+        put_cluster(disk, cluster);
+        remaining -= length;
+        cluster++;
+    }
+    SHA1_Final((unsigned char*)hash, &context);
+    STAT_PHASE_END(PHASE_SEARCH);
 }
 
 int compare_hash(char* one, char* two){
@@ -637,21 +782,10 @@ char char_to_hex(char c){
     }
 }
 
-char* input_to_hash(char* input){
-    char* res = malloc(sizeof(char)*20);
+void input_to_hash(char* input, char* hash){
     for(int i=0; i<20; i++){
-        res[i] = (char_to_hex(input[i*2]) << 4) | char_to_hex(input[i*2+1]);
+        hash[i] = (char_to_hex(input[i*2]) << 4) | char_to_hex(input[i*2+1]);
     }
-    return res;
-}
-
-char* fetch_data_by_cluster(char* diskMap, int clusterId){
-    int BYTEPERCLUSTER = bytes_per_cluster(diskMap);
-    int dataAreaByteOffset = data_area_offset(diskMap);
-
-    int offset = dataAreaByteOffset + (clusterId-2) * BYTEPERCLUSTER;
-    char* ptr = (char*)(diskMap + offset);
-    return ptr;
 }
 
 
@@ -0,0 +1,63 @@
+#ifndef NYUFILE_H
+#define NYUFILE_H
+
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+#define SHA_DIGEST_LENGTH 20
+
+#include <stdint.h>
+
+#include "fsinfo.h"
+#include "diskio.h"
+#include "search.h"
+#include "commit.h"
+
+unsigned char *SHA1(const unsigned char *d, size_t n, unsigned char *md);
+
+// one parsed command line, from argv or from a --serve request
+typedef struct commandLine{
+    int mode;               // 'i', 'l', 'L', 'r', 'R', 'b', 'C', 'S' or 'c', 0 for --serve
+    char* image;
+    char* filename;
+    char* manifestPath;
+    char* outDir;
+    char* digestPath;       // -S: one known SHA-1 per line
+    char* shaSignature;
+    char* extractDir;       // -x: write recovered files here, the image stays untouched
+    int check;              // -c: check the volume, before the recovery with -r, -R or -b
+    searchConfig config;
+    int backend;
+    size_t cacheBytes;
+    int statsFormat;
+    int indexGiven;
+    char* indexPath;        // NULL for the default <disk>.idx
+    char* servePath;
+} commandLine;
+
+int parse_command(int argc, char* argv[], commandLine* command);
+int is_write_command(commandLine* command);
+diskImage* open_image(commandLine* command, const char* path, int writable);
+void close_image(diskImage* disk);
+void run_command(diskImage* disk, commandLine* command);
+
+// recovery primitives shared by the single and batch paths
+void reset_fat_table(diskTransaction* txn, struct DirEntry* fileEntry, int isContiguous, int* clusterList, int clusterCount);
+void undelete_file(diskTransaction* txn, int dirCluster, int index, struct DirEntry* fileEntry, char* filename);
+void undelete_uncontiguous_file(diskTransaction* txn, int dirCluster, int index, struct DirEntry* fileEntry, char* filename, int* clusterList, int clusterCount);
+int commit_recovery(diskImage* disk, int dirCluster, int index, struct DirEntry* fileEntry, char* filename, int* clusterList, int clusterCount);
+
+// utility functions shared by the recovery modules
+uint64_t data_area_offset(diskImage* disk);
+uint64_t root_directory_offset(diskImage* disk);
+uint64_t fat_area_offset(diskImage* disk);
+int num_fat_tables(diskImage* disk);
+uint64_t fat_per_table_offset(diskImage* disk);
+int bytes_per_cluster(diskImage* disk);
+int cluster_count(diskImage* disk);
+int worker_count(int requested);
+void get_contiguous_deleted_hash(diskImage* disk, struct DirEntry* fileEntry, char* hash);
+int compare_hash(char* hash1, char* hash2);
+void input_to_hash(char* input, char* hash);
+char char_to_hex(char c);
+
+#endif
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "score.h"
+#include "diskio.h"
+#include "arena.h"
+#include "stats.h"
+#include "kernels.h"
+
+// continuity scores for the -R search
+//
+// every candidate cluster is profiled once at its head and its tail: byte
+// entropy, share of printable text, the bytes at the edge and, for text, the
+// partial line and word that cross the edge. the cost of b following a
+// compares a's tail with b's head; a wrong join usually shows up as an
+// entropy or text jump, a byte-value step, or a line or word that comes out
+// longer than any the cluster holds. each row of the order matrix then lists
+// the candidates by rising cost, and the search visits children in that
+// order, nearest following candidate first among equal costs, which is the
+// ascending order whenever the content says nothing. the ordering only
+// changes which chain is tried first, every chain is still reachable.
+
+#define SCORE_TEXT 0.95f            // printable share above which an edge counts as text
+#define SCORE_NOISE 7.0f            // bits per byte above which an edge carries no continuity signal
+#define SCORE_UNREADABLE 1e30f
+
+typedef struct edgeProfile{
+    int readable;
+    float headEntropy;              // bits per byte over the first SCORE_EDGE bytes
+    float tailEntropy;
+    float headText;                 // printable share of the same bytes
+    float tailText;
+    unsigned char head;             // first byte of the cluster
+    unsigned char tail;             // last two bytes of the cluster
+    unsigned char beforeTail;
+    int headLine;                   // bytes before the first newline, -1 when the edge has none
+    int tailLine;                   // bytes after the last newline, -1 when the edge has none
+    int shortestLine;               // full lines inside the cluster, 0 when there are none
+    int longestLine;
+    int headWord;                   // letters before the first non-letter
+    int tailWord;                   // letters after the last non-letter
+    int longestWord;
+} edgeProfile;
+
+typedef struct rankedCandidate{
+    float cost;
+    int gap;                        // candidates between a and this one going forward, breaks ties
+    int index;
+} rankedCandidate;
+
+typedef struct scoreShared{
+    diskImage* disk;
+    const int* candidates;
+    int count;
+    int workerCount;
+    edgeProfile* profiles;
+    uint16_t* order;
+    void (*profile)(edgeProfile* profile, const unsigned char* data, int clusterSize);
+} scoreShared;
+
+typedef struct scoreWorker{
+    int id;
+    pthread_t thread;
+    int started;
+    scoreShared* shared;
+    rankedCandidate* ranked;        // one row being sorted
+} scoreWorker;
+
+
+static float edge_entropy(const unsigned char* data, int length){
+    int histogram[256] = {0};
+    for(int i = 0; i < length; i++) histogram[data[i]] += 1;
+    float entropy = 0;
+    for(int b = 0; b < 256; b++){
+        if(histogram[b] == 0) continue;
+        float p = (float)histogram[b] / length;
+        entropy -= p * log2f(p);
+    }
+    return entropy;
+}
+
+static float edge_text(const unsigned char* data, int length){
+    int printable = 0;
+    for(int i = 0; i < length; i++){
+        if(isprint(data[i]) || data[i] == '\n' || data[i] == '\r' || data[i] == '\t') printable += 1;
+    }
+    return (float)printable / length;
+}
+
+KERNEL_BODY void profile_body(edgeProfile* profile, const unsigned char* data, int clusterSize){
+    int edge = clusterSize < SCORE_EDGE ? clusterSize : SCORE_EDGE;
+    const unsigned char* tail = data + clusterSize - edge;
+    profile->readable = 1;
+    profile->headEntropy = edge_entropy(data, edge);
+    profile->tailEntropy = edge_entropy(tail, edge);
+    profile->headText = edge_text(data, edge);
+    profile->tailText = edge_text(tail, edge);
+    profile->head = data[0];
+    profile->tail = data[clusterSize-1];
+    profile->beforeTail = data[clusterSize-2];
+
+    // lines and words, only meaningful when the edges are text
+    const unsigned char* newline = memchr(data, '\n', edge);
+    profile->headLine = newline != NULL ? (int)(newline - data) : -1;
+    profile->tailLine = -1;
+    for(int i = clusterSize - 1; i >= clusterSize - edge; i--){
+        if(data[i] == '\n'){
+            profile->tailLine = clusterSize - 1 - i;
+            break;
+        }
+    }
+    profile->shortestLine = 0;
+    profile->longestLine = 0;
+    profile->longestWord = 0;
+    int lineStart = -1;
+    int wordLength = 0;
+    for(int i = 0; i < clusterSize; i++){
+        if(data[i] == '\n'){
+            int line = i - lineStart - 1;
+            if(lineStart >= 0){
+                if(profile->shortestLine == 0 || line < profile->shortestLine) profile->shortestLine = line;
+                if(line > profile->longestLine) profile->longestLine = line;
+            }
+            lineStart = i;
+        }
+        if(isalpha(data[i])){
+            wordLength += 1;
+        }else{
+            if(wordLength > profile->longestWord && wordLength != i) profile->longestWord = wordLength;
+            wordLength = 0;
+        }
+    }
+    profile->headWord = 0;
+    while(profile->headWord < clusterSize && isalpha(data[profile->headWord])) profile->headWord += 1;
+    profile->tailWord = 0;
+    while(profile->tailWord < clusterSize && isalpha(data[clusterSize - 1 - profile->tailWord])) profile->tailWord += 1;
+}
+
+static void profile_cluster(edgeProfile* profile, const unsigned char* data, int clusterSize){
+    profile_body(profile, data, clusterSize);
+}
+
+// one copy of the body per cluster size, so the line and word scan and the
+// edge offsets run with a constant bound
+#define PROFILE_KERNEL(SIZE) \
+    static void profile_##SIZE(edgeProfile* profile, const unsigned char* data, int clusterSize){ \
+        (void)clusterSize; \
+        profile_body(profile, data, SIZE); \
+    }
+FOR_EACH_CLUSTER_SIZE(PROFILE_KERNEL)
+
+#define PROFILE_ENTRY(SIZE) profile_##SIZE,
+static void (*const profileKernels[CLUSTER_KERNELS])(edgeProfile*, const unsigned char*, int) = { FOR_EACH_CLUSTER_SIZE(PROFILE_ENTRY) };
+
+static float join_cost(const edgeProfile* a, const edgeProfile* b){
+    // how implausible it is for b to follow a, 0 for a seamless join
+    if(!a->readable || !b->readable) return SCORE_UNREADABLE;
+    // compressed or encrypted on both sides: every join looks alike, leave it to the gap
+    if(a->tailEntropy >= SCORE_NOISE && b->headEntropy >= SCORE_NOISE) return 0;
+    float cost = fabsf(a->tailEntropy - b->headEntropy) / 8 + fabsf(a->tailText - b->headText);
+    if(a->tailText >= SCORE_TEXT && b->headText >= SCORE_TEXT){
+        // text: the line and the word crossing the join should look like the ones around it
+        if(a->tailLine >= 0 && b->headLine >= 0 && a->longestLine > 0){
+            int line = a->tailLine + b->headLine;
+            if(line > a->longestLine) cost += fminf(1, (float)(line - a->longestLine) / a->longestLine);
+            if(line < a->shortestLine) cost += fminf(1, (float)(a->shortestLine - line) / a->longestLine);
+        }
+        if(a->longestWord > 0 && a->tailWord + b->headWord > a->longestWord) cost += 0.5f;
+        if(isspace(a->tail) && isspace(b->head)) cost += 0.5f;
+    }else{
+        // binary: smooth data continues the step of its last two bytes
+        int predicted = 2 * a->tail - a->beforeTail;
+        int step = abs(predicted - b->head);
+        int delta = abs(a->tail - b->head);
+        cost += (float)(step < delta ? step : delta) / 255;
+    }
+    return cost;
+}
+
+static int compare_ranked(const void* left, const void* right){
+    const rankedCandidate* a = left;
+    const rankedCandidate* b = right;
+    if(a->cost != b->cost) return a->cost < b->cost ? -1 : 1;
+    return a->gap - b->gap;
+}
+
+static void* profile_worker(void* arg){
+    scoreWorker* worker = (scoreWorker*)arg;
+    scoreShared* shared = worker->shared;
+    for(int i = worker->id; i < shared->count; i += shared->workerCount){
+        unsigned char* data = (unsigned char*)get_cluster(shared->disk, shared->candidates[i]);
+        if(data == NULL){
+            shared->profiles[i].readable = 0;
+            continue;
+        }
+        shared->profile(&shared->profiles[i], data, shared->disk->clusterSize);
+        put_cluster(shared->disk, shared->candidates[i]);
+    }
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+static void* rank_worker(void* arg){
+    scoreWorker* worker = (scoreWorker*)arg;
+    scoreShared* shared = worker->shared;
+    rankedCandidate* ranked = worker->ranked;
+    for(int a = worker->id; a < shared->count; a += shared->workerCount){
+        for(int b = 0; b < shared->count; b++){
+            ranked[b].index = b;
+            ranked[b].gap = (b - a + shared->count) % shared->count;
+            // the start cluster and a itself can never follow a, rank them last
+            ranked[b].cost = b == 0 || b == a ? INFINITY : join_cost(&shared->profiles[a], &shared->profiles[b]);
+        }
+        qsort(ranked, shared->count, sizeof(rankedCandidate), compare_ranked);
+        uint16_t* row = shared->order + (size_t)a * shared->count;
+        for(int k = 0; k < shared->count; k++) row[k] = (uint16_t)ranked[k].index;
+    }
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+static void run_workers(scoreShared* shared, scoreWorker* workers, void* (*routine)(void*)){
+    // worker 0 runs on the calling thread
+    for(int w = 0; w < shared->workerCount; w++) workers[w].started = 0;
+    for(int w = 1; w < shared->workerCount; w++){
+        workers[w].started = pthread_create(&workers[w].thread, NULL, routine, &workers[w]) == 0;
+    }
+    routine(&workers[0]);
+    for(int w = 1; w < shared->workerCount; w++){
+        // a stripe whose thread never started is done here instead
+        if(workers[w].started){
+            pthread_join(workers[w].thread, NULL);
+        }else{
+            routine(&workers[w]);
+        }
+    }
+}
+
+uint16_t* order_successors(diskImage* disk, const int* candidates, int count, int workerCount, arena* scratch){
+    // count x count matrix in scratch, NULL when there are too many candidates to rank
+    if(count < 2 || count > SCORE_MAX_CANDIDATES) return NULL;
+    scoreShared shared;
+    shared.disk = disk;
+    shared.candidates = candidates;
+    shared.count = count;
+    shared.workerCount = workerCount < count ? workerCount : count;
+    shared.profiles = arena_alloc(scratch, sizeof(edgeProfile) * count);
+    shared.order = arena_alloc(scratch, sizeof(uint16_t) * (size_t)count * count);
+    shared.profile = disk->kernel >= 0 && disk->kernel < CLUSTER_KERNELS ? profileKernels[disk->kernel] : profile_cluster;
+    scoreWorker* workers = arena_alloc(scratch, sizeof(scoreWorker) * shared.workerCount);
+    for(int w = 0; w < shared.workerCount; w++){
+        workers[w].id = w;
+        workers[w].shared = &shared;
+        workers[w].ranked = arena_alloc(scratch, sizeof(rankedCandidate) * count);
+    }
+    run_workers(&shared, workers, profile_worker);
+    run_workers(&shared, workers, rank_worker);
+    return shared.order;
+}
@@ -0,0 +1,14 @@
+#ifndef SCORE_H
+#define SCORE_H
+
+#include <stdint.h>
+#include "diskio.h"
+#include "arena.h"
+
+#define SCORE_EDGE 512              // bytes on each side of a join that are profiled
+#define SCORE_MAX_CANDIDATES 4096   // larger candidate sets keep their ascending order
+
+// row a lists every candidate index, most plausible successor of candidate a first
+uint16_t* order_successors(diskImage* disk, const int* candidates, int count, int workerCount, arena* scratch);
+
+#endif
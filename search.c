@@ -0,0 +1,887 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "search.h"
+#include "freemap.h"
+#include "validate.h"
+#include "score.h"
+#include "sha1lanes.h"
+#include "arena.h"
+#include "digest.h"
+#include "stats.h"
+
+// parallel engine for the non-contiguous (-R) search
+//
+// the search tree below the first cluster is cut at splitDepth into subtrees,
+// numbered in the order the serial depth-first search would visit them. each
+// worker owns a deque of subtrees and steals from the others once its own runs
+// dry. a match in subtree k cancels every subtree after k, but the ones before
+// it keep running, so the chain returned is always the one the serial search
+// would have found first.
+//
+// with a --deadline, --max-nodes or --checkpoint the search is anytime: it
+// runs in rounds over a widening prefix of the candidates, nearest first, and
+// a round only hashes the chains that use a candidate the earlier rounds did
+// not have. every worker adds its nodes to a shared count in batches and
+// checks the budget as it does; once the budget is gone every task stops, and
+// the subtrees searched to the end are saved so a later run skips them.
+//
+// before any of that, the orderings a fragmented file most often has are
+// tried serially: the candidates ascending, ascending with one run of them
+// skipped, and either of those with one adjacent pair swapped. every chain
+// has exactly the clusters the file size needs, and consecutive chains share
+// their prefix hashes, so most files of a few clusters are found after a
+// handful of finalizations instead of deep in the permutation order.
+
+#define TASKS_PER_WORKER 8
+#define MAX_TASKS 65536
+#define FAST_PATH_MAX_LENGTH 16     // longer chains go straight to the full search
+#define FAST_PATH_MAX_GAP 256       // candidates one skipped run may span
+
+typedef struct taskDeque{
+    pthread_mutex_t lock;
+    int* tasks;             // subtree indices, ascending
+    int head;               // owner pops here
+    int tail;               // thieves steal here
+} taskDeque;
+
+typedef struct searchShared{
+    diskImage* disk;
+    int* candidates;
+    int count;
+    int fileSize;
+    int clusterSize;
+    int clusterShift;
+    int chainLength;        // clusters needed to cover fileSize
+    char* targetHash;
+    const digestSet* targets;   // -S: any digest of the set matches instead of targetHash
+    const chainValidator* validator;    // picked by the first cluster's magic, NULL for none
+    int checkSlack;
+    slack_kernel slack;     // slack check specialised for clusterSize
+    uint16_t* order;        // successor ranking per candidate, NULL for ascending order
+
+    int splitDepth;
+    int taskCount;
+    int* taskPrefix;        // taskCount rows of splitDepth candidate indices
+
+    taskDeque* deques;
+    int workerCount;
+
+    atomic_int bestTask;    // lowest subtree with a match, INT_MAX while none
+    pthread_mutex_t resultLock;
+    int* result;
+    int matched;            // digest of targets the result hashes to
+
+    int totalCount;         // candidates of the whole search, count is this round's prefix of them
+    int floor;              // candidates below floor were searched by an earlier round
+    searchConfig* config;   // budget and progress, NULL for none
+    atomic_int stop;        // SEARCH_STOP_*
+    _Atomic uint64_t nodes; // every search of the command so far, flushed in SEARCH_NODE_BATCH steps
+    uint64_t roundNodes;    // nodes before this round started
+    double startTime;
+    double nextReport;
+    pthread_mutex_t progressLock;
+    char* done;             // subtrees searched to the end
+    atomic_int doneCount;
+} searchShared;
+
+// what a --checkpoint file holds: the search it belongs to, then one byte per
+// subtree of the round that was stopped, 1 once that subtree was searched to the end
+typedef struct searchCheckpoint{
+    char magic[8];
+    int32_t startCluster;
+    int32_t fileSize;
+    int32_t clusterSize;
+    int32_t count;
+    uint32_t candidateSum;          // FNV-1a over the candidate cluster numbers
+    int32_t order;
+    int32_t validate;
+    unsigned char targetHash[SHA_DIGEST_LENGTH];
+    int32_t width;                  // candidates of the stopped round
+    int32_t splitDepth;
+    int32_t taskCount;
+} searchCheckpoint;
+
+typedef struct searchWorker{
+    int id;
+    pthread_t thread;
+    int started;
+    searchShared* shared;
+    int currentTask;
+
+    // per-worker chain state, a fixed-depth stack of chainLength entries
+    int depth;              // clusters on the chain
+    int* chain;             // candidate index at each depth
+    char** data;            // pinned cluster at each depth, NULL outside the volume
+    SHA_CTX* prefix;        // prefix[d] = SHA-1 state after the first d clusters
+    validatorState* states; // states[d] = validator state after the first d clusters
+    char* used;             // candidates already on the chain
+    int matched;            // digest of targets the last match hashed to
+    int wide;               // chain members at or above floor
+    uint64_t nodes;
+} searchWorker;
+
+static volatile sig_atomic_t interrupted = 0;
+
+
+static int is_target(searchWorker* worker, const unsigned char* digest){
+    // the one target digest, or any digest of the set
+    searchShared* shared = worker->shared;
+    if(shared->targets == NULL) return compare_hash((char*)digest, shared->targetHash);
+    worker->matched = find_digest(shared->targets, digest);
+    return worker->matched >= 0;
+}
+
+static int search_cancelled(searchWorker* worker){
+    return atomic_load_explicit(&worker->shared->bestTask, memory_order_relaxed) < worker->currentTask
+           || atomic_load_explicit(&worker->shared->stop, memory_order_relaxed) != SEARCH_STOP_NONE;
+}
+
+double search_clock(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void report_progress(searchWorker* worker, uint64_t total, double now){
+    // one --progress line; what is left is extrapolated from the subtrees this round finished
+    searchShared* shared = worker->shared;
+    double elapsed = now - shared->startTime;
+    uint64_t spent = total - shared->config->nodesUsed;
+    int done = atomic_load(&shared->doneCount);
+    fprintf(stderr, "search: %d of %d candidates, depth %d of %d, %llu nodes, %.0f nodes/s, %d of %d subtrees",
+            shared->count, shared->totalCount, worker->depth, shared->chainLength,
+            (unsigned long long)spent, elapsed > 0 ? (double)spent / elapsed : 0.0, done, shared->taskCount);
+    if(done > 0){
+        double perTask = (double)(total - shared->roundNodes) / done;
+        fprintf(stderr, ", about %.0f nodes left at this width", perTask * (shared->taskCount - done));
+    }
+    fprintf(stderr, "\n");
+}
+
+static void check_budget(searchWorker* worker, uint64_t nodes){
+    // adds a batch of nodes to the shared count and stops the search once the budget is gone
+    searchShared* shared = worker->shared;
+    uint64_t total = atomic_fetch_add(&shared->nodes, nodes) + nodes;
+    searchConfig* config = shared->config;
+    if(config == NULL) return;
+    double now = config->deadlineAt > 0 || config->progress ? search_clock() : 0;
+    int reason = SEARCH_STOP_NONE;
+    if(interrupted){
+        reason = SEARCH_STOP_INTERRUPT;
+    }else if(config->maxNodes > 0 && total >= config->maxNodes){
+        reason = SEARCH_STOP_NODES;
+    }else if(config->deadlineAt > 0 && now >= config->deadlineAt){
+        reason = SEARCH_STOP_DEADLINE;
+    }
+    if(reason != SEARCH_STOP_NONE){
+        int expected = SEARCH_STOP_NONE;
+        atomic_compare_exchange_strong(&shared->stop, &expected, reason);
+    }
+    if(config->progress && pthread_mutex_trylock(&shared->progressLock) == 0){
+        if(now >= shared->nextReport){
+            shared->nextReport = now + SEARCH_PROGRESS_INTERVAL;
+            report_progress(worker, total, now);
+        }
+        pthread_mutex_unlock(&shared->progressLock);
+    }
+}
+
+static void spend_node(searchWorker* worker){
+    STAT_ADD(STAT_SEARCH_NODES, 1);
+    worker->nodes += 1;
+    if(worker->nodes % SEARCH_NODE_BATCH == 0) check_budget(worker, SEARCH_NODE_BATCH);
+}
+
+static void push_cluster(searchWorker* worker, int index){
+    searchShared* shared = worker->shared;
+    // pinned while on the chain, NULL if the cluster lies outside the volume
+    worker->data[worker->depth] = get_cluster(shared->disk, shared->candidates[index]);
+    worker->chain[worker->depth] = index;
+    worker->depth += 1;
+    worker->used[index] = 1;
+    if(index >= shared->floor) worker->wide += 1;
+}
+
+static void pop_cluster(searchWorker* worker){
+    worker->depth -= 1;
+    int index = worker->chain[worker->depth];
+    worker->used[index] = 0;
+    if(index >= worker->shared->floor) worker->wide -= 1;
+    put_cluster(worker->shared->disk, worker->shared->candidates[index]);
+}
+
+static int validate_cluster(searchWorker* worker, int depth, const unsigned char* data, int length){
+    // feeds the cluster at depth into the validator, 0 if the chain can no longer be a well-formed file
+    searchShared* shared = worker->shared;
+    if(shared->validator == NULL) return 1;
+    worker->states[depth] = worker->states[depth-1];
+    if(shared->validator->feed(&worker->states[depth], data, length)) return 1;
+    STAT_ADD(STAT_PRUNED, 1);
+    return 0;
+}
+
+static int leaf_accepted(searchWorker* worker, int depth, const unsigned char* data){
+    // validator and slack checks on the cluster that completes the chain at depth
+    searchShared* shared = worker->shared;
+    int used = shared->fileSize - ((depth-1) << shared->clusterShift);
+    if(!validate_cluster(worker, depth, data, used)) return 0;
+    if(shared->checkSlack && !shared->slack(data, used, shared->clusterSize)){
+        STAT_ADD(STAT_PRUNED, 1);
+        return 0;
+    }
+    return 1;
+}
+
+static int hash_leaves(searchWorker* worker, int* laneIndex, const unsigned char** laneData, int lanes){
+    // hashes a batch of final clusters from the shared prefix, returns the first lane that matches or -1
+    searchShared* shared = worker->shared;
+    int depth = worker->depth;
+    int length = shared->fileSize - (depth << shared->clusterShift);
+    unsigned char digests[SHA1_MAX_LANES][SHA_DIGEST_LENGTH];
+    sha1_finish_lanes(&worker->prefix[depth], laneData, length, lanes, digests);
+    STAT_ADD(STAT_SHA_CALLS, lanes);
+    STAT_ADD(STAT_SHA_BYTES, (uint64_t)length * lanes);
+    int match = -1;
+    for(int l = 0; l < lanes; l++){
+        if(match < 0 && is_target(worker, digests[l])) match = l;
+        put_cluster(shared->disk, shared->candidates[laneIndex[l]]);
+    }
+    return match;
+}
+
+static int match_leaves(searchWorker* worker, const uint16_t* row){
+    // every child completes the chain and continues the same prefix with the same length,
+    // so siblings are queued and hashed a lane batch at a time; the first match in child order wins
+    searchShared* shared = worker->shared;
+    int depth = worker->depth;
+    int width = sha1_lane_width();
+    int laneIndex[SHA1_MAX_LANES];
+    const unsigned char* laneData[SHA1_MAX_LANES];
+    int lanes = 0;
+    for(int k = 0; k < shared->count; k++){
+        int i = row != NULL ? row[k] : k;
+        if(worker->used[i]) continue;
+        // a chain of earlier-round candidates only was hashed by that round
+        if(worker->wide == 0 && i < shared->floor) continue;
+        if(search_cancelled(worker)) break;
+        spend_node(worker);
+        const unsigned char* data = (const unsigned char*)get_cluster(shared->disk, shared->candidates[i]);
+        if(data == NULL) continue;
+        if(!leaf_accepted(worker, depth+1, data)){
+            put_cluster(shared->disk, shared->candidates[i]);
+            continue;
+        }
+        laneIndex[lanes] = i;
+        laneData[lanes] = data;
+        lanes += 1;
+        if(lanes < width) continue;
+        int match = hash_leaves(worker, laneIndex, laneData, lanes);
+        if(match >= 0){
+            push_cluster(worker, laneIndex[match]);
+            return 1;
+        }
+        STAT_ADD(STAT_BACKTRACKS, lanes);
+        lanes = 0;
+    }
+    if(lanes > 0 && !search_cancelled(worker)){
+        int match = hash_leaves(worker, laneIndex, laneData, lanes);
+        if(match >= 0){
+            push_cluster(worker, laneIndex[match]);
+            return 1;
+        }
+        STAT_ADD(STAT_BACKTRACKS, lanes);
+    }else{
+        for(int l = 0; l < lanes; l++) put_cluster(shared->disk, shared->candidates[laneIndex[l]]);
+    }
+    return 0;
+}
+
+static int block_match_helper(searchWorker* worker){
+    // prefix[d] holds the SHA-1 state after the first d clusters of the chain,
+    // so a node only hashes its own cluster and backtracking reuses the parent state
+    searchShared* shared = worker->shared;
+    SHA_CTX* prefix = worker->prefix;
+    int depth = worker->depth;
+    int clusterSize = shared->clusterSize;
+    int clusterShift = shared->clusterShift;
+    unsigned char* data = (unsigned char*)worker->data[depth-1];
+    spend_node(worker);
+    if(data == NULL) return 0;
+
+    if((depth << clusterShift) >= shared->fileSize){
+        if(worker->wide == 0) return 0;
+        // base case: chain covers the whole file, only the final cluster needs a finalize
+        int used = shared->fileSize - ((depth-1) << clusterShift);
+        if(!leaf_accepted(worker, depth, data)) return 0;
+        SHA_CTX last = prefix[depth-1];
+        unsigned char fileHash[SHA_DIGEST_LENGTH];
+        SHA1_Update(&last, data, used);
+        STAT_ADD(STAT_SHA_CALLS, 1);
+        STAT_ADD(STAT_SHA_BYTES, used);
+        SHA1_Final(fileHash, &last);
+        return is_target(worker, fileHash);
+    }
+    if(!validate_cluster(worker, depth, data, clusterSize)) return 0;
+    prefix[depth] = prefix[depth-1];
+    SHA1_Update(&prefix[depth], data, clusterSize);
+    STAT_ADD(STAT_SHA_CALLS, 1);
+    STAT_ADD(STAT_SHA_BYTES, clusterSize);
+
+    // recursive case: try every candidate not already on the chain, most plausible successor first
+    const uint16_t* row = shared->order != NULL ? shared->order + (size_t)worker->chain[depth-1] * shared->count : NULL;
+    if(((depth+1) << clusterShift) >= shared->fileSize) return match_leaves(worker, row);
+    for(int k = 0; k < shared->count; k++){
+        int i = row != NULL ? row[k] : k;
+        if(worker->used[i]) continue;
+        if(search_cancelled(worker)) return 0;
+        push_cluster(worker, i);
+        if(block_match_helper(worker) == 1){
+            return 1;
+        }
+        pop_cluster(worker);
+        STAT_ADD(STAT_BACKTRACKS, 1);
+    }
+    return 0;
+}
+
+static void run_task(searchWorker* worker, int task){
+    searchShared* shared = worker->shared;
+    int* taskPrefix = shared->taskPrefix + (size_t)task * shared->splitDepth;
+    worker->currentTask = task;
+
+    // rebuild the subtree root; every node above splitDepth is an interior node
+    int readable = 1;
+    for(int d = 0; d < shared->splitDepth && readable; d++){
+        push_cluster(worker, taskPrefix[d]);
+        if(worker->data[d] == NULL){
+            readable = 0;
+        }else if(d < shared->splitDepth - 1){
+            if(!validate_cluster(worker, d+1, (unsigned char*)worker->data[d], shared->clusterSize)){
+                readable = 0;
+            }
+            worker->prefix[d+1] = worker->prefix[d];
+            SHA1_Update(&worker->prefix[d+1], worker->data[d], shared->clusterSize);
+            STAT_ADD(STAT_SHA_CALLS, 1);
+            STAT_ADD(STAT_SHA_BYTES, shared->clusterSize);
+        }
+    }
+
+    int found = readable && block_match_helper(worker) == 1;
+    if(!found && atomic_load(&shared->stop) == SEARCH_STOP_NONE){
+        // searched to the end, a resumed search skips it
+        shared->done[task] = 1;
+        atomic_fetch_add(&shared->doneCount, 1);
+    }
+    if(found){
+        pthread_mutex_lock(&shared->resultLock);
+        if(task < atomic_load(&shared->bestTask)){
+            for(int d = 0; d < worker->depth; d++){
+                shared->result[d] = shared->candidates[worker->chain[d]];
+            }
+            shared->matched = worker->matched;
+            atomic_store(&shared->bestTask, task);
+        }
+        pthread_mutex_unlock(&shared->resultLock);
+    }
+
+    while(worker->depth > 0){
+        pop_cluster(worker);
+    }
+}
+
+static int next_task(searchWorker* worker){
+    searchShared* shared = worker->shared;
+
+    // own deque first, lowest subtree first
+    taskDeque* own = &shared->deques[worker->id];
+    pthread_mutex_lock(&own->lock);
+    if(own->head < own->tail){
+        int task = own->tasks[own->head++];
+        pthread_mutex_unlock(&own->lock);
+        return task;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    // steal from the far end of the other deques
+    for(int k = 1; k < shared->workerCount; k++){
+        taskDeque* victim = &shared->deques[(worker->id + k) % shared->workerCount];
+        pthread_mutex_lock(&victim->lock);
+        if(victim->head < victim->tail){
+            int task = victim->tasks[--victim->tail];
+            pthread_mutex_unlock(&victim->lock);
+            return task;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return -1;
+}
+
+static void* search_worker(void* arg){
+    searchWorker* worker = (searchWorker*)arg;
+    int task;
+    while((task = next_task(worker)) >= 0){
+        if(task > atomic_load(&worker->shared->bestTask)) continue;
+        if(worker->shared->done[task] || atomic_load(&worker->shared->stop) != SEARCH_STOP_NONE) continue;
+        run_task(worker, task);
+    }
+    check_budget(worker, worker->nodes % SEARCH_NODE_BATCH);
+    STAT_THREAD_DONE();
+    return NULL;
+}
+
+static void init_worker(searchShared* shared, searchWorker* worker, int id, arena* scratch){
+    worker->id = id;
+    worker->shared = shared;
+    worker->currentTask = INT_MAX;
+    worker->depth = 0;
+    worker->chain = arena_alloc(scratch, sizeof(int) * shared->chainLength);
+    worker->data = arena_alloc(scratch, sizeof(char*) * shared->chainLength);
+    worker->prefix = arena_alloc(scratch, sizeof(SHA_CTX) * (shared->chainLength + 1));
+    SHA1_Init(&worker->prefix[0]);
+    worker->states = arena_alloc(scratch, sizeof(validatorState) * (shared->chainLength + 1));
+    if(shared->validator != NULL) shared->validator->start(&worker->states[0]);
+    worker->used = arena_calloc(scratch, shared->count, sizeof(char));
+    worker->matched = -1;
+    worker->wide = 0;
+    worker->nodes = 0;
+    worker->started = 0;
+}
+
+static long count_tasks(int count, int depth){
+    // ordered prefixes of the given depth that start with candidate 0
+    long tasks = 1;
+    for(int d = 1; d < depth; d++){
+        tasks *= count - d;
+        if(tasks > MAX_TASKS) return MAX_TASKS + 1;
+    }
+    return tasks;
+}
+
+static void fill_tasks(searchShared* shared, int* row, char* used, int depth, int* taskCounter){
+    if(depth == shared->splitDepth){
+        memcpy(shared->taskPrefix + (size_t)(*taskCounter) * shared->splitDepth, row, sizeof(int)*shared->splitDepth);
+        *taskCounter += 1;
+        return;
+    }
+    // same child order as block_match_helper, so subtrees stay numbered in search order
+    const uint16_t* order = shared->order != NULL ? shared->order + (size_t)row[depth-1] * shared->count : NULL;
+    for(int k = 0; k < shared->count; k++){
+        int i = order != NULL ? order[k] : k;
+        if(used[i]) continue;
+        used[i] = 1;
+        row[depth] = i;
+        fill_tasks(shared, row, used, depth+1, taskCounter);
+        used[i] = 0;
+    }
+}
+
+int* get_candidate_clusters(freeMap* map, searchConfig* config, int startingCluster, int* count, arena* scratch){
+    // start cluster first, then every free cluster of the window or range, ascending
+    int window = config->window > 0 ? config->window : 20;
+    int maxCandidates = config->rangeEnd != 0 ? config->rangeEnd - config->rangeStart + 2 : window + 1;
+    int* clusterList = arena_alloc(scratch, sizeof(int)*maxCandidates);
+    clusterList[0] = startingCluster;
+    *count = 1;
+    if(config->rangeEnd != 0){
+        *count += collect_free_clusters(map, config->rangeStart, config->rangeEnd, startingCluster, clusterList+1, maxCandidates-1);
+    }else{
+        *count += collect_free_clusters(map, startingCluster+1, startingCluster+window, startingCluster, clusterList+1, maxCandidates-1);
+    }
+    return clusterList;
+}
+
+static uint32_t candidate_sum(const int* candidates, int count){
+    // FNV-1a over the candidate cluster numbers
+    uint32_t hash = 2166136261u;
+    for(int i = 0; i < count; i++){
+        hash ^= (uint32_t)candidates[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int load_checkpoint(const char* path, const searchCheckpoint* identity, searchCheckpoint* saved, char** done){
+    // 1 when path holds a checkpoint of the search identity describes; *done is malloc'd then
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) return 0;
+    int ok = fread(saved, sizeof(searchCheckpoint), 1, file) == 1
+             && memcmp(saved, identity, offsetof(searchCheckpoint, width)) == 0
+             && saved->splitDepth >= 1 && saved->taskCount >= 1 && saved->taskCount <= MAX_TASKS;
+    if(ok){
+        *done = malloc(saved->taskCount);
+        ok = fread(*done, 1, saved->taskCount, file) == (size_t)saved->taskCount;
+        if(!ok) free(*done);
+    }
+    fclose(file);
+    if(!ok) fprintf(stderr, "%s: not a checkpoint of this search, starting over\n", path);
+    return ok;
+}
+
+static void save_checkpoint(const char* path, searchCheckpoint* checkpoint, const char* done){
+    // written beside path and renamed over it, so a checkpoint is never half written
+    char* temporary = malloc(strlen(path) + 5);
+    sprintf(temporary, "%s.tmp", path);
+    FILE* file = fopen(temporary, "wb");
+    int ok = file != NULL
+             && fwrite(checkpoint, sizeof(searchCheckpoint), 1, file) == 1
+             && fwrite(done, 1, checkpoint->taskCount, file) == (size_t)checkpoint->taskCount;
+    if(file != NULL && fclose(file) != 0) ok = 0;
+    if(!ok || rename(temporary, path) != 0){
+        perror(path);
+        unlink(temporary);
+    }
+    free(temporary);
+}
+
+static int next_width(int width, int chainLength, int count){
+    // candidates beyond the chain length double every round
+    int extra = (width - chainLength) * 2;
+    return chainLength + extra < count ? chainLength + extra : count;
+}
+
+static int* search_round(searchShared* shared, arena* scratch, const searchCheckpoint* resume, const char* resumeDone){
+    // one search over the first shared->count candidates; resume fixes the split and the subtrees already done
+    diskImage* disk = shared->disk;
+    int count = shared->count;
+    STAT_PHASE_BEGIN(PHASE_SEARCH);
+
+    int workerCount = shared->workerCount;
+    shared->order = NULL;
+    if(shared->config != NULL && shared->config->order == SEARCH_ORDER_SCORED){
+        shared->order = order_successors(disk, shared->candidates, count, workerCount, scratch);
+    }
+
+    // cut deep enough to give every worker several subtrees to balance over
+    shared->splitDepth = 1;
+    while(shared->splitDepth < shared->chainLength
+          && count_tasks(count, shared->splitDepth) < (long)workerCount * TASKS_PER_WORKER
+          && count_tasks(count, shared->splitDepth+1) <= MAX_TASKS){
+        shared->splitDepth += 1;
+    }
+    if(resume != NULL) shared->splitDepth = resume->splitDepth;
+    shared->taskCount = (int)count_tasks(count, shared->splitDepth);
+    shared->taskPrefix = arena_alloc(scratch, sizeof(int) * (size_t)shared->taskCount * shared->splitDepth);
+    int* row = arena_alloc(scratch, sizeof(int) * shared->splitDepth);
+    char* used = arena_calloc(scratch, count, sizeof(char));
+    int taskCounter = 0;
+    row[0] = 0;
+    used[0] = 1;
+    fill_tasks(shared, row, used, 1, &taskCounter);
+    shared->done = arena_calloc(scratch, shared->taskCount, sizeof(char));
+    atomic_init(&shared->doneCount, 0);
+    if(resume != NULL && resume->taskCount == shared->taskCount){
+        memcpy(shared->done, resumeDone, shared->taskCount);
+        for(int t = 0; t < shared->taskCount; t++) shared->doneCount += shared->done[t] != 0;
+    }
+
+    // deal the subtrees round-robin so every deque starts at the front of the tree
+    shared->deques = arena_alloc(scratch, sizeof(taskDeque) * workerCount);
+    for(int w = 0; w < workerCount; w++){
+        pthread_mutex_init(&shared->deques[w].lock, NULL);
+        shared->deques[w].tasks = arena_alloc(scratch, sizeof(int) * (shared->taskCount / workerCount + 1));
+        shared->deques[w].head = 0;
+        shared->deques[w].tail = 0;
+    }
+    for(int t = 0; t < shared->taskCount; t++){
+        taskDeque* deque = &shared->deques[t % workerCount];
+        deque->tasks[deque->tail++] = t;
+    }
+
+    atomic_init(&shared->bestTask, INT_MAX);
+    pthread_mutex_init(&shared->resultLock, NULL);
+    pthread_mutex_init(&shared->progressLock, NULL);
+    shared->result = arena_alloc(scratch, sizeof(int) * shared->chainLength);
+    shared->roundNodes = atomic_load(&shared->nodes);
+
+    // each worker's state is cut from scratch once, the search itself never allocates
+    searchWorker* workers = arena_alloc(scratch, sizeof(searchWorker) * workerCount);
+    for(int w = 0; w < workerCount; w++){
+        init_worker(shared, &workers[w], w, scratch);
+    }
+    for(int w = 1; w < workerCount; w++){
+        // a thread that fails to start only means less stealing, the others drain its deque
+        workers[w].started = pthread_create(&workers[w].thread, NULL, search_worker, &workers[w]) == 0;
+    }
+    search_worker(&workers[0]);
+    for(int w = 1; w < workerCount; w++){
+        if(workers[w].started) pthread_join(workers[w].thread, NULL);
+    }
+
+    int* result = NULL;
+    if(atomic_load(&shared->bestTask) != INT_MAX){
+        // the chain outlives scratch, the caller commits it later
+        result = malloc(sizeof(int) * shared->chainLength);
+        memcpy(result, shared->result, sizeof(int) * shared->chainLength);
+    }else if(atomic_load(&shared->doneCount) == shared->taskCount){
+        // the budget ran out only after the last subtree, nothing was left undone
+        atomic_store(&shared->stop, SEARCH_STOP_NONE);
+    }
+
+    for(int w = 0; w < workerCount; w++){
+        pthread_mutex_destroy(&shared->deques[w].lock);
+    }
+    pthread_mutex_destroy(&shared->resultLock);
+    pthread_mutex_destroy(&shared->progressLock);
+    STAT_PHASE_END(PHASE_SEARCH);
+    return result;
+}
+
+static int probe_chain(searchWorker* worker, const int* chain){
+    // hashes one whole chain, keeping whatever prefix the worker already holds; 1 on a match, left on the worker
+    searchShared* shared = worker->shared;
+    int last = shared->chainLength - 1;
+    int keep = 0;
+    while(keep < worker->depth && keep < last && worker->chain[keep] == chain[keep]) keep++;
+    while(worker->depth > keep) pop_cluster(worker);
+
+    // interior clusters, as in block_match_helper
+    while(worker->depth < last){
+        int d = worker->depth;
+        push_cluster(worker, chain[d]);
+        spend_node(worker);
+        if(worker->data[d] == NULL || !validate_cluster(worker, d+1, (unsigned char*)worker->data[d], shared->clusterSize)){
+            pop_cluster(worker);
+            return 0;
+        }
+        worker->prefix[d+1] = worker->prefix[d];
+        SHA1_Update(&worker->prefix[d+1], worker->data[d], shared->clusterSize);
+        STAT_ADD(STAT_SHA_CALLS, 1);
+        STAT_ADD(STAT_SHA_BYTES, shared->clusterSize);
+    }
+
+    push_cluster(worker, chain[last]);
+    spend_node(worker);
+    unsigned char* data = (unsigned char*)worker->data[last];
+    if(data != NULL && leaf_accepted(worker, last+1, data)){
+        int used = shared->fileSize - (last << shared->clusterShift);
+        SHA_CTX context = worker->prefix[last];
+        unsigned char fileHash[SHA_DIGEST_LENGTH];
+        SHA1_Update(&context, data, used);
+        STAT_ADD(STAT_SHA_CALLS, 1);
+        STAT_ADD(STAT_SHA_BYTES, used);
+        SHA1_Final(fileHash, &context);
+        if(is_target(worker, fileHash)) return 1;
+    }
+    pop_cluster(worker);
+    return 0;
+}
+
+static void ascending_chain(int* chain, const int* sequence, int length, int split, int gap){
+    // the sequence from its start, skipping gap of it from position split on
+    for(int d = 0; d < length; d++) chain[d] = sequence[d < split ? d : d + gap];
+}
+
+static int keep_probing(searchShared* shared, int found){
+    return !found && atomic_load_explicit(&shared->stop, memory_order_relaxed) == SEARCH_STOP_NONE;
+}
+
+static int* try_fast_paths(searchShared* shared, arena* scratch){
+    // the likeliest orderings, serially before the rounds; a malloc'd chain or NULL
+    int length = shared->chainLength;
+    int count = shared->count;
+    shared->floor = 0;
+    shared->taskCount = 0;
+    atomic_init(&shared->doneCount, 0);
+    atomic_init(&shared->bestTask, INT_MAX);
+    shared->roundNodes = atomic_load(&shared->nodes);
+    pthread_mutex_init(&shared->progressLock, NULL);
+    searchWorker worker;
+    init_worker(shared, &worker, 0, scratch);
+    int* chain = arena_alloc(scratch, sizeof(int) * length);
+
+    // the start cluster, the candidates after it, then those a --range puts before it
+    int* sequence = arena_alloc(scratch, sizeof(int) * count);
+    int next = 0;
+    sequence[next++] = 0;
+    for(int i = 1; i < count; i++) if(shared->candidates[i] > shared->candidates[0]) sequence[next++] = i;
+    for(int i = 1; i < count; i++) if(shared->candidates[i] < shared->candidates[0]) sequence[next++] = i;
+
+    // pass 0 takes the chains as they are, pass 1 swaps one adjacent pair after the start cluster;
+    // gap 0 is the plain ascending chain, the rest skip gap candidates from position split on,
+    // the latest split first so the chains that follow share the longest prefix
+    int gaps = count - length < FAST_PATH_MAX_GAP ? count - length : FAST_PATH_MAX_GAP;
+    int found = 0;
+    for(int pass = 0; pass < 2 && keep_probing(shared, found); pass++){
+        for(int gap = 0; gap <= gaps && keep_probing(shared, found); gap++){
+            for(int split = length - 1; split >= (gap == 0 ? length - 1 : 1) && keep_probing(shared, found); split--){
+                if(pass == 0){
+                    ascending_chain(chain, sequence, length, split, gap);
+                    found = probe_chain(&worker, chain);
+                }
+                for(int p = length - 2; pass == 1 && p >= 1 && keep_probing(shared, found); p--){
+                    ascending_chain(chain, sequence, length, split, gap);
+                    int swap = chain[p];
+                    chain[p] = chain[p+1];
+                    chain[p+1] = swap;
+                    found = probe_chain(&worker, chain);
+                }
+            }
+        }
+    }
+
+    int* result = NULL;
+    if(found){
+        result = malloc(sizeof(int) * length);
+        for(int d = 0; d < length; d++) result[d] = shared->candidates[worker.chain[d]];
+        shared->matched = worker.matched;
+    }
+    while(worker.depth > 0) pop_cluster(&worker);
+    check_budget(&worker, worker.nodes % SEARCH_NODE_BATCH);
+    pthread_mutex_destroy(&shared->progressLock);
+    return result;
+}
+
+static void on_interrupt(int signo){
+    (void)signo;
+    interrupted = 1;
+}
+
+static int* block_match(diskImage* disk, int* possibleClusters, int count, int fileSize, char* shaSignature, const digestSet* targets,
+                        int* resultSize, int* matched, searchConfig* config, arena* scratch){
+    searchShared shared;
+    shared.disk = disk;
+    shared.candidates = possibleClusters;
+    shared.count = count;
+    shared.totalCount = count;
+    shared.fileSize = fileSize;
+    shared.clusterSize = disk->clusterSize;
+    shared.clusterShift = disk->clusterShift;
+    shared.chainLength = (fileSize + shared.clusterSize - 1) / shared.clusterSize;
+    if(shared.chainLength < 1) shared.chainLength = 1;
+    shared.targetHash = shaSignature;
+    shared.targets = targets;
+    shared.matched = -1;
+    if(shared.chainLength > count){
+        // not enough candidates to cover the file
+        return NULL;
+    }
+    if(config != NULL && config->stopped != SEARCH_STOP_NONE){
+        // an earlier search of the command spent the budget
+        return NULL;
+    }
+    int validate = config != NULL ? config->validate : 0;
+    shared.validator = NULL;
+    shared.checkSlack = (validate & VALIDATE_SLACK) != 0;
+    shared.slack = select_slack_kernel(disk->kernel);
+    if(validate & VALIDATE_FORMAT){
+        void* first = get_cluster(disk, possibleClusters[0]);
+        if(first != NULL){
+            shared.validator = select_validator(first, fileSize < shared.clusterSize ? fileSize : shared.clusterSize);
+            put_cluster(disk, possibleClusters[0]);
+        }
+    }
+    shared.workerCount = worker_count(config != NULL ? config->threadCount : 0);
+    shared.config = config;
+    atomic_init(&shared.stop, SEARCH_STOP_NONE);
+    atomic_init(&shared.nodes, config != NULL ? config->nodesUsed : 0);
+    shared.startTime = search_clock();
+    shared.nextReport = shared.startTime + SEARCH_PROGRESS_INTERVAL;
+
+    // the anytime rounds, or a single one over every candidate
+    int anytime = config != NULL && (config->deadlineAt > 0 || config->maxNodes > 0 || config->checkpointPath != NULL);
+    int width = anytime && shared.chainLength + SEARCH_FIRST_WIDTH < count ? shared.chainLength + SEARCH_FIRST_WIDTH : count;
+    int floor = 0;
+
+    // a checkpoint names the round it stopped in and the subtrees that round finished
+    const char* checkpointPath = config != NULL && targets == NULL ? config->checkpointPath : NULL;
+    searchCheckpoint identity;
+    memset(&identity, 0, sizeof(identity));
+    memcpy(identity.magic, CHECKPOINT_MAGIC, sizeof(identity.magic));
+    identity.startCluster = possibleClusters[0];
+    identity.fileSize = fileSize;
+    identity.clusterSize = shared.clusterSize;
+    identity.count = count;
+    identity.candidateSum = candidate_sum(possibleClusters, count);
+    identity.order = config != NULL ? config->order : SEARCH_ORDER_RAW;
+    identity.validate = validate;
+    if(shaSignature != NULL) memcpy(identity.targetHash, shaSignature, SHA_DIGEST_LENGTH);
+    searchCheckpoint saved;
+    char* savedDone = NULL;
+    int resumed = checkpointPath != NULL && load_checkpoint(checkpointPath, &identity, &saved, &savedDone);
+    int owned = resumed;            // only a checkpoint of this search is removed once it is over
+    if(resumed){
+        while(width < saved.width){
+            floor = width;
+            width = next_width(width, shared.chainLength, count);
+        }
+        if(width != saved.width){
+            fprintf(stderr, "%s: not a checkpoint of this search, starting over\n", checkpointPath);
+            resumed = 0;
+            width = anytime && shared.chainLength + SEARCH_FIRST_WIDTH < count ? shared.chainLength + SEARCH_FIRST_WIDTH : count;
+            floor = 0;
+        }
+    }
+    struct sigaction previous;
+    if(checkpointPath != NULL){
+        // ^C stops the search like a spent budget, so the checkpoint is kept
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_interrupt;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &previous);
+    }
+
+    int* result = NULL;
+    int rounds = 0;
+    int scope = config != NULL ? config->scope : 0;
+    if(scope != SEARCH_SCOPE_FULL && shared.chainLength <= FAST_PATH_MAX_LENGTH) result = try_fast_paths(&shared, scratch);
+    while(scope != SEARCH_SCOPE_FAST && result == NULL && atomic_load(&shared.stop) == SEARCH_STOP_NONE){
+        shared.count = width;
+        shared.floor = floor;
+        result = search_round(&shared, scratch, resumed ? &saved : NULL, savedDone);
+        resumed = 0;
+        rounds += 1;
+        if(result != NULL || atomic_load(&shared.stop) != SEARCH_STOP_NONE || width == count) break;
+        floor = width;
+        width = next_width(width, shared.chainLength, count);
+    }
+    free(savedDone);
+    if(checkpointPath != NULL) sigaction(SIGINT, &previous, NULL);
+
+    if(config != NULL){
+        config->nodesUsed = atomic_load(&shared.nodes);
+        config->stopped = atomic_load(&shared.stop);
+    }
+    if(result != NULL){
+        *resultSize = shared.chainLength;
+        if(matched != NULL) *matched = shared.matched;
+    }
+    if(config != NULL && config->stopped != SEARCH_STOP_NONE){
+        static const char* reasons[] = { "", "deadline reached", "node limit reached", "interrupted" };
+        fprintf(stderr, "search stopped: %s after %llu nodes", reasons[config->stopped], (unsigned long long)config->nodesUsed);
+        if(checkpointPath != NULL && rounds > 0){
+            // stopped in the fast paths a checkpoint has nothing new, one already there is kept
+            identity.width = width;
+            identity.splitDepth = shared.splitDepth;
+            identity.taskCount = shared.taskCount;
+            save_checkpoint(checkpointPath, &identity, shared.done);
+            fprintf(stderr, ", checkpoint saved to %s", checkpointPath);
+        }
+        fprintf(stderr, "\n");
+    }else if(owned){
+        // the search is over one way or the other, there is nothing to resume
+        unlink(checkpointPath);
+    }
+    return result;
+}
+
+int* get_uncontinguous_block_match(diskImage* disk, int* possibleClusters, int count, int fileSize, char* shaSignature, int* resultSize, searchConfig* config, arena* scratch){
+    // returns a malloc'd array of clusters that match the hash, all search state lives in scratch
+    return block_match(disk, possibleClusters, count, fileSize, shaSignature, NULL, resultSize, NULL, config, scratch);
+}
+
+int* get_digest_set_match(diskImage* disk, int* possibleClusters, int count, int fileSize, const digestSet* targets, int* resultSize, int* matched, searchConfig* config, arena* scratch){
+    // the same search against every digest of targets at once, *matched is the one the chain hashes to
+    return block_match(disk, possibleClusters, count, fileSize, NULL, targets, resultSize, matched, config, scratch);
+}
@@ -0,0 +1,56 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdint.h>
+
+#include "freemap.h"
+#include "diskio.h"
+#include "arena.h"
+
+#define SEARCH_ORDER_RAW 0          // children in ascending cluster order
+#define SEARCH_ORDER_SCORED 1       // children by continuity score, most plausible first
+
+// why the searches of a command gave up early
+#define SEARCH_STOP_NONE 0
+#define SEARCH_STOP_DEADLINE 1
+#define SEARCH_STOP_NODES 2
+#define SEARCH_STOP_INTERRUPT 3     // SIGINT while a checkpoint was being kept
+
+// which parts of a search run, 0 for both
+#define SEARCH_SCOPE_FAST 1         // only the ordered fast paths
+#define SEARCH_SCOPE_FULL 2         // only the permutation rounds, the fast paths already ran
+
+#define SEARCH_NODE_BATCH 1024      // nodes a worker visits between budget checks
+#define SEARCH_PROGRESS_INTERVAL 1.0    // seconds between --progress lines
+#define SEARCH_FIRST_WIDTH 4        // candidates of the first anytime round beyond the chain length
+#define CHECKPOINT_MAGIC "NYUSRC01"
+
+typedef struct searchConfig{
+    int threadCount;        // worker threads for the -R search, 0 = one per online CPU
+    int window;             // clusters after the start cluster to search, 0 = default of 20
+    int rangeStart;         // explicit candidate range, used instead of the window when rangeEnd != 0
+    int rangeEnd;
+    int validate;           // VALIDATE_* checks applied while chains grow
+    int order;              // SEARCH_ORDER_*
+    int scope;              // SEARCH_SCOPE_*, 0 for the fast paths then the full search
+
+    // budget shared by every search of one command; with one set, or a
+    // checkpoint, the search widens its candidates round by round
+    double deadline;        // --deadline seconds, 0 for none
+    double deadlineAt;      // search_clock() time it runs out, set when the command starts
+    uint64_t maxNodes;      // --max-nodes, 0 for none
+    uint64_t nodesUsed;
+    int progress;           // --progress: a line on stderr every SEARCH_PROGRESS_INTERVAL
+    const char* checkpointPath;     // --checkpoint: resume from and save to this file
+    int stopped;            // SEARCH_STOP_*, set once the budget is gone
+} searchConfig;
+
+// candidates and search state come from scratch, which the caller resets between entries
+int* get_candidate_clusters(freeMap* map, searchConfig* config, int startingCluster, int* count, arena* scratch);
+struct digestSet;
+
+int* get_uncontinguous_block_match(diskImage* disk, int* possibleClusters, int count, int fileSize, char* shaSignature, int* resultSize, searchConfig* config, arena* scratch);
+double search_clock(void);
+int* get_digest_set_match(diskImage* disk, int* possibleClusters, int count, int fileSize, const struct digestSet* targets, int* resultSize, int* matched, searchConfig* config, arena* scratch);
+
+#endif
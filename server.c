@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "server.h"
+#include "stats.h"
+
+// long-running server (--serve)
+//
+// orchestration sends thousands of small queries per incident, and every run
+// used to pay for opening the image, loading its FAT and warming the page
+// cache again. the server keeps each image it is asked about open, with the
+// FAT loaded and the sidecar attached when --index is given, and answers one
+// request per connection on a Unix socket. a request is one line holding the
+// arguments of a normal run, image first ("disk.img -R NAME.EXT -s SHA"), and
+// the reply is what that run would print. every request runs in a child
+// forked from the server: it starts with the image already parsed, and its
+// stdout, stats and memory are its own. requests that only read run side by
+// side; a recovery holds its image alone and the image is reopened after it,
+// so later requests never see a stale FAT or sidecar. paths in requests are
+// relative to the directory the server was started in.
+
+typedef struct serverImage{
+    char* path;                     // as first requested, reopened by it
+    dev_t device;
+    ino_t inode;
+    diskImage* disk;                // NULL when reopening after a recovery failed
+    int writable;
+    pthread_rwlock_t lock;          // shared by readers, held alone by a recovery
+} serverImage;
+
+typedef struct serverState{
+    commandLine* options;           // how every image is opened
+    pthread_mutex_t lock;           // the image table and the client count
+    pthread_cond_t changed;
+    pthread_mutex_t parseLock;      // getopt keeps global state
+    serverImage images[SERVER_MAX_IMAGES];
+    int imageCount;
+    int clients;
+} serverState;
+
+typedef struct serverClient{
+    serverState* state;
+    int fd;
+} serverClient;
+
+
+static int read_request(int fd, char* line, int capacity){
+    // one line, without its newline; -1 when it does not fit or the client went away
+    int length = 0;
+    while(length < capacity){
+        ssize_t got = read(fd, line + length, capacity - length);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) break;
+        char* newline = memchr(line + length, '\n', got);
+        length += got;
+        if(newline != NULL){
+            *newline = '\0';
+            return (int)(newline - line);
+        }
+    }
+    if(length == 0 || length == capacity) return -1;
+    line[length] = '\0';
+    return length;
+}
+
+static int split_request(char* line, char** args){
+    // "disk -l" becomes { "nyufile", "disk", "-l" }, as main would see it
+    int count = 0;
+    char* save = NULL;
+    args[count++] = "nyufile";
+    for(char* word = strtok_r(line, " \t\r", &save); word != NULL; word = strtok_r(NULL, " \t\r", &save)){
+        if(count == SERVER_MAX_ARGS - 1) return -1;
+        args[count++] = word;
+    }
+    args[count] = NULL;
+    return count;
+}
+
+static diskImage* load_image(serverState* state, serverImage* image){
+    diskImage* disk = open_image(state->options, image->path, image->writable);
+    // children inherit the loaded FAT, each of them would load its own otherwise
+    if(disk != NULL) disk_fat(disk);
+    return disk;
+}
+
+static serverImage* lookup_image(serverState* state, const struct stat* sb){
+    // with state->lock held
+    for(int i = 0; i < state->imageCount; i++){
+        if(state->images[i].device == sb->st_dev && state->images[i].inode == sb->st_ino) return &state->images[i];
+    }
+    return NULL;
+}
+
+static serverImage* find_image(serverState* state, const char* path){
+    // the open image at path, opened now if it is not yet. images are told apart by
+    // device and inode, so two spellings of one path share one image and its lock
+    struct stat sb;
+    if(stat(path, &sb) < 0) return NULL;
+    pthread_mutex_lock(&state->lock);
+    serverImage* found = lookup_image(state, &sb);
+    pthread_mutex_unlock(&state->lock);
+    if(found != NULL) return found;
+
+    // opening and loading the FAT and sidecar can take seconds, other images are served meanwhile
+    serverImage opened;
+    memset(&opened, 0, sizeof(serverImage));
+    opened.path = strdup(path);
+    opened.device = sb.st_dev;
+    opened.inode = sb.st_ino;
+    // an image that cannot be written is still served, recoveries are refused
+    opened.writable = access(path, W_OK) == 0;
+    opened.disk = load_image(state, &opened);
+    if(opened.disk == NULL){
+        free(opened.path);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    // another client may have opened the same image in the meantime, the first one in is kept
+    found = lookup_image(state, &sb);
+    if(found == NULL && state->imageCount < SERVER_MAX_IMAGES){
+        found = &state->images[state->imageCount];
+        *found = opened;
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+        // a steady stream of readers must not hold a recovery off forever
+        pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&found->lock, &attributes);
+        pthread_rwlockattr_destroy(&attributes);
+        state->imageCount += 1;
+        opened.disk = NULL;
+    }
+    pthread_mutex_unlock(&state->lock);
+    if(opened.disk != NULL){
+        close_image(opened.disk);
+        free(opened.path);
+    }
+    return found;
+}
+
+static void reopen_image(serverState* state, serverImage* image){
+    // after a recovery, with the image held alone; nothing else reads image->disk
+    // without its lock, so the table stays open to other clients meanwhile
+    if(image->disk != NULL) close_image(image->disk);
+    image->disk = load_image(state, image);
+}
+
+static void run_request(serverImage* image, commandLine* command, int fd){
+    fflush(stdout);
+    fflush(stderr);
+    pid_t child = fork();
+    if(child < 0){
+        dprintf(fd, "fork: %s\n", strerror(errno));
+        return;
+    }
+    if(child == 0){
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        // drop the other connections, a client sees the end of its reply when its child exits
+        unsigned int keep = image->disk->fd;
+        if(keep > 3) close_range(3, keep - 1, 0);
+        close_range(keep + 1, ~0U, 0);
+        stats_reset();
+        run_command(image->disk, command);
+        if(is_write_command(command)){
+            STAT_PHASE_BEGIN(PHASE_COMMIT);
+            flush_disk(image->disk);
+            STAT_PHASE_END(PHASE_COMMIT);
+        }
+        // the reply and the stats share the socket, the reply comes first
+        fflush(stdout);
+        if(command->statsFormat != 0){
+            stats_report(command->statsFormat);
+        }
+        _exit(0);
+    }
+    while(waitpid(child, NULL, 0) < 0 && errno == EINTR);
+}
+
+static void serve_request(serverState* state, int fd){
+    char line[SERVER_MAX_LINE];
+    char* args[SERVER_MAX_ARGS];
+    commandLine command;
+    if(read_request(fd, line, sizeof(line)) < 0){
+        dprintf(fd, "invalid request\n");
+        return;
+    }
+    int count = split_request(line, args);
+    pthread_mutex_lock(&state->parseLock);
+    int parsed = count >= 0 && parse_command(count, args, &command) && command.servePath == NULL;
+    pthread_mutex_unlock(&state->parseLock);
+    if(!parsed){
+        dprintf(fd, "invalid request\n");
+        return;
+    }
+
+    serverImage* image = find_image(state, command.image);
+    if(image == NULL){
+        dprintf(fd, "%s: cannot open image\n", command.image);
+        return;
+    }
+    int write = is_write_command(&command);
+    if(write && !image->writable){
+        dprintf(fd, "%s: image is read-only\n", command.image);
+        return;
+    }
+    if(write){
+        pthread_rwlock_wrlock(&image->lock);
+    }else{
+        pthread_rwlock_rdlock(&image->lock);
+    }
+    if(image->disk == NULL){
+        dprintf(fd, "%s: cannot open image\n", command.image);
+    }else{
+        run_request(image, &command, fd);
+        if(write) reopen_image(state, image);
+    }
+    pthread_rwlock_unlock(&image->lock);
+}
+
+static void* client_thread(void* arg){
+    serverClient* client = (serverClient*)arg;
+    serverState* state = client->state;
+    serve_request(state, client->fd);
+    close(client->fd);
+    free(client);
+
+    pthread_mutex_lock(&state->lock);
+    state->clients -= 1;
+    pthread_cond_signal(&state->changed);
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+int serve_images(commandLine* command){
+    serverState state;
+    memset(&state, 0, sizeof(serverState));
+    state.options = command;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.changed, NULL);
+    pthread_mutex_init(&state.parseLock, NULL);
+
+    // the image on the command line is opened up front, a bad one fails here
+    if(find_image(&state, command->image) == NULL){
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(command->servePath) >= sizeof(address.sun_path)){
+        fprintf(stderr, "%s: socket path too long\n", command->servePath);
+        return 1;
+    }
+    strcpy(address.sun_path, command->servePath);
+    // a socket left behind by an earlier server is replaced, anything else is not
+    struct stat sb;
+    if(lstat(command->servePath, &sb) == 0 && S_ISSOCK(sb.st_mode)){
+        unlink(command->servePath);
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0){
+        perror(command->servePath);
+        if(listener >= 0) close(listener);
+        return 1;
+    }
+    // a client that hangs up early must not take the server or a recovery with it
+    signal(SIGPIPE, SIG_IGN);
+
+    while(1){
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            break;
+        }
+        pthread_mutex_lock(&state.lock);
+        while(state.clients >= SERVER_MAX_CLIENTS){
+            pthread_cond_wait(&state.changed, &state.lock);
+        }
+        state.clients += 1;
+        pthread_mutex_unlock(&state.lock);
+
+        serverClient* client = malloc(sizeof(serverClient));
+        client->state = &state;
+        client->fd = fd;
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, client_thread, client) == 0){
+            pthread_detach(thread);
+        }else{
+            client_thread(client);
+        }
+    }
+    close(listener);
+    unlink(command->servePath);
+    return 1;
+}
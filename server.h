@@ -0,0 +1,13 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "nyufile.h"
+
+#define SERVER_MAX_IMAGES 16        // images kept open at once
+#define SERVER_MAX_CLIENTS 64       // requests in flight, further connections wait in the backlog
+#define SERVER_MAX_LINE 4096
+#define SERVER_MAX_ARGS 32
+
+int serve_images(commandLine* command);
+
+#endif
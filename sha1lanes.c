@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "sha1lanes.h"
+
+// multi-buffer SHA-1 for the -R leaves
+//
+// the children of a node one level above the leaves all continue the same
+// prefix state with a final cluster of the same length, so their messages
+// have identical block counts and identical padding. each lane of a vector
+// register carries one message: the compression rounds run once for 4, 8 or
+// 16 messages. blocks that lie inside a tail are read in place, only the
+// blocks mixing in buffered prefix bytes or padding are assembled per lane.
+// the widest kernel the CPU supports is picked once, on first use, under
+// pthread_once. OpenSSL hashes a single buffer with SHA-NI about as fast as
+// eight AVX2 lanes, so on CPUs with SHA-NI only the 16-lane kernel is used and
+// every other case goes lane by lane through OpenSSL.
+
+typedef void (*lanes_kernel)(uint32_t state[5][SHA1_MAX_LANES], const unsigned char* const* blocks);
+
+static inline uint32_t load_be32(const unsigned char* p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap32(v);
+}
+
+#define SHA1_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// one 64-byte block per lane, state is lane-major: state[word][lane]
+#define SHA1_LANES_KERNEL(NAME, TARGET, WIDTH)                                                  \
+typedef uint32_t NAME##_vec __attribute__((vector_size((WIDTH) * 4)));                          \
+__attribute__((target(TARGET)))                                                                 \
+static void NAME(uint32_t state[5][SHA1_MAX_LANES], const unsigned char* const* blocks){       \
+    NAME##_vec w[16], h[5], a, b, c, d, e, t;                                                   \
+    for(int i = 0; i < 16; i++){                                                                \
+        for(int l = 0; l < (WIDTH); l++) w[i][l] = load_be32(blocks[l] + 4*i);                  \
+    }                                                                                           \
+    for(int k = 0; k < 5; k++) memcpy(&h[k], state[k], sizeof(h[k]));                          \
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];                                           \
+    for(int r = 0; r < 80; r++){                                                                \
+        if(r >= 16){                                                                            \
+            w[r&15] = SHA1_ROL(w[(r-3)&15] ^ w[(r-8)&15] ^ w[(r-14)&15] ^ w[r&15], 1);          \
+        }                                                                                       \
+        if(r < 20) t = (d ^ (b & (c ^ d))) + 0x5A827999u;                                       \
+        else if(r < 40) t = (b ^ c ^ d) + 0x6ED9EBA1u;                                          \
+        else if(r < 60) t = ((b & c) | (d & (b | c))) + 0x8F1BBCDCu;                            \
+        else t = (b ^ c ^ d) + 0xCA62C1D6u;                                                     \
+        t += SHA1_ROL(a, 5) + e + w[r&15];                                                      \
+        e = d; d = c; c = SHA1_ROL(b, 30); b = a; a = t;                                        \
+    }                                                                                           \
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;                                      \
+    for(int k = 0; k < 5; k++) memcpy(state[k], &h[k], sizeof(h[k]));                          \
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+SHA1_LANES_KERNEL(compress_sse2, "sse2", 4)
+SHA1_LANES_KERNEL(compress_avx2, "avx2", 8)
+SHA1_LANES_KERNEL(compress_avx512, "avx512f", 16)
+#endif
+
+static lanes_kernel selectedKernel = NULL;
+static int selectedWidth = 0;
+static const char* selectedKernelName = NULL;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+#if defined(__x86_64__) || defined(__i386__)
+static int has_sha_extensions(void){
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return 0;
+    return (ebx >> 29) & 1;
+}
+#endif
+
+static void choose_kernel(void){
+    // the width is stored last: a lane count is only ever read next to its kernel
+    lanes_kernel kernel = NULL;
+    int width = 1;
+    const char* name = "openssl";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        kernel = compress_avx512;
+        width = 16;
+        name = "avx512";
+    }else if(has_sha_extensions()){
+        name = "openssl-sha-ni";
+    }else if(__builtin_cpu_supports("avx2")){
+        kernel = compress_avx2;
+        width = 8;
+        name = "avx2";
+    }else if(__builtin_cpu_supports("sse2")){
+        kernel = compress_sse2;
+        width = 4;
+        name = "sse2";
+    }
+#endif
+    selectedKernel = kernel;
+    selectedKernelName = name;
+    selectedWidth = width;
+}
+
+static void select_kernel(void){
+    // search workers may all get here first at once
+    pthread_once(&kernelOnce, choose_kernel);
+}
+
+int sha1_lane_width(void){
+    select_kernel();
+    return selectedWidth;
+}
+
+const char* sha1_lanes_kernel(void){
+    select_kernel();
+    return selectedKernelName;
+}
+
+static void finish_group(const SHA_CTX* prefix, const unsigned char* const* tails, size_t length, int lanes,
+                         unsigned char (*digests)[SHA_DIGEST_LENGTH]){
+    uint32_t state[5][SHA1_MAX_LANES];
+    const unsigned char* blocks[SHA1_MAX_LANES];
+    unsigned char scratch[SHA1_MAX_LANES][64];
+    const uint32_t start[5] = { prefix->h0, prefix->h1, prefix->h2, prefix->h3, prefix->h4 };
+    for(int k = 0; k < 5; k++){
+        for(int l = 0; l < selectedWidth; l++) state[k][l] = start[k];
+    }
+
+    // the prefix may hold a partial block, the tails follow it
+    const unsigned char* buffered = (const unsigned char*)prefix->data;
+    size_t bufferedLength = prefix->num;
+    size_t total = bufferedLength + length;
+    uint64_t bitLength = (((uint64_t)prefix->Nh << 32) | prefix->Nl) + (uint64_t)length * 8;
+    size_t blockCount = (total + 8) / 64 + 1;
+
+    for(size_t block = 0; block < blockCount; block++){
+        size_t first = block * 64;
+        for(int l = 0; l < selectedWidth; l++){
+            // spare lanes repeat lane 0, their digests are dropped
+            const unsigned char* tail = tails[l < lanes ? l : 0];
+            if(first >= bufferedLength && first + 64 <= total){
+                blocks[l] = tail + (first - bufferedLength);
+                continue;
+            }
+            unsigned char* out = scratch[l];
+            memset(out, 0, 64);
+            if(first < bufferedLength){
+                memcpy(out, buffered + first, bufferedLength - first < 64 ? bufferedLength - first : 64);
+            }
+            size_t from = first > bufferedLength ? first : bufferedLength;
+            size_t to = first + 64 < total ? first + 64 : total;
+            if(from < to) memcpy(out + (from - first), tail + (from - bufferedLength), to - from);
+            if(total >= first && total < first + 64) out[total - first] = 0x80;
+            if(block == blockCount - 1){
+                for(int i = 0; i < 8; i++) out[56 + i] = (unsigned char)(bitLength >> (56 - 8*i));
+            }
+            blocks[l] = out;
+        }
+        selectedKernel(state, blocks);
+    }
+
+    for(int l = 0; l < lanes; l++){
+        for(int k = 0; k < 5; k++){
+            digests[l][4*k] = (unsigned char)(state[k][l] >> 24);
+            digests[l][4*k+1] = (unsigned char)(state[k][l] >> 16);
+            digests[l][4*k+2] = (unsigned char)(state[k][l] >> 8);
+            digests[l][4*k+3] = (unsigned char)state[k][l];
+        }
+    }
+}
+
+void sha1_finish_lanes(const SHA_CTX* prefix, const unsigned char* const* tails, size_t length, int lanes,
+                       unsigned char (*digests)[SHA_DIGEST_LENGTH]){
+    select_kernel();
+    for(int first = 0; first < lanes; first += selectedWidth){
+        int group = lanes - first < selectedWidth ? lanes - first : selectedWidth;
+        if(selectedKernel != NULL && group * 4 > selectedWidth){
+            finish_group(prefix, tails + first, length, group, digests + first);
+            continue;
+        }
+        // a mostly empty group costs as much as a full one, hash it one lane at a time
+        for(int l = first; l < first + group; l++){
+            SHA_CTX last = *prefix;
+            SHA1_Update(&last, tails[l], length);
+            SHA1_Final(digests[l], &last);
+        }
+    }
+}
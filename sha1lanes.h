@@ -0,0 +1,17 @@
+#ifndef SHA1LANES_H
+#define SHA1LANES_H
+
+#include <stddef.h>
+
+#include "nyufile.h"
+
+#define SHA1_MAX_LANES 16
+
+// finishes `lanes` messages that continue the same prefix state with tails of
+// the same length, lane-parallel when the CPU allows
+void sha1_finish_lanes(const SHA_CTX* prefix, const unsigned char* const* tails, size_t length, int lanes,
+                       unsigned char (*digests)[SHA_DIGEST_LENGTH]);
+int sha1_lane_width(void);
+const char* sha1_lanes_kernel(void);
+
+#endif
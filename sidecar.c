@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nyufile.h"
+#include "diskio.h"
+#include "fatscan.h"
+#include "dirtree.h"
+#include "sidecar.h"
+#include "stats.h"
+
+// persistent sidecar index (--index)
+//
+// triage scripts run the tool many times against the same image, and every
+// run used to rebuild the free-cluster bitmap and walk the directories again.
+// the index keeps the result of that work next to the image: the geometry,
+// the free bitmap, every live and deleted entry of every directory sorted by
+// (directory, name bytes 1..10), and the root directory as -l prints it. it
+// is keyed by the image size, its mtime and a checksum of the first FAT, so
+// any write to the volume makes it stale and the next run rebuilds it. the
+// file is mapped read-only and used in place.
+
+typedef struct entryList{
+    sidecarEntry* records;
+    int count;
+    int capacity;
+} entryList;
+
+typedef struct buildContext{
+    entryList* lists;       // one per worker, merged at the end
+} buildContext;
+
+
+static uint64_t fat_checksum(diskImage* disk){
+    // four independent FNV-1a style lanes over the entries of the first FAT
+    const unsigned int* fat = disk_fat(disk);
+    uint64_t lanes[4] = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL, 0x9ce484222325cbf2ULL, 0x2325cbf29ce48422ULL };
+    int count = disk->clusterCount;
+    int i = 0;
+    for(; i + 4 <= count; i += 4){
+        for(int l = 0; l < 4; l++) lanes[l] = (lanes[l] ^ fat[i+l]) * 0x100000001b3ULL;
+    }
+    for(; i < count; i++) lanes[0] = (lanes[0] ^ fat[i]) * 0x100000001b3ULL;
+    STAT_ADD(STAT_FAT_READS, count);
+    return lanes[0] ^ (lanes[1] << 1 | lanes[1] >> 63) ^ (lanes[2] << 2 | lanes[2] >> 62) ^ (lanes[3] << 3 | lanes[3] >> 61);
+}
+
+static int compare_entries(const void* one, const void* two){
+    const sidecarEntry* a = one;
+    const sidecarEntry* b = two;
+    if(a->dirCluster != b->dirCluster) return a->dirCluster < b->dirCluster ? -1 : 1;
+    int name = memcmp(a->name + 1, b->name + 1, 10);
+    if(name != 0) return name;
+    return a->ordinal - b->ordinal;
+}
+
+static void index_visit(void* arg, int worker, const char* dirPath, const entryPlace* place, struct DirEntry* entry){
+    (void)dirPath;
+    buildContext* ctx = (buildContext*)arg;
+    entryList* list = &ctx->lists[worker];
+    if(list->count == list->capacity){
+        list->capacity = list->capacity == 0 ? 256 : list->capacity * 2;
+        list->records = realloc(list->records, sizeof(sidecarEntry) * list->capacity);
+    }
+    sidecarEntry* record = &list->records[list->count++];
+    record->dirCluster = place->dirCluster;
+    record->cluster = place->cluster;
+    record->index = place->index;
+    record->ordinal = place->ordinal;
+    record->startCluster = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+    record->size = entry->DIR_FileSize;
+    memcpy(record->name, entry->DIR_Name, 11);
+    record->attr = entry->DIR_Attr;
+}
+
+static struct DirEntry* collect_root(diskImage* disk, int* count){
+    // the root entries -l prints, in the order it prints them
+    unsigned int* fat = disk_fat(disk);
+    int entriesPerCluster = disk->clusterSize / sizeof(struct DirEntry);
+    int capacity = entriesPerCluster;
+    struct DirEntry* root = malloc(sizeof(struct DirEntry) * capacity);
+    *count = 0;
+    int cluster = disk->boot.BPB_RootClus;
+    int hops = 0;
+    while(cluster >= 2 && cluster < FAT_BAD_CLUSTER && cluster < disk->clusterCount && hops++ < disk->clusterCount){
+        struct DirEntry* entries = (struct DirEntry*)get_cluster(disk, cluster);
+        if(entries == NULL) break;
+        STAT_ADD(STAT_DIR_CLUSTERS, 1);
+        for(int i = 0; i < entriesPerCluster && entries[i].DIR_Name[0] != 0x00; i++){
+            STAT_ADD(STAT_DIR_ENTRIES, 1);
+            if(entries[i].DIR_Name[0] == 0xE5) continue;
+            if(*count == capacity){
+                capacity *= 2;
+                root = realloc(root, sizeof(struct DirEntry) * capacity);
+            }
+            root[(*count)++] = entries[i];
+        }
+        put_cluster(disk, cluster);
+        STAT_ADD(STAT_FAT_READS, 1);
+        cluster = fat[cluster] & FAT_ENTRY_MASK;
+    }
+    return root;
+}
+
+static uint64_t align8(uint64_t offset){
+    return (offset + 7) & ~7ULL;
+}
+
+static void attach_sections(sidecarIndex* index){
+    index->header = (sidecarHeader*)index->base;
+    index->freeBits = (uint64_t*)(index->base + index->header->freeOffset);
+    index->entries = (sidecarEntry*)(index->base + index->header->entryOffset);
+    index->root = (struct DirEntry*)(index->base + index->header->rootOffset);
+}
+
+static void describe_image(diskImage* disk, const struct stat* image, uint64_t checksum, sidecarHeader* header){
+    memset(header, 0, sizeof(sidecarHeader));
+    memcpy(header->magic, SIDECAR_MAGIC, sizeof(header->magic));
+    header->version = SIDECAR_VERSION;
+    header->headerSize = sizeof(sidecarHeader);
+    header->imageSize = disk->size;
+    header->mtimeSec = image->st_mtim.tv_sec;
+    header->mtimeNsec = image->st_mtim.tv_nsec;
+    header->fatChecksum = checksum;
+    header->dataOffset = disk->dataOffset;
+    header->clusterSize = disk->clusterSize;
+    header->clusterCount = disk->clusterCount;
+    header->boot = disk->boot;
+}
+
+static int load_sidecar(sidecarIndex* index, const char* path, const sidecarHeader* expected){
+    // maps the index at path, returns 0 when it is missing, damaged or describes another image state
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return 0;
+    struct stat sb;
+    if(fstat(fd, &sb) < 0 || (uint64_t)sb.st_size < sizeof(sidecarHeader)){
+        close(fd);
+        return 0;
+    }
+    char* base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return 0;
+
+    const sidecarHeader* header = (const sidecarHeader*)base;
+    uint64_t freeBytes = (uint64_t)(expected->clusterCount + 63) / 64 * sizeof(uint64_t);
+    int fresh = memcmp(header->magic, expected->magic, sizeof(header->magic)) == 0
+                && header->version == expected->version && header->headerSize == expected->headerSize
+                && header->imageSize == expected->imageSize
+                && header->mtimeSec == expected->mtimeSec && header->mtimeNsec == expected->mtimeNsec
+                && header->fatChecksum == expected->fatChecksum && header->dataOffset == expected->dataOffset
+                && header->clusterSize == expected->clusterSize && header->clusterCount == expected->clusterCount
+                && memcmp(&header->boot, &expected->boot, sizeof(struct BootEntry)) == 0
+                && header->fileSize == (uint64_t)sb.st_size
+                && header->entryCount >= 0 && header->rootCount >= 0
+                && header->freeOffset >= sizeof(sidecarHeader) && header->freeOffset % 8 == 0
+                && header->entryOffset >= header->freeOffset + freeBytes && header->entryOffset % 8 == 0
+                && header->rootOffset >= header->entryOffset + (uint64_t)header->entryCount * sizeof(sidecarEntry)
+                && header->rootOffset % 8 == 0
+                && header->fileSize >= header->rootOffset + (uint64_t)header->rootCount * sizeof(struct DirEntry);
+    if(!fresh){
+        munmap(base, sb.st_size);
+        return 0;
+    }
+    index->base = base;
+    index->length = sb.st_size;
+    index->mapped = 1;
+    attach_sections(index);
+    return 1;
+}
+
+static void build_sidecar(sidecarIndex* index, diskImage* disk, const sidecarHeader* described, int workerCount){
+    fatScan* scan = scan_fat(disk, FAT_SCAN_FREE_BITS);
+
+    buildContext ctx;
+    ctx.lists = calloc(workerCount, sizeof(entryList));
+    walk_directory_tree(disk, workerCount, index_visit, &ctx);
+    int entryCount = 0;
+    for(int w = 0; w < workerCount; w++) entryCount += ctx.lists[w].count;
+    int rootCount = 0;
+    struct DirEntry* root = collect_root(disk, &rootCount);
+
+    uint64_t freeBytes = (uint64_t)(disk->clusterCount + 63) / 64 * sizeof(uint64_t);
+    sidecarHeader header = *described;
+    header.freeCount = scan->freeCount;
+    header.entryCount = entryCount;
+    header.rootCount = rootCount;
+    header.freeOffset = align8(sizeof(sidecarHeader));
+    header.entryOffset = align8(header.freeOffset + freeBytes);
+    header.rootOffset = align8(header.entryOffset + (uint64_t)entryCount * sizeof(sidecarEntry));
+    header.fileSize = header.rootOffset + (uint64_t)rootCount * sizeof(struct DirEntry);
+
+    index->length = header.fileSize;
+    index->base = calloc(1, index->length);
+    index->mapped = 0;
+    memcpy(index->base, &header, sizeof(sidecarHeader));
+    attach_sections(index);
+    memcpy(index->freeBits, scan->freeBits, freeBytes);
+    int counter = 0;
+    for(int w = 0; w < workerCount; w++){
+        memcpy(index->entries + counter, ctx.lists[w].records, sizeof(sidecarEntry) * ctx.lists[w].count);
+        counter += ctx.lists[w].count;
+        free(ctx.lists[w].records);
+    }
+    qsort(index->entries, entryCount, sizeof(sidecarEntry), compare_entries);
+    memcpy(index->root, root, sizeof(struct DirEntry) * rootCount);
+
+    free(root);
+    free(ctx.lists);
+    destroy_fat_scan(scan);
+}
+
+static void save_sidecar(sidecarIndex* index, const char* path){
+    // written aside and renamed over, a reader never sees half an index
+    char* temporary = malloc(strlen(path) + 5);
+    sprintf(temporary, "%s.tmp", path);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int saved = 0;
+    if(fd >= 0){
+        uint64_t written = 0;
+        while(written < index->length){
+            ssize_t result = write(fd, index->base + written, index->length - written);
+            if(result <= 0) break;
+            written += result;
+        }
+        saved = written == index->length;
+        if(close(fd) < 0) saved = 0;
+        saved = saved && rename(temporary, path) == 0;
+        if(!saved) unlink(temporary);
+    }
+    if(!saved){
+        // the index still serves this run from memory
+        perror(path);
+    }
+    free(temporary);
+}
+
+int open_sidecar(diskImage* disk, const char* path, int workerCount){
+    // attaches the index at path to disk, rebuilding and saving it when it is stale
+    struct stat image;
+    if(fstat(disk->fd, &image) < 0){
+        perror("fstat");
+        return 0;
+    }
+    sidecarHeader expected;
+    describe_image(disk, &image, fat_checksum(disk), &expected);
+
+    sidecarIndex* index = calloc(1, sizeof(sidecarIndex));
+    if(!load_sidecar(index, path, &expected)){
+        build_sidecar(index, disk, &expected, workerCount);
+        save_sidecar(index, path);
+    }
+    disk->index = index;
+    return 1;
+}
+
+void close_sidecar(diskImage* disk){
+    sidecarIndex* index = disk->index;
+    if(index == NULL) return;
+    if(index->mapped){
+        munmap(index->base, index->length);
+    }else{
+        free(index->base);
+    }
+    free(index);
+    disk->index = NULL;
+}
+
+int sidecar_match_range(sidecarIndex* index, int dirCluster, const nameKey* key, const sidecarEntry** first){
+    // entries of the directory at dirCluster whose name bytes 1..10 equal the key's, in directory order
+    sidecarEntry probe;
+    probe.dirCluster = dirCluster;
+    memcpy(probe.name, key->name, 11);
+    probe.ordinal = -1;
+    int low = 0;
+    int high = index->header->entryCount;
+    while(low < high){
+        int middle = low + (high - low) / 2;
+        if(compare_entries(&index->entries[middle], &probe) < 0){
+            low = middle + 1;
+        }else{
+            high = middle;
+        }
+    }
+    int end = low;
+    while(end < index->header->entryCount && index->entries[end].dirCluster == dirCluster
+          && memcmp(index->entries[end].name + 1, key->name + 1, 10) == 0){
+        end++;
+    }
+    *first = index->entries + low;
+    return end - low;
+}
+
+int sidecar_find_directory(sidecarIndex* index, int dirCluster, const nameKey* key, int* cluster){
+    // the first live subdirectory named key in the directory at dirCluster
+    const sidecarEntry* first;
+    int count = sidecar_match_range(index, dirCluster, key, &first);
+    for(int e = 0; e < count; e++){
+        const sidecarEntry* entry = &first[e];
+        if(entry->name[0] == 0xE5 || entry->name[0] == '.' || !(entry->attr & 0x10)) continue;
+        if(entry->startCluster < 2 || entry->name[0] != key->name[0]) continue;
+        *cluster = entry->startCluster;
+        return 1;
+    }
+    return 0;
+}
+
+int sidecar_deleted_clusters(sidecarIndex* index, int dirCluster, const nameKey* key, int** clusters){
+    // the clusters of the directory at dirCluster holding deleted entries that match key, in chain order
+    const sidecarEntry* first;
+    int count = sidecar_match_range(index, dirCluster, key, &first);
+    *clusters = malloc(sizeof(int) * (count + 1));
+    int found = 0;
+    for(int e = 0; e < count; e++){
+        if(first[e].name[0] != 0xE5) continue;
+        if(found > 0 && (*clusters)[found-1] == first[e].cluster) continue;
+        (*clusters)[found++] = first[e].cluster;
+    }
+    return found;
+}
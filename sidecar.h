@@ -0,0 +1,68 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdint.h>
+
+#include "fsinfo.h"
+#include "diskio.h"
+#include "dirscan.h"
+
+#define SIDECAR_MAGIC "NYUIDX01"
+#define SIDECAR_VERSION 1
+#define SIDECAR_SUFFIX ".idx"       // default index path is the image path plus this
+
+// one directory entry, live or deleted, of any directory on the volume
+typedef struct sidecarEntry{
+    int32_t dirCluster;             // first cluster of the directory holding it
+    int32_t cluster;                // directory cluster holding it
+    int32_t index;                  // slot within that cluster
+    int32_t ordinal;                // slot within the whole directory
+    int32_t startCluster;
+    uint32_t size;
+    unsigned char name[11];         // DIR_Name as stored, 0xE5 first for deleted entries
+    unsigned char attr;
+} sidecarEntry;
+
+typedef struct sidecarHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+
+    // the image the index describes, all must match for it to be used
+    uint64_t imageSize;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t fatChecksum;
+    uint64_t dataOffset;
+    int32_t clusterSize;
+    int32_t clusterCount;
+
+    int32_t freeCount;
+    int32_t entryCount;
+    int32_t rootCount;
+    int32_t reserved;
+    uint64_t freeOffset;            // free-cluster bitmap, one bit per cluster
+    uint64_t entryOffset;           // sidecarEntry records by (dirCluster, name bytes 1..10, ordinal)
+    uint64_t rootOffset;            // raw root directory entries in -l order
+    uint64_t fileSize;
+
+    struct BootEntry boot;
+} sidecarHeader;
+
+typedef struct sidecarIndex{
+    sidecarHeader* header;
+    uint64_t* freeBits;
+    sidecarEntry* entries;
+    struct DirEntry* root;
+    char* base;                     // whole index, mapped from the file or built in memory
+    uint64_t length;
+    int mapped;
+} sidecarIndex;
+
+int open_sidecar(diskImage* disk, const char* path, int workerCount);
+void close_sidecar(diskImage* disk);
+int sidecar_match_range(sidecarIndex* index, int dirCluster, const nameKey* key, const sidecarEntry** first);
+int sidecar_find_directory(sidecarIndex* index, int dirCluster, const nameKey* key, int* cluster);
+int sidecar_deleted_clusters(sidecarIndex* index, int dirCluster, const nameKey* key, int** clusters);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+static const char* counterNames[STAT_COUNTERS] = {
+    "dir_clusters", "dir_entries", "name_matches", "search_nodes", "backtracks", "sha_calls",
+    "sha_bytes", "fat_reads", "fat_writes", "cluster_reads", "cache_misses", "window_maps", "pruned",
+    "hole_reads"
+};
+
+static const char* phaseNames[STAT_PHASES] = {
+    "map", "fat_scan", "dir_walk", "search", "commit"
+};
+
+#ifdef NYUFILE_STATS
+
+#define PHASE_STACK 16
+
+_Thread_local uint64_t threadCounters[STAT_COUNTERS];
+
+static uint64_t totalCounters[STAT_COUNTERS];
+static pthread_mutex_t totalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t phaseTotals[STAT_PHASES];
+static int phaseStack[PHASE_STACK];
+static int phaseDepth = 0;
+static uint64_t phaseStart = 0;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void stats_phase_begin(int phase){
+    uint64_t now = now_ns();
+    if(phaseDepth > 0){
+        phaseTotals[phaseStack[phaseDepth-1]] += now - phaseStart;
+    }
+    if(phaseDepth < PHASE_STACK){
+        phaseStack[phaseDepth++] = phase;
+    }
+    phaseStart = now;
+}
+
+void stats_phase_end(int phase){
+    uint64_t now = now_ns();
+    if(phaseDepth == 0 || phaseStack[phaseDepth-1] != phase) return;
+    phaseTotals[phase] += now - phaseStart;
+    phaseDepth -= 1;
+    phaseStart = now;
+}
+
+void stats_merge_thread(void){
+    pthread_mutex_lock(&totalLock);
+    for(int c = 0; c < STAT_COUNTERS; c++){
+        totalCounters[c] += threadCounters[c];
+        threadCounters[c] = 0;
+    }
+    pthread_mutex_unlock(&totalLock);
+}
+
+void stats_reset(void){
+    // starts over in a child forked by --serve; it runs alone, so the lock is
+    // recreated rather than taken, some other thread may have held it at the fork
+    pthread_mutex_init(&totalLock, NULL);
+    for(int c = 0; c < STAT_COUNTERS; c++){
+        threadCounters[c] = 0;
+        totalCounters[c] = 0;
+    }
+    for(int p = 0; p < STAT_PHASES; p++) phaseTotals[p] = 0;
+    phaseDepth = 0;
+}
+
+void stats_report(int format){
+    stats_merge_thread();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    if(format == STATS_JSON){
+        fprintf(stderr, "{\"counters\":{");
+        for(int c = 0; c < STAT_COUNTERS; c++){
+            fprintf(stderr, "%s\"%s\":%llu", c == 0 ? "" : ",", counterNames[c], (unsigned long long)totalCounters[c]);
+        }
+        fprintf(stderr, "},\"phases_ns\":{");
+        for(int p = 0; p < STAT_PHASES; p++){
+            fprintf(stderr, "%s\"%s\":%llu", p == 0 ? "" : ",", phaseNames[p], (unsigned long long)phaseTotals[p]);
+        }
+        fprintf(stderr, "},\"minor_faults\":%ld,\"major_faults\":%ld,\"max_rss_kb\":%ld}\n",
+                usage.ru_minflt, usage.ru_majflt, usage.ru_maxrss);
+        return;
+    }
+    for(int c = 0; c < STAT_COUNTERS; c++){
+        fprintf(stderr, "%-16s %llu\n", counterNames[c], (unsigned long long)totalCounters[c]);
+    }
+    for(int p = 0; p < STAT_PHASES; p++){
+        fprintf(stderr, "%-16s %.6f s\n", phaseNames[p], phaseTotals[p] / 1e9);
+    }
+    fprintf(stderr, "%-16s %ld\n", "minor_faults", usage.ru_minflt);
+    fprintf(stderr, "%-16s %ld\n", "major_faults", usage.ru_majflt);
+    fprintf(stderr, "%-16s %ld\n", "max_rss_kb", usage.ru_maxrss);
+}
+
+#else
+
+void stats_phase_begin(int phase){
+    (void)phase;
+}
+
+void stats_phase_end(int phase){
+    (void)phase;
+}
+
+void stats_merge_thread(void){
+}
+
+void stats_reset(void){
+}
+
+void stats_report(int format){
+    (void)format;
+    (void)counterNames;
+    (void)phaseNames;
+    fprintf(stderr, "stats: not built in, rebuild with make STATS=1\n");
+}
+
+#endif
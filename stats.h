@@ -0,0 +1,63 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// hot-path counters and phase timers for --stats
+//
+// built in when NYUFILE_STATS is defined (make STATS=1, the default). counters
+// are per thread and merged when a worker finishes, so a STAT_ADD is a single
+// thread-local add. without the switch every macro below compiles to nothing.
+
+#define STAT_DIR_CLUSTERS 0         // directory clusters scanned
+#define STAT_DIR_ENTRIES 1          // directory entries scanned
+#define STAT_NAME_MATCHES 2         // deleted entries matching the requested name
+#define STAT_SEARCH_NODES 3         // block_match_helper nodes visited
+#define STAT_BACKTRACKS 4
+#define STAT_SHA_CALLS 5            // SHA1_Update calls
+#define STAT_SHA_BYTES 6            // bytes passed to SHA-1
+#define STAT_FAT_READS 7            // FAT entries read
+#define STAT_FAT_WRITES 8           // FAT entries written
+#define STAT_CLUSTER_READS 9        // get_cluster calls
+#define STAT_CACHE_MISSES 10        // pread cache misses
+#define STAT_WINDOW_MAPS 11         // mmap windows mapped or faulted back after a trim
+#define STAT_PRUNED 12              // search nodes rejected by a format validator or the slack check
+#define STAT_HOLE_READS 13          // get_cluster calls answered with zeros for a hole
+#define STAT_COUNTERS 14
+
+#define PHASE_MAP 0                 // opening the image and loading the FAT
+#define PHASE_FAT_SCAN 1
+#define PHASE_DIR_WALK 2
+#define PHASE_SEARCH 3              // hashing candidates, contiguous and not
+#define PHASE_COMMIT 4              // directory and FAT updates, write back
+#define STAT_PHASES 5
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+#ifdef NYUFILE_STATS
+
+extern _Thread_local uint64_t threadCounters[STAT_COUNTERS];
+
+#define STAT_ADD(counter, n) (threadCounters[(counter)] += (uint64_t)(n))
+#define STAT_PHASE_BEGIN(phase) stats_phase_begin(phase)
+#define STAT_PHASE_END(phase) stats_phase_end(phase)
+#define STAT_THREAD_DONE() stats_merge_thread()
+
+#else
+
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_PHASE_BEGIN(phase) ((void)0)
+#define STAT_PHASE_END(phase) ((void)0)
+#define STAT_THREAD_DONE() ((void)0)
+
+#endif
+
+// phases are timed on the main thread only; a nested phase pauses the outer one
+void stats_phase_begin(int phase);
+void stats_phase_end(int phase);
+void stats_merge_thread(void);
+void stats_report(int format);
+void stats_reset(void);
+
+#endif
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "validate.h"
+#include "kernels.h"
+
+// format validators for the -R search
+//
+// the first cluster of a chain is always the entry's start cluster, so its
+// magic number picks at most one validator for the whole search. the
+// validator then parses the chain as it grows, one cluster per depth, and
+// rejects it as soon as the bytes stop forming a well-formed file. a
+// validator must accept every well-formed file, so anything it cannot follow
+// (sizes in a trailing descriptor, data after the end marker) is accepted
+// as is and left to the SHA-1.
+
+
+// JPEG: marker segments are skipped by their length, entropy-coded data may
+// only hold 0xFF followed by stuffing, a restart marker or the next marker
+
+#define JPEG_MARKER 0               // expecting 0xFF
+#define JPEG_CODE 1                 // expecting a marker code
+#define JPEG_LENGTH_HIGH 2
+#define JPEG_LENGTH_LOW 3
+#define JPEG_SKIP 4                 // inside a segment payload
+#define JPEG_ENTROPY 5
+#define JPEG_ENTROPY_FF 6
+#define JPEG_DONE 7
+
+typedef struct jpegState{
+    int mode;
+    int seenStart;                  // SOI has been read
+    int scan;                       // the segment being read is SOS, entropy data follows it
+    uint32_t remaining;
+    uint32_t lengthHigh;
+} jpegState;
+
+static int jpeg_matches(const unsigned char* first, int length){
+    return length >= 3 && first[0] == 0xFF && first[1] == 0xD8 && first[2] == 0xFF;
+}
+
+static void jpeg_start(validatorState* state){
+    jpegState* jpeg = (jpegState*)state->bytes;
+    memset(jpeg, 0, sizeof(jpegState));
+    jpeg->mode = JPEG_MARKER;
+}
+
+static int jpeg_code(jpegState* jpeg, unsigned char code){
+    // a marker code, returns 0 when it cannot appear here
+    if(!jpeg->seenStart){
+        if(code != 0xD8) return 0;
+        jpeg->seenStart = 1;
+        jpeg->mode = JPEG_MARKER;
+    }else if(code == 0x00 || code == 0xD8 || (code >= 0x02 && code <= 0xBF)
+             || (code >= 0xF0 && code <= 0xFD && code != 0xF7 && code != 0xF8)){
+        // reserved codes never appear, F7 and F8 are the JPEG-LS markers
+        return 0;
+    }else if(code == 0xD9){
+        jpeg->mode = JPEG_DONE;
+    }else if((code >= 0xD0 && code <= 0xD7) || code == 0x01){
+        // standalone markers carry no length
+        jpeg->mode = jpeg->scan ? JPEG_ENTROPY : JPEG_MARKER;
+    }else{
+        jpeg->scan = code == 0xDA;
+        jpeg->mode = JPEG_LENGTH_HIGH;
+    }
+    return 1;
+}
+
+static int jpeg_feed(validatorState* state, const unsigned char* data, int length){
+    jpegState* jpeg = (jpegState*)state->bytes;
+    int i = 0;
+    while(i < length){
+        unsigned char byte = data[i];
+        switch(jpeg->mode){
+            case JPEG_MARKER:
+                if(byte != 0xFF) return 0;
+                jpeg->mode = JPEG_CODE;
+                i++;
+                break;
+            case JPEG_CODE:
+                i++;
+                if(byte == 0xFF) break;         // fill byte
+                if(!jpeg_code(jpeg, byte)) return 0;
+                break;
+            case JPEG_LENGTH_HIGH:
+                jpeg->lengthHigh = byte;
+                jpeg->mode = JPEG_LENGTH_LOW;
+                i++;
+                break;
+            case JPEG_LENGTH_LOW:
+                jpeg->remaining = jpeg->lengthHigh << 8 | byte;
+                if(jpeg->remaining < 2) return 0;
+                jpeg->remaining -= 2;
+                jpeg->mode = jpeg->remaining > 0 ? JPEG_SKIP : (jpeg->scan ? JPEG_ENTROPY : JPEG_MARKER);
+                i++;
+                break;
+            case JPEG_SKIP: {
+                uint32_t take = (uint32_t)(length - i) < jpeg->remaining ? (uint32_t)(length - i) : jpeg->remaining;
+                i += (int)take;
+                jpeg->remaining -= take;
+                if(jpeg->remaining == 0) jpeg->mode = jpeg->scan ? JPEG_ENTROPY : JPEG_MARKER;
+                break;
+            }
+            case JPEG_ENTROPY: {
+                const unsigned char* marker = memchr(data + i, 0xFF, length - i);
+                if(marker == NULL) return 1;
+                i = (int)(marker - data) + 1;
+                jpeg->mode = JPEG_ENTROPY_FF;
+                break;
+            }
+            case JPEG_ENTROPY_FF:
+                i++;
+                if(byte == 0x00 || (byte >= 0xD0 && byte <= 0xD7)){
+                    jpeg->mode = JPEG_ENTROPY;
+                }else if(byte != 0xFF){
+                    // the scan ended, a new marker segment starts
+                    jpeg->scan = 0;
+                    if(!jpeg_code(jpeg, byte)) return 0;
+                }
+                break;
+            default:
+                // anything after EOI is trailing data
+                return 1;
+        }
+    }
+    return 1;
+}
+
+
+// PNG: every chunk has a plausible length, a letters-only type and a CRC
+// over type and data that must match
+
+#define PNG_SIGNATURE 0
+#define PNG_LENGTH 1
+#define PNG_TYPE 2
+#define PNG_DATA 3
+#define PNG_CRC 4
+#define PNG_DONE 5
+
+typedef struct pngState{
+    int mode;
+    int gathered;                   // bytes of the current field read so far
+    uint32_t field;
+    uint32_t remaining;
+    uint32_t crc;
+    int lastChunk;                  // the chunk being read is IEND
+} pngState;
+
+static uint32_t crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void build_crc_table(void){
+    for(uint32_t n = 0; n < 256; n++){
+        uint32_t c = n;
+        for(int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crcTable[n] = c;
+    }
+}
+
+static uint32_t crc_update(uint32_t crc, const unsigned char* data, int length){
+    for(int i = 0; i < length; i++) crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static int png_matches(const unsigned char* first, int length){
+    return length >= 8 && memcmp(first, "\x89PNG\r\n\x1A\n", 8) == 0;
+}
+
+static void png_start(validatorState* state){
+    pthread_once(&crcOnce, build_crc_table);
+    pngState* png = (pngState*)state->bytes;
+    memset(png, 0, sizeof(pngState));
+    png->mode = PNG_SIGNATURE;
+}
+
+static int png_feed(validatorState* state, const unsigned char* data, int length){
+    pngState* png = (pngState*)state->bytes;
+    int i = 0;
+    while(i < length){
+        if(png->mode == PNG_DONE) return 1;
+        if(png->mode == PNG_DATA){
+            uint32_t take = (uint32_t)(length - i) < png->remaining ? (uint32_t)(length - i) : png->remaining;
+            png->crc = crc_update(png->crc, data + i, (int)take);
+            i += (int)take;
+            png->remaining -= take;
+            if(png->remaining == 0) png->mode = PNG_CRC;
+            continue;
+        }
+        unsigned char byte = data[i++];
+        if(png->mode == PNG_TYPE){
+            if(!((byte >= 'A' && byte <= 'Z') || (byte >= 'a' && byte <= 'z'))) return 0;
+            png->crc = crc_update(png->crc, &byte, 1);
+        }
+        png->field = png->field << 8 | byte;
+        png->gathered += 1;
+        int needed = png->mode == PNG_SIGNATURE ? 8 : 4;
+        if(png->gathered < needed) continue;
+
+        // a whole field has been read
+        png->gathered = 0;
+        if(png->mode == PNG_SIGNATURE){
+            png->mode = PNG_LENGTH;
+        }else if(png->mode == PNG_LENGTH){
+            if(png->field > 0x7FFFFFFFu) return 0;
+            png->remaining = png->field;
+            png->crc = 0xFFFFFFFFu;
+            png->mode = PNG_TYPE;
+        }else if(png->mode == PNG_TYPE){
+            png->lastChunk = png->field == 0x49454E44u;     // "IEND"
+            png->mode = png->remaining > 0 ? PNG_DATA : PNG_CRC;
+        }else{
+            if(png->field != (png->crc ^ 0xFFFFFFFFu)) return 0;
+            png->mode = png->lastChunk ? PNG_DONE : PNG_LENGTH;
+        }
+        png->field = 0;
+    }
+    return 1;
+}
+
+
+// ZIP: local file headers follow each other at the offsets their sizes give,
+// up to the central directory; a header with a trailing data descriptor ends
+// the walk since its sizes are not known up front
+
+#define ZIP_HEADER 0
+#define ZIP_SKIP 1
+#define ZIP_DONE 2
+#define ZIP_HEADER_SIZE 30
+
+typedef struct zipState{
+    int mode;
+    int gathered;
+    unsigned char header[ZIP_HEADER_SIZE];
+    uint64_t remaining;
+} zipState;
+
+static int zip_matches(const unsigned char* first, int length){
+    return length >= 4 && memcmp(first, "PK\x03\x04", 4) == 0;
+}
+
+static void zip_start(validatorState* state){
+    zipState* zip = (zipState*)state->bytes;
+    memset(zip, 0, sizeof(zipState));
+    zip->mode = ZIP_HEADER;
+}
+
+static int zip_record(zipState* zip){
+    // the first four bytes at a record offset; 0 when no record starts there
+    unsigned char* h = zip->header;
+    if(h[0] != 'P' || h[1] != 'K') return 0;
+    if(h[2] == 3 && h[3] == 4) return 1;
+    if((h[2] == 1 && h[3] == 2) || (h[2] == 5 && h[3] == 6) || (h[2] == 6 && h[3] == 6)
+       || (h[2] == 6 && h[3] == 7) || (h[2] == 6 && h[3] == 8) || (h[2] == 7 && h[3] == 8)){
+        // central directory and friends: the local entries are over
+        zip->mode = ZIP_DONE;
+        return 1;
+    }
+    return 0;
+}
+
+static int zip_feed(validatorState* state, const unsigned char* data, int length){
+    zipState* zip = (zipState*)state->bytes;
+    int i = 0;
+    while(i < length){
+        if(zip->mode == ZIP_DONE) return 1;
+        if(zip->mode == ZIP_SKIP){
+            uint64_t take = (uint64_t)(length - i) < zip->remaining ? (uint64_t)(length - i) : zip->remaining;
+            i += (int)take;
+            zip->remaining -= take;
+            if(zip->remaining == 0){
+                zip->mode = ZIP_HEADER;
+                zip->gathered = 0;
+            }
+            continue;
+        }
+        zip->header[zip->gathered++] = data[i++];
+        if(zip->gathered == 4 && !zip_record(zip)) return 0;
+        if(zip->mode == ZIP_DONE || zip->gathered < ZIP_HEADER_SIZE) continue;
+
+        unsigned char* h = zip->header;
+        int flags = h[6] | h[7] << 8;
+        uint32_t compressedSize = (uint32_t)h[18] | (uint32_t)h[19] << 8 | (uint32_t)h[20] << 16 | (uint32_t)h[21] << 24;
+        int nameLength = h[26] | h[27] << 8;
+        int extraLength = h[28] | h[29] << 8;
+        if((flags & 0x8) || compressedSize == 0xFFFFFFFFu){
+            // sizes live in a data descriptor or a zip64 extra field
+            zip->mode = ZIP_DONE;
+            continue;
+        }
+        zip->remaining = (uint64_t)nameLength + extraLength + compressedSize;
+        zip->mode = zip->remaining > 0 ? ZIP_SKIP : ZIP_HEADER;
+        zip->gathered = 0;
+    }
+    return 1;
+}
+
+
+_Static_assert(sizeof(jpegState) <= VALIDATOR_STATE_SIZE, "jpegState outgrew validatorState");
+_Static_assert(sizeof(pngState) <= VALIDATOR_STATE_SIZE, "pngState outgrew validatorState");
+_Static_assert(sizeof(zipState) <= VALIDATOR_STATE_SIZE, "zipState outgrew validatorState");
+
+static const chainValidator validators[] = {
+    { "jpeg", jpeg_matches, jpeg_start, jpeg_feed },
+    { "png", png_matches, png_start, png_feed },
+    { "zip", zip_matches, zip_start, zip_feed },
+};
+
+const chainValidator* select_validator(const unsigned char* first, int length){
+    for(size_t v = 0; v < sizeof(validators) / sizeof(validators[0]); v++){
+        if(validators[v].matches(first, length)) return &validators[v];
+    }
+    return NULL;
+}
+
+int slack_is_clean(const unsigned char* data, int used, int clusterSize){
+    for(int i = used; i < clusterSize; i++){
+        if(data[i] != 0) return 0;
+    }
+    return 1;
+}
+
+KERNEL_BODY int slack_body(const unsigned char* data, int used, int clusterSize){
+    // bytes up to the next 8-byte boundary of the cluster, then whole words
+    // OR-ed together; clusterSize is a constant in every instance below
+    int i = used;
+    for(; i < clusterSize && (i & 7) != 0; i++){
+        if(data[i] != 0) return 0;
+    }
+    uint64_t bits = 0;
+    for(; i < clusterSize; i += 8){
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        bits |= word;
+    }
+    return bits == 0;
+}
+
+#define SLACK_KERNEL(SIZE) \
+    static int slack_##SIZE(const unsigned char* data, int used, int clusterSize){ \
+        (void)clusterSize; \
+        return slack_body(data, used, SIZE); \
+    }
+FOR_EACH_CLUSTER_SIZE(SLACK_KERNEL)
+
+#define SLACK_ENTRY(SIZE) slack_##SIZE,
+static const slack_kernel slackKernels[CLUSTER_KERNELS] = { FOR_EACH_CLUSTER_SIZE(SLACK_ENTRY) };
+
+slack_kernel select_slack_kernel(int kernel){
+    // the copy for the image's cluster size, the generic loop for anything out of spec
+    if(kernel < 0 || kernel >= CLUSTER_KERNELS) return slack_is_clean;
+    return slackKernels[kernel];
+}
+
+int parse_validate_flags(const char* text, int* flags){
+    // "none" or a comma list of format and slack; returns 0 on anything else
+    char* copy = strdup(text);
+    char* save = NULL;
+    int parsed = 0;
+    int ok = 1;
+    for(char* part = strtok_r(copy, ",", &save); part != NULL; part = strtok_r(NULL, ",", &save)){
+        if(strcmp(part, "format") == 0){
+            parsed |= VALIDATE_FORMAT;
+        }else if(strcmp(part, "slack") == 0){
+            parsed |= VALIDATE_SLACK;
+        }else if(strcmp(part, "none") != 0){
+            ok = 0;
+        }
+    }
+    free(copy);
+    if(ok) *flags = parsed;
+    return ok;
+}
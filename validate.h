@@ -0,0 +1,31 @@
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <stdint.h>
+
+// what the -R search checks as each cluster is appended to a chain
+#define VALIDATE_FORMAT 0x1         // structure of the format picked by the first cluster's magic
+#define VALIDATE_SLACK 0x2          // bytes past the end of file in the last cluster must be zero
+
+#define VALIDATOR_STATE_SIZE 48
+
+// incremental state, copied per depth so backtracking restores the parent's
+typedef struct validatorState{
+    unsigned char bytes[VALIDATOR_STATE_SIZE];
+} validatorState;
+
+typedef struct chainValidator{
+    const char* name;
+    int (*matches)(const unsigned char* first, int length);     // magic number of the first cluster
+    void (*start)(validatorState* state);
+    int (*feed)(validatorState* state, const unsigned char* data, int length);  // 0 rejects the chain
+} chainValidator;
+
+int parse_validate_flags(const char* text, int* flags);
+const chainValidator* select_validator(const unsigned char* first, int length);
+typedef int (*slack_kernel)(const unsigned char* data, int used, int clusterSize);
+
+int slack_is_clean(const unsigned char* data, int used, int clusterSize);
+slack_kernel select_slack_kernel(int kernel);
+
+#endif